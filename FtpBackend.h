@@ -0,0 +1,103 @@
+/*
+ * FTP Server - selection of the network and file system layers
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * The server only talks to the network and to the file system through the
+ *   names defined here:
+ *     FTP_NET_SERVER  class listening for incoming connections; it must
+ *                     provide stop(), to stop listening until next begin()
+ *     FTP_NET_CLIENT  class of a connected socket (control or data); beside
+ *                     the methods of EthernetClient, it must provide
+ *                     availableForWrite() (as does Ethernet library 2.0),
+ *                     connectStart( ip, port ), which opens a connection
+ *                     without waiting, and connecting(), true while it is
+ *                     being established (see FtpServer.cpp), and
+ *                     remoteIP()
+ *     FTP_FS          object giving access to the file system
+ *     FTP_FILE        class of an open file; beside read/write it must
+ *                     provide seekSet( pos ), preAllocate( size ), which
+ *                     reserves contiguous clusters to an empty file, and
+ *                     truncate( size )
+ *     FTP_DIR         class of an open directory, read by nextFile()
+ *                     until closeDir()
+ *     FTP_LOCAL_IP( client )  IP address of the server, as seen by client
+ *     FTP_CWD_HANDLE  1 if an FTP_FILE opened on a directory can be used as
+ *                     base of relative names, with open( & dir, name, mode )
+ *                     and dir.exists( name ), as SdFat does. Each session
+ *                     then keeps its working directory open. 0 otherwise
+ *     FTP_SENDFILE    1 if FTP_NET_CLIENT provides sendFile( file, size ),
+ *                     which sends bytes of an FTP_FILE from its position
+ *                     without waiting and without copying them through the
+ *                     server (see FtpSession::doSendFile()). 0 by default
+ *
+ * On Arduino they are the Ethernet library and FatLib (which itself selects
+ *   FatFs or SdFat). Elsewhere the POSIX implementation of FtpPosix.h is
+ *   used, so the same server runs as a process on a workstation.
+ *   Another implementation can be given on the command line, as the
+ *   simulated hardware of extras/sim:
+ *     -DFTP_BACKEND_HEADER='"extras/sim/FtpSim.h"'
+ *   This header then defines all the names above.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_BACKEND_H
+#define FTP_BACKEND_H
+
+#if defined( FTP_BACKEND_HEADER )
+
+  #include FTP_BACKEND_HEADER
+
+#elif defined( ARDUINO )
+
+  #include <Ethernet.h>
+  #include <FatLib.h>
+
+  #define FTP_NET_SERVER EthernetServer
+  #define FTP_NET_CLIENT EthernetClient
+  #define FTP_FS         FAT
+  #define FTP_FILE       FAT_FILE
+  #define FTP_DIR        FAT_DIR
+
+  #define FTP_LOCAL_IP( client ) Ethernet.localIP()
+
+  #if FAT_SYST == 0
+    #define FTP_CWD_HANDLE 1
+  #else
+    #define FTP_CWD_HANDLE 0          // FatFs has a single current directory
+  #endif
+
+#else
+
+  #include "FtpPosix.h"
+
+  #define FTP_NET_SERVER PosixServer
+  #define FTP_NET_CLIENT PosixClient
+  #define FTP_FS         POSIX_FS
+  #define FTP_FILE       PosixFile
+  #define FTP_DIR        PosixDir
+
+  #define FTP_LOCAL_IP( client ) ( client ).localIP()
+
+  #define FTP_CWD_HANDLE 1
+
+  #define FTP_SENDFILE   1          // with sendfile() of Linux
+
+#endif
+
+#ifndef FTP_SENDFILE
+  #define FTP_SENDFILE 0
+#endif
+
+#endif // FTP_BACKEND_H
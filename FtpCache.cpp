@@ -0,0 +1,300 @@
+/*
+ * FTP Server - caches of file system information
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FtpServer.h"
+
+#define LIST_ENTRY_HEAD 9             // size of an entry without its name
+
+#if FTP_LIST_CACHE_SLOTS > 0
+
+void FtpListCache::init()
+{
+  for( uint8_t i = 0; i < FTP_LIST_CACHE_SLOTS; i ++ )
+  {
+    slots[ i ].path[ 0 ] = 0;
+    slots[ i ].valid = false;
+    slots[ i ].lastUse = 0;
+    slots[ i ].users = 0;
+  }
+  useCount = 0;
+}
+
+int8_t FtpListCache::find( const char * path )
+{
+  for( uint8_t i = 0; i < FTP_LIST_CACHE_SLOTS; i ++ )
+    if( slots[ i ].valid && ! strcmp( slots[ i ].path, path ) &&
+        millis() - slots[ i ].millisStored < FTP_LIST_CACHE_TTL )
+    {
+      slots[ i ].lastUse = ++ useCount;
+      slots[ i ].users ++;
+      return i;
+    }
+  return -1;
+}
+
+boolean FtpListCache::next( int8_t slot, uint32_t * pos, FtpListEntry * entry )
+{
+  Slot * ps = & slots[ slot ];
+  if( * pos >= ps->used )
+    return false;
+  uint8_t * p = ps->data + * pos;
+  entry->isDir = p[ 0 ];
+  memcpy( & entry->size, p + 1, 4 );
+  memcpy( & entry->modDate, p + 5, 2 );
+  memcpy( & entry->modTime, p + 7, 2 );
+  entry->name = (char *) p + LIST_ENTRY_HEAD;
+  * pos += LIST_ENTRY_HEAD + strlen( entry->name ) + 1;
+  return true;
+}
+
+int8_t FtpListCache::begin( const char * path )
+{
+  if( strlen( path ) >= FTP_CWD_SIZE )
+    return -1;
+  // take the least recently used slot, among those no listing holds
+  int8_t i = -1;
+  for( uint8_t j = 0; j < FTP_LIST_CACHE_SLOTS; j ++ )
+    if( slots[ j ].users == 0 &&
+        ( i < 0 || slots[ j ].lastUse < slots[ i ].lastUse ))
+      i = j;
+  if( i < 0 )
+    return -1;
+  strcpy( slots[ i ].path, path );
+  slots[ i ].valid = false;
+  slots[ i ].used = 0;
+  slots[ i ].lastUse = ++ useCount;
+  slots[ i ].millisStored = millis();
+  slots[ i ].users = 1;
+  return i;
+}
+
+int8_t FtpListCache::add( int8_t slot, FtpListEntry * entry )
+{
+  if( slot < 0 )
+    return -1;
+  Slot *   ps = & slots[ slot ];
+  uint16_t nameLen = strlen( entry->name ) + 1;
+  if( ps->path[ 0 ] == 0 ||
+      ps->used + LIST_ENTRY_HEAD + nameLen > FTP_LIST_CACHE_SIZE )
+  {
+    // too big for the cache (or invalidated while being read)
+    ps->path[ 0 ] = 0;
+    ps->lastUse = 0;
+    ps->users --;
+    return -1;
+  }
+  uint8_t * p = ps->data + ps->used;
+  p[ 0 ] = entry->isDir;
+  memcpy( p + 1, & entry->size, 4 );
+  memcpy( p + 5, & entry->modDate, 2 );
+  memcpy( p + 7, & entry->modTime, 2 );
+  memcpy( p + LIST_ENTRY_HEAD, entry->name, nameLen );
+  ps->used += LIST_ENTRY_HEAD + nameLen;
+  return slot;
+}
+
+void FtpListCache::end( int8_t slot )
+{
+  if( slot >= 0 && slots[ slot ].path[ 0 ] != 0 )
+    slots[ slot ].valid = true;
+  release( slot );
+}
+
+void FtpListCache::release( int8_t slot )
+{
+  if( slot < 0 )
+    return;
+  if( ! slots[ slot ].valid )
+  {
+    slots[ slot ].path[ 0 ] = 0;
+    slots[ slot ].lastUse = 0;
+  }
+  slots[ slot ].users --;
+}
+
+int8_t FtpListCache::lookup( const char * path, FtpListEntry * entry )
+{
+  const char * pSep = strrchr( path, '/' );
+  if( pSep == NULL || pSep[ 1 ] == 0 )
+    return -1;
+  uint16_t lParent = pSep == path ? 1 : pSep - path;
+
+  for( uint8_t i = 0; i < FTP_LIST_CACHE_SLOTS; i ++ )
+    if( slots[ i ].valid && strlen( slots[ i ].path ) == lParent &&
+        ! strncmp( slots[ i ].path, path, lParent ) &&
+        millis() - slots[ i ].millisStored < FTP_LIST_CACHE_TTL )
+    {
+      uint32_t pos = 0;
+      while( next( i, & pos, entry ))
+        if( ! strcmp( entry->name, pSep + 1 ))
+          return 1;
+      return 0;
+    }
+  return -1;
+}
+
+// Drop listing of the directory holding path, and of path itself and
+//   its subdirectories if path is a directory
+
+void FtpListCache::invalidate( const char * path )
+{
+  const char * pSep = strrchr( path, '/' );
+  uint16_t     lParent = pSep == NULL ? 0 : pSep - path;
+  uint16_t     lPath = strlen( path );
+
+  for( uint8_t i = 0; i < FTP_LIST_CACHE_SLOTS; i ++ )
+  {
+    char *   sp = slots[ i ].path;
+    uint16_t l = strlen( sp );
+    boolean  drop = ( l == lParent && ! strncmp( sp, path, l )) ||
+                    ( lParent == 0 && ! strcmp( sp, "/" )) ||
+                    ( l >= lPath && ! strncmp( sp, path, lPath ) &&
+                      ( sp[ lPath ] == 0 || sp[ lPath ] == '/' ));
+    if( l > 0 && drop )
+    {
+      sp[ 0 ] = 0;
+      slots[ i ].valid = false;
+      slots[ i ].lastUse = 0;
+    }
+  }
+}
+
+#else // FTP_LIST_CACHE_SLOTS == 0
+
+void    FtpListCache::init() {}
+int8_t  FtpListCache::find( const char * path ) { return -1; }
+boolean FtpListCache::next( int8_t slot, uint32_t * pos, FtpListEntry * entry )
+          { return false; }
+int8_t  FtpListCache::begin( const char * path ) { return -1; }
+int8_t  FtpListCache::add( int8_t slot, FtpListEntry * entry ) { return -1; }
+void    FtpListCache::end( int8_t slot ) {}
+void    FtpListCache::release( int8_t slot ) {}
+int8_t  FtpListCache::lookup( const char * path, FtpListEntry * entry )
+          { return -1; }
+void    FtpListCache::invalidate( const char * path ) {}
+
+#endif
+
+#if FTP_STAT_CACHE_SLOTS > 0
+
+static uint16_t hashPath( const char * path )
+{
+  uint16_t h = 0;
+  while( * path != 0 )
+    h = h * 31 + (uint8_t) * path ++;
+  return h;
+}
+
+void FtpStatCache::init()
+{
+  for( uint16_t i = 0; i < FTP_STAT_CACHE_SLOTS; i ++ )
+  {
+    slots[ i ].path[ 0 ] = 0;
+    slots[ i ].lastUse = 0;
+  }
+  useCount = 0;
+}
+
+// Return the slot holding path, or -1
+
+int16_t FtpStatCache::search( const char * path, uint16_t hash )
+{
+  for( uint16_t i = 0; i < FTP_STAT_CACHE_SLOTS; i ++ )
+    if( slots[ i ].hash == hash && slots[ i ].path[ 0 ] != 0 &&
+        ! strcmp( slots[ i ].path, path ))
+    {
+      if( millis() - slots[ i ].millisStored < FTP_STAT_CACHE_TTL )
+        return i;
+      slots[ i ].path[ 0 ] = 0;     // too old
+      slots[ i ].lastUse = 0;
+      return -1;
+    }
+  return -1;
+}
+
+boolean FtpStatCache::find( const char * path, FtpStat * st )
+{
+  int16_t i = search( path, hashPath( path ));
+  if( i < 0 )
+    return false;
+  slots[ i ].lastUse = ++ useCount;
+  * st = slots[ i ].st;
+  return true;
+}
+
+void FtpStatCache::store( const char * path, FtpStat * st )
+{
+  if( strlen( path ) >= FTP_CWD_SIZE )
+    return;
+  uint16_t hash = hashPath( path );
+  int16_t  i = search( path, hash );
+  if( i >= 0 )
+  {
+    // keep what was known and is not given now
+    Slot * ps = & slots[ i ];
+    if( ! ( st->flags & FTP_STAT_SIZE ) && ( ps->st.flags & FTP_STAT_SIZE ))
+    {
+      st->flags |= ps->st.flags & ( FTP_STAT_SIZE | FTP_STAT_DIR );
+      st->size = ps->st.size;
+    }
+    if( ! ( st->flags & FTP_STAT_TIME ) && ( ps->st.flags & FTP_STAT_TIME ))
+    {
+      st->flags |= FTP_STAT_TIME;
+      st->modDate = ps->st.modDate;
+      st->modTime = ps->st.modTime;
+    }
+  }
+  else
+  {
+    // take the least recently used slot
+    i = 0;
+    for( uint16_t j = 1; j < FTP_STAT_CACHE_SLOTS; j ++ )
+      if( slots[ j ].lastUse < slots[ i ].lastUse )
+        i = j;
+    strcpy( slots[ i ].path, path );
+    slots[ i ].hash = hash;
+    slots[ i ].millisStored = millis();
+  }
+  slots[ i ].st = * st;
+  slots[ i ].lastUse = ++ useCount;
+}
+
+void FtpStatCache::invalidate( const char * path )
+{
+  uint16_t lPath = strlen( path );
+
+  for( uint16_t i = 0; i < FTP_STAT_CACHE_SLOTS; i ++ )
+  {
+    char * sp = slots[ i ].path;
+    if( sp[ 0 ] != 0 && ! strncmp( sp, path, lPath ) &&
+        ( sp[ lPath ] == 0 || sp[ lPath ] == '/' || lPath == 1 ))
+    {
+      sp[ 0 ] = 0;
+      slots[ i ].lastUse = 0;
+    }
+  }
+}
+
+#else // FTP_STAT_CACHE_SLOTS == 0
+
+void    FtpStatCache::init() {}
+boolean FtpStatCache::find( const char * path, FtpStat * st ) { return false; }
+void    FtpStatCache::store( const char * path, FtpStat * st ) {}
+void    FtpStatCache::invalidate( const char * path ) {}
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * FTP Server - caches of file system information
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Included by FtpServer.h, after the definition of the sizes of names.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_CACHE_H
+#define FTP_CACHE_H
+
+// Number of directory listings kept in memory, and memory reserved for
+//   each of them. A directory whose entries do not fit is not cached
+#ifndef FTP_LIST_CACHE_SLOTS
+  #if defined( __AVR__ )
+    #define FTP_LIST_CACHE_SLOTS 0
+  #elif defined( ARDUINO )
+    #define FTP_LIST_CACHE_SLOTS 2
+  #else
+    #define FTP_LIST_CACHE_SLOTS 8
+  #endif
+#endif
+#ifndef FTP_LIST_CACHE_SIZE
+  #if defined( ARDUINO )
+    #define FTP_LIST_CACHE_SIZE 4096
+  #else
+    #define FTP_LIST_CACHE_SIZE 262144
+  #endif
+#endif
+
+// Listings are also dropped after this time (ms), as the sketch may write
+//   to the card behind the back of the server (see FtpServer::fileChanged())
+#ifndef FTP_LIST_CACHE_TTL
+  #define FTP_LIST_CACHE_TTL 60000
+#endif
+
+// Number of files and directories whose existence, size and time are kept
+//   in memory, so lookups by SIZE, MDTM and others do not read the card
+#ifndef FTP_STAT_CACHE_SLOTS
+  #if defined( __AVR__ )
+    #define FTP_STAT_CACHE_SLOTS 0
+  #elif defined( ARDUINO )
+    #define FTP_STAT_CACHE_SLOTS 16
+  #else
+    #define FTP_STAT_CACHE_SLOTS 256
+  #endif
+#endif
+#ifndef FTP_STAT_CACHE_TTL
+  #define FTP_STAT_CACHE_TTL FTP_LIST_CACHE_TTL
+#endif
+
+// An entry of a directory
+
+struct FtpListEntry
+{
+  char *   name;
+  boolean  isDir;
+  uint32_t size;
+  uint16_t modDate, modTime;
+};
+
+// Listings of the directories most recently read
+//
+// Each listing is stored as a sequence of entries:
+//   flags (1 byte), size (4), date (2), time (2), name terminated by 0
+//
+// A listing is sent over many calls of service(), so the slot it reads or
+//   fills is held from find() or begin() to release(), end() or a failed
+//   add(): it is not given to another listing meanwhile. Invalidated, it
+//   is only no longer found
+
+class FtpListCache
+{
+public:
+  void    init();
+
+  // Return the slot holding the listing of directory path, held, or -1
+  int8_t  find( const char * path );
+  // Read entry at * pos of slot and advance * pos. Return false at the end
+  boolean next( int8_t slot, uint32_t * pos, FtpListEntry * entry );
+
+  // Take a slot to store the listing of path, or return -1 if there is none
+  int8_t  begin( const char * path );
+  // Add an entry to the listing. If it does not fit, the slot is released
+  //   and -1 is returned
+  int8_t  add( int8_t slot, FtpListEntry * entry );
+  // Listing of slot is complete, release it
+  void    end( int8_t slot );
+  // Release slot; a listing not complete is dropped
+  void    release( int8_t slot );
+
+  // Search path in the listing of its directory. Return 1 if found,
+  //   0 if it is not in the listing, -1 if the listing is not in cache
+  int8_t  lookup( const char * path, FtpListEntry * entry );
+
+  // File or directory path has been created, modified or removed
+  void    invalidate( const char * path );
+
+private:
+#if FTP_LIST_CACHE_SLOTS > 0
+  struct Slot
+  {
+    char     path[ FTP_CWD_SIZE ];
+    boolean  valid;                   // listing is complete
+    uint32_t lastUse;
+    uint32_t millisStored;
+    uint32_t used;                    // bytes used in data
+    uint8_t  users;                   // listings reading or filling the slot
+    uint8_t  data[ FTP_LIST_CACHE_SIZE ];
+  };
+
+  Slot     slots[ FTP_LIST_CACHE_SLOTS ];
+  uint32_t useCount;
+#endif
+};
+
+// What is known of a file or directory. Flags tell which fields are valid
+
+#define FTP_STAT_KNOWN  1             // existence is known
+#define FTP_STAT_EXISTS 2
+#define FTP_STAT_SIZE   4             // size and type are known
+#define FTP_STAT_DIR    8
+#define FTP_STAT_TIME   16            // date and time are known
+
+struct FtpStat
+{
+  uint8_t  flags;
+  uint32_t size;
+  uint16_t modDate, modTime;
+};
+
+// Information about the paths most recently looked up
+
+class FtpStatCache
+{
+public:
+  void    init();
+
+  // Copy in * st what is known of path. Return false if nothing is known
+  boolean find( const char * path, FtpStat * st );
+  // Record information about path, keeping what was known before
+  void    store( const char * path, FtpStat * st );
+
+  // Drop information about path and, if it is a directory, its content
+  void    invalidate( const char * path );
+
+private:
+#if FTP_STAT_CACHE_SLOTS > 0
+  int16_t search( const char * path, uint16_t hash );
+
+  struct Slot
+  {
+    char     path[ FTP_CWD_SIZE ];
+    uint16_t hash;                    // of path, to compare it quickly
+    FtpStat  st;
+    uint32_t lastUse;
+    uint32_t millisStored;
+  };
+
+  Slot     slots[ FTP_STAT_CACHE_SLOTS ];
+  uint32_t useCount;
+#endif
+};
+
+#endif // FTP_CACHE_H
@@ -0,0 +1,1141 @@
+/*
+ * FTP Server - deflate compression for MODE Z
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * The compressor searches repeated strings through hash chains, as zlib
+ *   does, and codes each block with the smallest of dynamic Huffman codes,
+ *   fixed codes or no compression. The decompressor decodes one symbol at
+ *   a time and goes back to the beginning of the symbol when compressed
+ *   data is missing, so the stream can be cut anywhere.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FtpServer.h"
+
+#if FTP_ZSTREAMS > 0
+
+#define MIN_MATCH     3
+#define MAX_MATCH     258
+#define MIN_LOOKAHEAD ( MAX_MATCH + MIN_MATCH + 1 )
+#define W_SIZE        ((uint32_t) FTP_DEFLATE_WINDOW )
+#define W_MASK        ( W_SIZE - 1 )
+#define MAX_DIST      ( W_SIZE - MIN_LOOKAHEAD )
+#define HASH_MASK     (( 1 << FTP_DEFLATE_HASH_BITS ) - 1 )
+#define HASH_SHIFT    (( FTP_DEFLATE_HASH_BITS + MIN_MATCH - 1 ) / MIN_MATCH )
+#define TOO_FAR       4096
+#define END_BLOCK     256
+#define I_MASK        ( FTP_INFLATE_WINDOW - 1 )
+
+// States of a stream
+
+#define Z_DEFLATE     0
+#define Z_HEADER      1               // inflate: waiting for zlib header
+#define Z_BLOCK       2               //   for block header
+#define Z_STORED      3               //   copying a stored block
+#define Z_CODES       4               //   decoding a compressed block
+#define Z_TRAILER     5               //   for Adler-32 checksum
+#define Z_DONE        6
+#define Z_ERROR       7
+#define Z_WINDOW      8               // inflate: window of stream too large
+
+static const uint16_t lengthBase[ 29 ] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[ 29 ] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[ 30 ] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+  16385, 24577 };
+static const uint8_t distExtra[ 30 ] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order of the lengths of the code lengths in a dynamic block header
+static const uint8_t clOrder[ 19 ] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Codes of lengths ( - 3 ) and of distances ( - 1, see distCodeOf() )
+static uint8_t lengthCodes[ 256 ];
+static uint8_t distCodes[ 512 ];
+static boolean codesReady = false;
+
+static void initCodes()
+{
+  if( codesReady )
+    return;
+  for( uint8_t c = 0; c < 28; c ++ )
+    for( uint16_t n = 0; n < ( 1 << lengthExtra[ c ] ); n ++ )
+      lengthCodes[ lengthBase[ c ] - 3 + n ] = c;
+  lengthCodes[ 255 ] = 28;
+  uint16_t dist = 0;
+  uint8_t  c;
+  for( c = 0; c < 16; c ++ )
+    for( uint16_t n = 0; n < ( 1 << distExtra[ c ] ); n ++ )
+      distCodes[ dist ++ ] = c;
+  dist >>= 7;
+  for( ; c < 30; c ++ )
+    for( uint16_t n = 0; n < ( 1 << ( distExtra[ c ] - 7 )); n ++ )
+      distCodes[ 256 + dist ++ ] = c;
+  codesReady = true;
+}
+
+static inline uint8_t distCodeOf( uint16_t dist )
+{
+  dist --;
+  return dist < 256 ? distCodes[ dist ] : distCodes[ 256 + ( dist >> 7 )];
+}
+
+// Length of the fixed code of literal/length c
+static inline uint8_t fixedLen( uint16_t c )
+{
+  return c < 144 ? 8 : c < 256 ? 9 : c < 280 ? 7 : 8;
+}
+
+static uint32_t adler32( uint32_t adler, const uint8_t * p, uint32_t n )
+{
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  while( n > 0 )
+  {
+    uint32_t k = n < 5552 ? n : 5552;
+    n -= k;
+    while( k -- > 0 )
+    {
+      s1 += * p ++;
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  return s2 << 16 | s1;
+}
+
+// Compute canonical codes, bit reversed as deflate sends them, of n
+//   symbols of lengths len
+
+static void makeCodes( const uint8_t * len, uint16_t n, uint16_t * code )
+{
+  uint16_t count[ 16 ], next[ 16 ];
+  memset( count, 0, sizeof( count ));
+  for( uint16_t i = 0; i < n; i ++ )
+    count[ len[ i ]] ++;
+  count[ 0 ] = 0;
+  uint16_t c = 0;
+  for( uint8_t bits = 1; bits < 16; bits ++ )
+  {
+    c = ( c + count[ bits - 1 ] ) << 1;
+    next[ bits ] = c;
+  }
+  for( uint16_t i = 0; i < n; i ++ )
+    if( len[ i ] > 0 )
+    {
+      uint16_t v = next[ len[ i ]] ++;
+      uint16_t r = 0;
+      for( uint8_t b = 0; b < len[ i ]; b ++, v >>= 1 )
+        r = r << 1 | ( v & 1 );
+      code[ i ] = r;
+    }
+}
+
+// Build decoding table of n symbols of lengths len (count of codes of each
+//   length, and symbols ordered by code)
+//
+// return:
+//    false if there are more codes than possible
+
+static boolean makeDecoder( const uint16_t * len, uint16_t n,
+                            uint16_t * count, uint16_t * symbol )
+{
+  uint16_t offs[ 16 ];
+  memset( count, 0, 16 * sizeof( uint16_t ));
+  for( uint16_t i = 0; i < n; i ++ )
+    count[ len[ i ]] ++;
+  int32_t left = 1;
+  for( uint8_t bits = 1; bits < 16; bits ++ )
+  {
+    left = ( left << 1 ) - count[ bits ];
+    if( left < 0 )
+      return false;
+  }
+  offs[ 1 ] = 0;
+  for( uint8_t bits = 1; bits < 15; bits ++ )
+    offs[ bits + 1 ] = offs[ bits ] + count[ bits ];
+  for( uint16_t i = 0; i < n; i ++ )
+    if( len[ i ] != 0 )
+      symbol[ offs[ len[ i ]] ++ ] = i;
+  return true;
+}
+
+/*******************************************************************************
+ **                                                                            **
+ **                               COMPRESSION                                  **
+ **                                                                            **
+ *******************************************************************************/
+
+// Parameters of the search of strings for each level: reduce the search
+//   when a match of good length is found, do not search a better match
+//   when one of lazy length is found, stop at nice length, and maximum
+//   length of hash chains followed. Levels 1 to 3 take the first match
+
+static const struct
+{
+  uint16_t good, lazy, nice, chain;
+} configs[ 10 ] = {
+  {  0,   0,   0,    0 },           // 0: store only
+  {  4,   4,   8,    4 },
+  {  4,   5,  16,    8 },
+  {  4,   6,  32,   32 },
+  {  4,   4,  16,   16 },
+  {  8,  16,  32,   32 },
+  {  8,  16, 128,  128 },
+  {  8,  32, 128,  256 },
+  { 32, 128, 258, 1024 },
+  { 32, 258, 258, 4096 } };
+
+void FtpZStream::deflateBegin( uint8_t level )
+{
+  initCodes();
+  this->level = level > 9 ? 9 : level;
+  memset( d.head, 0, sizeof( d.head ));
+  memset( d.prev, 0, sizeof( d.prev ));
+  memset( d.litFreq, 0, sizeof( d.litFreq ));
+  memset( d.distFreq, 0, sizeof( d.distFreq ));
+  d.strStart = 0;
+  d.lookAhead = 0;
+  d.blockStart = 0;
+  d.matchStart = 0;
+  d.matchLength = MIN_MATCH - 1;
+  d.prevLength = MIN_MATCH - 1;
+  d.matchAvailable = false;
+  d.symCount = 0;
+  d.done = false;
+  bitBuf = 0;
+  bitCount = 0;
+  adler = 1;
+  state = Z_DEFLATE;
+  outPos = 0;
+  outLen = 0;
+
+  // zlib header: method, window and level
+  uint8_t wBits = 0;
+  while(( 256UL << wBits ) < W_SIZE )
+    wBits ++;
+  uint16_t header = ( wBits << 4 | 8 ) << 8;
+  header |= ( this->level < 2 ? 0 : this->level < 6 ? 1 : this->level == 6 ? 2 : 3 ) << 6;
+  header += 31 - header % 31;
+  d.out[ outLen ++ ] = header >> 8;
+  d.out[ outLen ++ ] = header;
+}
+
+const uint8_t * FtpZStream::pendingData()
+{
+  return d.out + outPos;
+}
+
+void FtpZStream::take( uint16_t n )
+{
+  outPos += n;
+  if( outPos >= outLen )
+    outPos = outLen = 0;
+}
+
+uint16_t FtpZStream::deflate( const uint8_t * data, uint16_t len )
+{
+  uint16_t taken = 0;
+  while( outPos == outLen )
+  {
+    if( d.lookAhead < MIN_LOOKAHEAD && taken < len )
+    {
+      uint16_t n = len - taken;
+      fill( data + taken, & n );
+      taken += n;
+    }
+    else if( d.lookAhead >= MIN_LOOKAHEAD )
+      compress( false );
+    else
+      break;
+  }
+  return taken;
+}
+
+boolean FtpZStream::deflateEnd()
+{
+  while( outPos == outLen && ! d.done )
+  {
+    if( d.lookAhead > 0 || d.matchAvailable )
+      compress( true );
+    else
+    {
+      flushBlock( true );
+      alignBits();
+      for( int8_t s = 24; s >= 0; s -= 8 )
+        d.out[ outLen ++ ] = adler >> s;
+      d.done = true;
+    }
+  }
+  return d.done && outPos == outLen;
+}
+
+// Append to the window up to * len bytes of data. Return in * len the
+//   number of bytes taken
+
+void FtpZStream::fill( const uint8_t * data, uint16_t * len )
+{
+  if( d.strStart >= W_SIZE + MAX_DIST )
+    slide();
+  uint32_t room = 2 * W_SIZE - d.strStart - d.lookAhead;
+  if( * len > room )
+    * len = room;
+  memcpy( d.win + d.strStart + d.lookAhead, data, * len );
+  adler = adler32( adler, data, * len );
+  d.lookAhead += * len;
+}
+
+// Move the upper half of the window to the lower half
+
+void FtpZStream::slide()
+{
+  memcpy( d.win, d.win + W_SIZE, W_SIZE );
+  d.matchStart = d.matchStart >= W_SIZE ? d.matchStart - W_SIZE : 0;
+  d.strStart -= W_SIZE;
+  d.blockStart -= W_SIZE;
+  for( uint32_t n = 0; n <= HASH_MASK; n ++ )
+    d.head[ n ] = d.head[ n ] >= W_SIZE ? d.head[ n ] - W_SIZE : 0;
+  for( uint32_t n = 0; n < W_SIZE; n ++ )
+    d.prev[ n ] = d.prev[ n ] >= W_SIZE ? d.prev[ n ] - W_SIZE : 0;
+}
+
+// Insert string at pos in its hash chain and return previous head of chain
+
+uint16_t FtpZStream::insert( uint32_t pos )
+{
+  const uint8_t * p = d.win + pos;
+  uint16_t h = (( p[ 0 ] << ( 2 * HASH_SHIFT )) ^ ( p[ 1 ] << HASH_SHIFT ) ^ p[ 2 ] )
+               & HASH_MASK;
+  uint16_t head = d.head[ h ];
+  d.prev[ pos & W_MASK ] = head;
+  d.head[ h ] = pos;
+  return head;
+}
+
+// Search the longest match of the string at strStart along the chain
+//   beginning at cur. Set matchStart and return its length, which is
+//   prevLength if no longer match has been found
+
+uint32_t FtpZStream::longestMatch( uint32_t cur )
+{
+  uint16_t  chain = configs[ level ].chain;
+  uint8_t * scan = d.win + d.strStart;
+  uint32_t  best = d.prevLength;
+  uint32_t  maxLen = d.lookAhead < MAX_MATCH ? d.lookAhead : MAX_MATCH;
+  uint32_t  nice = configs[ level ].nice < maxLen ? configs[ level ].nice : maxLen;
+  uint32_t  limit = d.strStart > MAX_DIST ? d.strStart - MAX_DIST : 0;
+
+  if( best >= maxLen )
+    return maxLen;
+  if( best >= configs[ level ].good )
+    chain >>= 2;
+  do
+  {
+    uint8_t * m = d.win + cur;
+    if( m[ best ] != scan[ best ] || m[ best - 1 ] != scan[ best - 1 ] ||
+        m[ 0 ] != scan[ 0 ] || m[ 1 ] != scan[ 1 ] )
+      continue;
+    uint32_t len = 2;
+    while( len < maxLen && m[ len ] == scan[ len ] )
+      len ++;
+    if( len > best )
+    {
+      d.matchStart = cur;
+      best = len;
+      if( len >= nice )
+        break;
+    }
+  }
+  while(( cur = d.prev[ cur & W_MASK ] ) > limit && -- chain != 0 );
+  return best;
+}
+
+void FtpZStream::tallyLit( uint8_t c )
+{
+  d.symLen[ d.symCount ] = c;
+  d.symDist[ d.symCount ++ ] = 0;
+  d.litFreq[ c ] ++;
+}
+
+void FtpZStream::tallyMatch( uint16_t dist, uint16_t len )
+{
+  d.symLen[ d.symCount ] = len - MIN_MATCH;
+  d.symDist[ d.symCount ++ ] = dist;
+  d.litFreq[ 257 + lengthCodes[ len - MIN_MATCH ]] ++;
+  d.distFreq[ distCodeOf( dist ) ] ++;
+}
+
+boolean FtpZStream::blockFull()
+{
+  return d.symCount == FTP_DEFLATE_SYMS ||
+         (int32_t) d.strStart - d.blockStart >= FTP_DEFLATE_BLOCK;
+}
+
+// Compress the data of the window, until it runs short of data to look
+//   ahead (or is empty if flush is true), or a block has been sent to
+//   the output buffer
+
+void FtpZStream::compress( boolean flush )
+{
+  const uint32_t minLook = flush ? 1 : MIN_LOOKAHEAD;
+
+  if( level == 0 )
+    while( outPos == outLen && d.lookAhead >= minLook )
+    {
+      uint32_t n = FTP_DEFLATE_BLOCK - ( d.strStart - d.blockStart );
+      if( n > d.lookAhead )
+        n = d.lookAhead;
+      d.strStart += n;
+      d.lookAhead -= n;
+      if( blockFull())
+        flushBlock( false );
+    }
+
+  else if( level <= 3 )             // take first match found
+    while( outPos == outLen && d.lookAhead >= minLook )
+    {
+      uint16_t head = d.lookAhead >= MIN_MATCH ? insert( d.strStart ) : 0;
+      d.matchLength = 0;
+      if( head != 0 && d.strStart - head <= MAX_DIST )
+      {
+        d.prevLength = MIN_MATCH - 1;
+        d.matchLength = longestMatch( head );
+      }
+      if( d.matchLength >= MIN_MATCH )
+      {
+        tallyMatch( d.strStart - d.matchStart, d.matchLength );
+        d.lookAhead -= d.matchLength;
+        if( d.matchLength <= configs[ level ].lazy && d.lookAhead >= MIN_MATCH )
+        {
+          while( -- d.matchLength != 0 )
+            insert( ++ d.strStart );
+          d.strStart ++;
+        }
+        else
+          d.strStart += d.matchLength;
+      }
+      else
+      {
+        tallyLit( d.win[ d.strStart ++ ] );
+        d.lookAhead --;
+      }
+      if( blockFull())
+        flushBlock( false );
+    }
+
+  else                              // lazy evaluation of matches
+    while( outPos == outLen )
+    {
+      if( d.lookAhead < minLook )
+      {
+        if( flush && d.matchAvailable )
+        {
+          tallyLit( d.win[ d.strStart - 1 ] );
+          d.matchAvailable = false;
+        }
+        break;
+      }
+      uint16_t head = d.lookAhead >= MIN_MATCH ? insert( d.strStart ) : 0;
+      d.prevLength = d.matchLength;
+      d.prevMatch = d.matchStart;
+      d.matchLength = MIN_MATCH - 1;
+      if( head != 0 && d.prevLength < configs[ level ].lazy &&
+          d.strStart - head <= MAX_DIST )
+      {
+        d.matchLength = longestMatch( head );
+        if( d.matchLength == MIN_MATCH && d.strStart - d.matchStart > TOO_FAR )
+          d.matchLength = MIN_MATCH - 1;
+      }
+      if( d.prevLength >= MIN_MATCH && d.matchLength <= d.prevLength )
+      {
+        // previous match is better: output it
+        uint32_t maxInsert = d.strStart + d.lookAhead - MIN_MATCH;
+        tallyMatch( d.strStart - 1 - d.prevMatch, d.prevLength );
+        d.lookAhead -= d.prevLength - 1;
+        d.prevLength -= 2;
+        do
+          if( ++ d.strStart <= maxInsert )
+            insert( d.strStart );
+        while( -- d.prevLength != 0 );
+        d.matchAvailable = false;
+        d.matchLength = MIN_MATCH - 1;
+        d.strStart ++;
+        if( blockFull())
+          flushBlock( false );
+      }
+      else if( d.matchAvailable )
+      {
+        tallyLit( d.win[ d.strStart - 1 ] );
+        if( blockFull())
+          flushBlock( false );
+        d.strStart ++;
+        d.lookAhead --;
+      }
+      else
+      {
+        d.matchAvailable = true;
+        d.strStart ++;
+        d.lookAhead --;
+      }
+    }
+}
+
+void FtpZStream::putBits( uint16_t value, uint8_t n )
+{
+  bitBuf |= (uint32_t) value << bitCount;
+  bitCount += n;
+  while( bitCount >= 8 )
+  {
+    d.out[ outLen ++ ] = bitBuf;
+    bitBuf >>= 8;
+    bitCount -= 8;
+  }
+}
+
+void FtpZStream::alignBits()
+{
+  if( bitCount > 0 )
+    putBits( 0, 8 - bitCount );
+}
+
+// Compute lengths of the Huffman codes of n symbols of frequencies freq,
+//   limited to maxBits. When the tree is too deep, frequencies are halved
+//   until it fits
+
+void FtpZStream::buildLengths( const uint16_t * freq, uint16_t n, uint8_t maxBits,
+                               uint8_t * len )
+{
+  uint16_t * w = d.weight;
+  uint16_t * parent = d.parent;
+  uint16_t * sorted = d.sorted;
+  uint16_t   used = 0;
+
+  for( uint16_t i = 0; i < n; i ++ )
+    if(( w[ i ] = freq[ i ] ) > 0 )
+      used ++;
+  // a code needs at least 2 symbols
+  for( uint16_t i = 0; i < n && used < 2; i ++ )
+    if( w[ i ] == 0 )
+    {
+      w[ i ] = 1;
+      used ++;
+    }
+
+  for( ;; )
+  {
+    // sort symbols used by weight
+    uint16_t m = 0;
+    for( uint16_t i = 0; i < n; i ++ )
+      if( w[ i ] > 0 )
+      {
+        uint16_t j = m ++;
+        while( j > 0 && w[ sorted[ j - 1 ]] > w[ i ] )
+        {
+          sorted[ j ] = sorted[ j - 1 ];
+          j --;
+        }
+        sorted[ j ] = i;
+      }
+    // merge the two lightest nodes, taken from the sorted symbols or from
+    //   the nodes already built, which are created in order of weight
+    uint16_t iLeaf = 0, iNode = n, nNode = n;
+    while( nNode < n + m - 1 )
+    {
+      uint16_t pair[ 2 ];
+      for( uint8_t k = 0; k < 2; k ++ )
+        if( iLeaf < m && ( iNode == nNode || w[ sorted[ iLeaf ]] <= w[ iNode ] ))
+          pair[ k ] = sorted[ iLeaf ++ ];
+        else
+          pair[ k ] = iNode ++;
+      w[ nNode ] = w[ pair[ 0 ]] + w[ pair[ 1 ]];
+      parent[ pair[ 0 ]] = parent[ pair[ 1 ]] = nNode ++;
+    }
+    // depth of nodes (stored in sorted, which is no more needed)
+    uint16_t * depth = sorted;
+    depth[ nNode - 1 - n ] = 0;
+    for( int16_t k = nNode - 2; k >= (int16_t) n; k -- )
+      depth[ k - n ] = depth[ parent[ k ] - n ] + 1;
+    uint8_t maxLen = 0;
+    for( uint16_t i = 0; i < n; i ++ )
+    {
+      len[ i ] = w[ i ] > 0 ? depth[ parent[ i ] - n ] + 1 : 0;
+      if( len[ i ] > maxLen )
+        maxLen = len[ i ];
+    }
+    if( maxLen <= maxBits )
+      return;
+    for( uint16_t i = 0; i < n; i ++ )
+      w[ i ] = ( w[ i ] + 1 ) >> 1;
+  }
+}
+
+// Run-length encode the code lengths len of n symbols. Count the codes
+//   used if send is false, else send them
+
+void FtpZStream::scanLengths( const uint8_t * len, uint16_t n, boolean send )
+{
+  uint16_t i = 0;
+  while( i < n )
+  {
+    uint8_t  cur = len[ i ];
+    uint16_t run = 1;
+    while( i + run < n && len[ i + run ] == cur )
+      run ++;
+    i += run;
+
+    boolean  repeat = false;          // cur has been sent once
+    while( run > 0 )
+    {
+      uint8_t  sym = cur;
+      uint16_t extra = 0;
+      uint8_t  bits = 0;
+      if( cur == 0 && run >= 11 )
+      {
+        uint16_t r = run < 138 ? run : 138;
+        sym = 18;
+        extra = r - 11;
+        bits = 7;
+        run -= r;
+      }
+      else if( cur == 0 && run >= 3 )
+      {
+        sym = 17;
+        extra = run - 3;
+        bits = 3;
+        run = 0;
+      }
+      else if( repeat && run >= 3 )
+      {
+        uint16_t r = run < 6 ? run : 6;
+        sym = 16;
+        extra = r - 3;
+        bits = 2;
+        run -= r;
+      }
+      else
+      {
+        repeat = cur != 0;
+        run --;
+      }
+      if( ! send )
+      {
+        d.clFreq[ sym ] ++;
+        d.clExtra += bits;
+      }
+      else
+      {
+        putBits( d.clCode[ sym ], d.clLen[ sym ] );
+        if( bits > 0 )
+          putBits( extra, bits );
+      }
+    }
+  }
+}
+
+// Send the symbols of the block with the current codes
+
+void FtpZStream::sendSymbols()
+{
+  for( uint16_t s = 0; s < d.symCount; s ++ )
+  {
+    uint16_t dist = d.symDist[ s ];
+    uint8_t  lc = d.symLen[ s ];
+    if( dist == 0 )
+      putBits( d.litCode[ lc ], d.litLen[ lc ] );
+    else
+    {
+      uint8_t c = lengthCodes[ lc ];
+      putBits( d.litCode[ 257 + c ], d.litLen[ 257 + c ] );
+      if( lengthExtra[ c ] > 0 )
+        putBits( lc + MIN_MATCH - lengthBase[ c ], lengthExtra[ c ] );
+      c = distCodeOf( dist );
+      putBits( d.distCode[ c ], d.distLen[ c ] );
+      if( distExtra[ c ] > 0 )
+        putBits( dist - distBase[ c ], distExtra[ c ] );
+    }
+  }
+  putBits( d.litCode[ END_BLOCK ], d.litLen[ END_BLOCK ] );
+}
+
+// Send the current block to the output buffer, with the smallest of the
+//   3 possible codings
+
+void FtpZStream::flushBlock( boolean last )
+{
+  outPos = outLen = 0;
+  uint32_t bytes = d.strStart - d.blockStart;
+  boolean  canStore = d.blockStart >= 0 && bytes <= 0xffff;
+  uint32_t storedBits = 0xffffffff;
+  uint32_t fixedBits = 0xffffffff;
+  uint32_t dynBits = 0xffffffff;
+  uint16_t hLit = 0, hDist = 0, hCl = 0;
+
+  if( canStore )
+    storedBits = 3 + ( 8 - ( bitCount + 3 ) % 8 ) % 8 + 32 + bytes * 8;
+  if( level > 0 )
+  {
+    d.litFreq[ END_BLOCK ] = 1;
+    uint32_t extra = 0;
+    for( uint8_t c = 0; c < 29; c ++ )
+      extra += (uint32_t) d.litFreq[ 257 + c ] * lengthExtra[ c ];
+    for( uint8_t c = 0; c < 30; c ++ )
+      extra += (uint32_t) d.distFreq[ c ] * distExtra[ c ];
+
+    fixedBits = 3 + extra;
+    for( uint16_t c = 0; c < 286; c ++ )
+      fixedBits += (uint32_t) d.litFreq[ c ] * fixedLen( c );
+    for( uint8_t c = 0; c < 30; c ++ )
+      fixedBits += (uint32_t) d.distFreq[ c ] * 5;
+
+    buildLengths( d.litFreq, 286, 15, d.litLen );
+    buildLengths( d.distFreq, 30, 15, d.distLen );
+    for( hLit = 286; hLit > 257 && d.litLen[ hLit - 1 ] == 0; hLit -- )
+      ;
+    for( hDist = 30; hDist > 1 && d.distLen[ hDist - 1 ] == 0; hDist -- )
+      ;
+    memset( d.clFreq, 0, sizeof( d.clFreq ));
+    d.clExtra = 0;
+    scanLengths( d.litLen, hLit, false );
+    scanLengths( d.distLen, hDist, false );
+    buildLengths( d.clFreq, 19, 7, d.clLen );
+    for( hCl = 19; hCl > 4 && d.clLen[ clOrder[ hCl - 1 ]] == 0; hCl -- )
+      ;
+    dynBits = 3 + 14 + 3 * hCl + d.clExtra + extra;
+    for( uint8_t c = 0; c < 19; c ++ )
+      dynBits += (uint32_t) d.clFreq[ c ] * d.clLen[ c ];
+    for( uint16_t c = 0; c < 286; c ++ )
+      dynBits += (uint32_t) d.litFreq[ c ] * d.litLen[ c ];
+    for( uint8_t c = 0; c < 30; c ++ )
+      dynBits += (uint32_t) d.distFreq[ c ] * d.distLen[ c ];
+  }
+
+  if( storedBits <= fixedBits && storedBits <= dynBits )
+  {
+    putBits( last, 3 );
+    alignBits();
+    putBits( bytes, 16 );
+    putBits( ~ bytes, 16 );
+    memcpy( d.out + outLen, d.win + d.blockStart, bytes );
+    outLen += bytes;
+  }
+  else if( fixedBits <= dynBits )
+  {
+    putBits( last | 1 << 1, 3 );
+    for( uint16_t c = 0; c < 288; c ++ )
+      d.litLen[ c ] = fixedLen( c );
+    for( uint8_t c = 0; c < 30; c ++ )
+      d.distLen[ c ] = 5;
+    makeCodes( d.litLen, 288, d.litCode );
+    makeCodes( d.distLen, 30, d.distCode );
+    sendSymbols();
+  }
+  else
+  {
+    putBits( last | 2 << 1, 3 );
+    putBits( hLit - 257, 5 );
+    putBits( hDist - 1, 5 );
+    putBits( hCl - 4, 4 );
+    for( uint8_t k = 0; k < hCl; k ++ )
+      putBits( d.clLen[ clOrder[ k ]], 3 );
+    makeCodes( d.clLen, 19, d.clCode );
+    makeCodes( d.litLen, 286, d.litCode );
+    makeCodes( d.distLen, 30, d.distCode );
+    scanLengths( d.litLen, hLit, true );
+    scanLengths( d.distLen, hDist, true );
+    sendSymbols();
+  }
+
+  memset( d.litFreq, 0, sizeof( d.litFreq ));
+  memset( d.distFreq, 0, sizeof( d.distFreq ));
+  d.symCount = 0;
+  d.blockStart = d.strStart;
+}
+
+/*******************************************************************************
+ **                                                                            **
+ **                              DECOMPRESSION                                 **
+ **                                                                            **
+ *******************************************************************************/
+
+void FtpZStream::inflateBegin()
+{
+  i.inPos = 0;
+  i.inLen = 0;
+  i.total = 0;
+  i.copyLen = 0;
+  i.storedLeft = 0;
+  i.lastBlock = false;
+  bitBuf = 0;
+  bitCount = 0;
+  adler = 1;
+  state = Z_HEADER;
+  outPos = 0;
+  outLen = 0;
+}
+
+uint8_t * FtpZStream::inflateInput( uint16_t * room )
+{
+  if( state >= Z_DONE )             // ignore what follows the stream
+    i.inPos = i.inLen = 0;
+  else if( i.inPos > 0 )
+  {
+    memmove( i.in, i.in + i.inPos, i.inLen - i.inPos );
+    i.inLen -= i.inPos;
+    i.inPos = 0;
+  }
+  * room = FTP_INFLATE_INPUT - i.inLen;
+  return i.in + i.inLen;
+}
+
+void FtpZStream::inflateInputAdd( uint16_t n )
+{
+  i.inLen += n;
+}
+
+boolean FtpZStream::inflateDone()
+{
+  return state == Z_DONE;
+}
+
+// Make sure that n bits are in bitBuf. Return false if input is missing
+
+boolean FtpZStream::needBits( uint8_t n )
+{
+  while( bitCount < n )
+  {
+    if( i.inPos == i.inLen )
+      return false;
+    bitBuf |= (uint32_t) i.in[ i.inPos ++ ] << bitCount;
+    bitCount += 8;
+  }
+  return true;
+}
+
+uint16_t FtpZStream::getBits( uint8_t n )
+{
+  uint16_t v = bitBuf & (( 1UL << n ) - 1 );
+  bitBuf >>= n;
+  bitCount -= n;
+  return v;
+}
+
+// Decode a symbol with the code given by count and symbol
+//
+// return:
+//    the symbol, -1 if input is missing, -2 if the code is not valid
+
+int16_t FtpZStream::decode( const uint16_t * count, const uint16_t * symbol )
+{
+  int32_t code = 0, first = 0, index = 0;
+  for( uint8_t len = 1; len < 16; len ++ )
+  {
+    if( ! needBits( 1 ))
+      return -1;
+    code |= getBits( 1 );
+    int32_t n = count[ len ];
+    if( code - n < first )
+      return symbol[ index + ( code - first ) ];
+    index += n;
+    first = ( first + n ) << 1;
+    code <<= 1;
+  }
+  return -2;
+}
+
+// Read the codes of a dynamic block
+//
+// return:
+//    1 if done, 0 if input is missing, -1 if they are not valid
+
+int8_t FtpZStream::readTables()
+{
+  if( ! needBits( 14 ))
+    return 0;
+  uint16_t nLit = getBits( 5 ) + 257;
+  uint16_t nDist = getBits( 5 ) + 1;
+  uint8_t  nCl = getBits( 4 ) + 4;
+  if( nLit > 286 || nDist > 30 )
+    return -1;
+  uint16_t * lens = i.lens;
+  for( uint8_t k = 0; k < 19; k ++ )
+    lens[ clOrder[ k ]] = 0;
+  for( uint8_t k = 0; k < nCl; k ++ )
+  {
+    if( ! needBits( 3 ))
+      return 0;
+    lens[ clOrder[ k ]] = getBits( 3 );
+  }
+  // code of the code lengths, built in the table of distances
+  if( ! makeDecoder( lens, 19, i.distCount, i.distSym ))
+    return -1;
+  for( uint16_t k = 0; k < nLit + nDist; )
+  {
+    int16_t sym = decode( i.distCount, i.distSym );
+    if( sym == -1 )
+      return 0;
+    if( sym < 0 )
+      return -1;
+    if( sym < 16 )
+    {
+      lens[ k ++ ] = sym;
+      continue;
+    }
+    uint16_t len = 0, rep;
+    if( sym == 16 )
+    {
+      if( k == 0 )
+        return -1;
+      len = lens[ k - 1 ];
+      if( ! needBits( 2 ))
+        return 0;
+      rep = 3 + getBits( 2 );
+    }
+    else if( sym == 17 )
+    {
+      if( ! needBits( 3 ))
+        return 0;
+      rep = 3 + getBits( 3 );
+    }
+    else
+    {
+      if( ! needBits( 7 ))
+        return 0;
+      rep = 11 + getBits( 7 );
+    }
+    if( k + rep > nLit + nDist )
+      return -1;
+    while( rep -- > 0 )
+      lens[ k ++ ] = len;
+  }
+  if( lens[ END_BLOCK ] == 0 ||
+      ! makeDecoder( lens, nLit, i.litCount, i.litSym ) ||
+      ! makeDecoder( lens + nLit, nDist, i.distCount, i.distSym ))
+    return -1;
+  return 1;
+}
+
+// Decode the next element of the stream, writing decoded bytes at out + * n
+//
+// return:
+//    1 if done, 0 if input is missing, -1 if the stream is not valid,
+//    -2 if its window is larger than FTP_INFLATE_WINDOW
+
+int8_t FtpZStream::step( uint8_t * out, uint16_t * n, uint16_t size )
+{
+  switch( state )
+  {
+    case Z_HEADER:
+    {
+      if( ! needBits( 16 ))
+        return 0;
+      uint16_t cmf = getBits( 8 );
+      uint16_t flg = getBits( 8 );
+      if(( cmf & 15 ) != 8 || ( cmf >> 4 ) > 7 || ( cmf << 8 | flg ) % 31 != 0 ||
+         ( flg & 0x20 ))            // preset dictionary
+        return -1;
+      if(( 256UL << ( cmf >> 4 )) > FTP_INFLATE_WINDOW )
+        return -2;
+      state = Z_BLOCK;
+      return 1;
+    }
+
+    case Z_BLOCK:
+    {
+      if( ! needBits( 3 ))
+        return 0;
+      i.lastBlock = getBits( 1 );
+      uint8_t type = getBits( 2 );
+      if( type == 0 )
+      {
+        getBits( bitCount & 7 );
+        if( ! needBits( 32 ))
+          return 0;
+        uint16_t len = getBits( 16 );
+        if(( getBits( 16 ) ^ 0xffff ) != len )
+          return -1;
+        i.storedLeft = len;
+        state = Z_STORED;
+      }
+      else if( type == 1 )
+      {
+        for( uint16_t c = 0; c < 288; c ++ )
+          i.lens[ c ] = fixedLen( c );
+        for( uint16_t c = 288; c < 288 + 30; c ++ )
+          i.lens[ c ] = 5;
+        makeDecoder( i.lens, 288, i.litCount, i.litSym );
+        makeDecoder( i.lens + 288, 30, i.distCount, i.distSym );
+        state = Z_CODES;
+      }
+      else if( type == 2 )
+      {
+        int8_t r = readTables();
+        if( r <= 0 )
+          return r;
+        state = Z_CODES;
+      }
+      else
+        return -1;
+      return 1;
+    }
+
+    case Z_STORED:
+    {
+      if( i.storedLeft == 0 )
+      {
+        state = i.lastBlock ? Z_TRAILER : Z_BLOCK;
+        return 1;
+      }
+      uint16_t k = 0;
+      // bytes already in bitBuf, then bytes of input
+      while( bitCount >= 8 && i.storedLeft > 0 && * n < size )
+      {
+        uint8_t c = getBits( 8 );
+        i.win[ i.total ++ & I_MASK ] = c;
+        out[ ( * n ) ++ ] = c;
+        i.storedLeft --;
+        k ++;
+      }
+      while( i.inPos < i.inLen && i.storedLeft > 0 && * n < size )
+      {
+        uint8_t c = i.in[ i.inPos ++ ];
+        i.win[ i.total ++ & I_MASK ] = c;
+        out[ ( * n ) ++ ] = c;
+        i.storedLeft --;
+        k ++;
+      }
+      return k > 0 || * n == size ? 1 : 0;
+    }
+
+    case Z_CODES:
+    {
+      int16_t sym = decode( i.litCount, i.litSym );
+      if( sym < 0 )
+        return sym == -1 ? 0 : -1;
+      if( sym < 256 )
+      {
+        i.win[ i.total ++ & I_MASK ] = sym;
+        out[ ( * n ) ++ ] = sym;
+        return 1;
+      }
+      if( sym == END_BLOCK )
+      {
+        state = i.lastBlock ? Z_TRAILER : Z_BLOCK;
+        return 1;
+      }
+      sym -= 257;
+      if( sym >= 29 || ! needBits( lengthExtra[ sym ] ))
+        return sym >= 29 ? -1 : 0;
+      uint16_t len = lengthBase[ sym ] + getBits( lengthExtra[ sym ] );
+      sym = decode( i.distCount, i.distSym );
+      if( sym < 0 )
+        return sym == -1 ? 0 : -1;
+      if( sym >= 30 || ! needBits( distExtra[ sym ] ))
+        return sym >= 30 ? -1 : 0;
+      uint16_t dist = distBase[ sym ] + getBits( distExtra[ sym ] );
+      if( dist > i.total || dist > FTP_INFLATE_WINDOW )
+        return -1;
+      i.copyLen = len;
+      i.copyDist = dist;
+      return 1;
+    }
+
+    case Z_TRAILER:
+    {
+      getBits( bitCount & 7 );
+      if( ! needBits( 32 ))
+        return 0;
+      uint32_t check = 0;
+      for( uint8_t k = 0; k < 4; k ++ )
+        check = check << 8 | getBits( 8 );
+      if( check != adler )
+        return -1;
+      state = Z_DONE;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+int32_t FtpZStream::inflate( uint8_t * out, uint16_t size, boolean last )
+{
+  uint16_t n = 0;
+  uint16_t nAdler = 0;                // bytes of out added to checksum
+
+  while( n < size && state < Z_DONE )
+  {
+    if( i.copyLen > 0 )
+    {
+      while( i.copyLen > 0 && n < size )
+      {
+        uint8_t c = i.win[ ( i.total - i.copyDist ) & I_MASK ];
+        i.win[ i.total ++ & I_MASK ] = c;
+        out[ n ++ ] = c;
+        i.copyLen --;
+      }
+      continue;
+    }
+    if( state == Z_TRAILER )
+    {
+      adler = adler32( adler, out + nAdler, n - nAdler );
+      nAdler = n;
+    }
+    // go back to the beginning of the element if input is missing
+    uint16_t inPos = i.inPos;
+    uint32_t buf = bitBuf;
+    uint8_t  count = bitCount;
+    int8_t   r = step( out, & n, size );
+    if( r == 0 )
+    {
+      i.inPos = inPos;
+      bitBuf = buf;
+      bitCount = count;
+      if( last )
+        state = Z_ERROR;
+      break;
+    }
+    if( r < 0 )
+      state = r == -2 ? Z_WINDOW : Z_ERROR;
+  }
+  if( state == Z_ERROR )
+    return -1;
+  if( state == Z_WINDOW )
+    return -2;
+  if( state < Z_TRAILER )
+    adler = adler32( adler, out + nAdler, n - nAdler );
+  return n;
+}
+
+#else // FTP_ZSTREAMS == 0
+
+void     FtpZStream::deflateBegin( uint8_t level ) {}
+uint16_t FtpZStream::deflate( const uint8_t * data, uint16_t len ) { return len; }
+boolean  FtpZStream::deflateEnd() { return true; }
+const uint8_t * FtpZStream::pendingData() { return NULL; }
+void     FtpZStream::take( uint16_t n ) {}
+void     FtpZStream::inflateBegin() {}
+uint8_t * FtpZStream::inflateInput( uint16_t * room ) { * room = 0; return NULL; }
+void     FtpZStream::inflateInputAdd( uint16_t n ) {}
+int32_t  FtpZStream::inflate( uint8_t * out, uint16_t size, boolean last )
+           { return -1; }
+boolean  FtpZStream::inflateDone() { return false; }
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * FTP Server - deflate compression for MODE Z
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Included by FtpServer.h, after the definition of the number of sessions.
+ *
+ * Data of a transfer in MODE Z is a zlib stream (RFC 1950 and 1951). The
+ *   compressor and the decompressor work in fixed memory, without malloc,
+ *   and a few of them are shared by the sessions.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_DEFLATE_H
+#define FTP_DEFLATE_H
+
+// Number of transfers in MODE Z at the same time (0 disables MODE Z)
+#ifndef FTP_ZSTREAMS
+  #if defined( __AVR__ )
+    #define FTP_ZSTREAMS 0
+  #elif defined( ARDUINO )
+    #define FTP_ZSTREAMS 1
+  #else
+    #define FTP_ZSTREAMS FTP_MAX_SESSIONS
+  #endif
+#endif
+
+// Compression: size of the window where repeated strings are searched
+//   (power of 2, from 1024 to 32768), bits of the hash of strings, and
+//   maximum number of symbols and of bytes in a block
+#ifndef FTP_DEFLATE_WINDOW
+  #if defined( ARDUINO )
+    #define FTP_DEFLATE_WINDOW 2048
+  #else
+    #define FTP_DEFLATE_WINDOW 32768
+  #endif
+#endif
+#ifndef FTP_DEFLATE_HASH_BITS
+  #if defined( ARDUINO )
+    #define FTP_DEFLATE_HASH_BITS 11
+  #else
+    #define FTP_DEFLATE_HASH_BITS 15
+  #endif
+#endif
+#ifndef FTP_DEFLATE_SYMS
+  #define FTP_DEFLATE_SYMS ( FTP_DEFLATE_WINDOW / 2 )
+#endif
+#ifndef FTP_DEFLATE_BLOCK
+  #define FTP_DEFLATE_BLOCK ( FTP_DEFLATE_WINDOW / 2 )
+#endif
+// Default level of compression (0 to 9), as changed by OPTS MODE Z LEVEL
+#ifndef FTP_DEFLATE_LEVEL
+  #define FTP_DEFLATE_LEVEL 6
+#endif
+
+// Decompression: window (power of 2, from 1024 to 32768). Streams whose
+//   zlib header announces a larger window are refused
+#ifndef FTP_INFLATE_WINDOW
+  #if defined( ARDUINO )
+    #define FTP_INFLATE_WINDOW FTP_DEFLATE_WINDOW
+  #else
+    #define FTP_INFLATE_WINDOW 32768
+  #endif
+#endif
+#define FTP_INFLATE_INPUT 1024        // compressed data waiting to be decoded
+
+#if FTP_ZSTREAMS > 0
+  #if FTP_DEFLATE_WINDOW < 1024 || FTP_DEFLATE_WINDOW > 32768
+    #error FTP_DEFLATE_WINDOW must be from 1024 to 32768
+  #endif
+  #if FTP_INFLATE_WINDOW < 1024 || FTP_INFLATE_WINDOW > 32768 || \
+      ( FTP_INFLATE_WINDOW & ( FTP_INFLATE_WINDOW - 1 )) != 0
+    #error FTP_INFLATE_WINDOW must be a power of 2 from 1024 to 32768
+  #endif
+  #if FTP_DEFLATE_BLOCK > FTP_DEFLATE_WINDOW - 262
+    #error FTP_DEFLATE_BLOCK must be less than FTP_DEFLATE_WINDOW - 262
+  #endif
+  #define FTP_FEAT_MODE_Z "MODE Z"
+#else
+  #define FTP_FEAT_MODE_Z NULL
+#endif
+
+#define FTP_DEFLATE_OUT ( FTP_DEFLATE_BLOCK + FTP_DEFLATE_BLOCK / 4 + 1024 )
+
+// A zlib stream, used either to compress or to decompress a transfer
+
+class FtpZStream
+{
+public:
+  // Compression
+  //
+  // Data given to deflate() are compressed to an internal buffer, which
+  //   must be emptied with pending()/pendingData()/take() before deflate()
+  //   accepts more data. deflateEnd() completes the stream; it returns
+  //   true once all of it has been taken
+  void     deflateBegin( uint8_t level );
+  uint16_t deflate( const uint8_t * data, uint16_t len );
+  boolean  deflateEnd();
+  uint16_t pending()                  { return outLen - outPos; }
+  const uint8_t * pendingData();
+  void     take( uint16_t n );
+
+  // Decompression
+  //
+  // Compressed data are written to the buffer returned by inflateInput(),
+  //   then decoded by inflate(), which returns the number of bytes stored
+  //   at out, -1 if the stream is not valid, or -2 if it was made with a
+  //   window larger than FTP_INFLATE_WINDOW. last tells that there is no
+  //   more compressed data to come
+  void     inflateBegin();
+  uint8_t * inflateInput( uint16_t * room );
+  void     inflateInputAdd( uint16_t n );
+  int32_t  inflate( uint8_t * out, uint16_t size, boolean last );
+  boolean  inflateDone();
+
+private:
+#if FTP_ZSTREAMS > 0
+  void     fill( const uint8_t * data, uint16_t * len );
+  void     slide();
+  void     compress( boolean flush );
+  uint16_t insert( uint32_t pos );
+  uint32_t longestMatch( uint32_t cur );
+  void     tallyLit( uint8_t c );
+  void     tallyMatch( uint16_t dist, uint16_t len );
+  boolean  blockFull();
+  void     flushBlock( boolean last );
+  void     buildLengths( const uint16_t * freq, uint16_t n, uint8_t maxBits,
+                         uint8_t * len );
+  void     scanLengths( const uint8_t * len, uint16_t n, boolean send );
+  void     sendSymbols();
+  void     putBits( uint16_t value, uint8_t n );
+  void     alignBits();
+
+  boolean  needBits( uint8_t n );
+  uint16_t getBits( uint8_t n );
+  int16_t  decode( const uint16_t * count, const uint16_t * symbol );
+  int8_t   step( uint8_t * out, uint16_t * n, uint16_t size );
+  int8_t   readTables();
+
+  struct Deflate
+  {
+    uint8_t  win[ 2 * FTP_DEFLATE_WINDOW ];
+    uint16_t prev[ FTP_DEFLATE_WINDOW ];
+    uint16_t head[ 1 << FTP_DEFLATE_HASH_BITS ];
+    uint8_t  symLen[ FTP_DEFLATE_SYMS ];    // literal, or length - 3
+    uint16_t symDist[ FTP_DEFLATE_SYMS ];   // 0 for a literal
+    uint16_t litFreq[ 286 ], distFreq[ 30 ], clFreq[ 19 ];
+    uint8_t  litLen[ 288 ], distLen[ 30 ], clLen[ 19 ];
+    uint16_t litCode[ 288 ], distCode[ 30 ], clCode[ 19 ];
+    uint16_t weight[ 2 * 286 ], parent[ 2 * 286 ], sorted[ 286 ];
+    uint8_t  out[ FTP_DEFLATE_OUT ];
+    uint32_t strStart, lookAhead, matchStart, prevMatch, matchLength, prevLength;
+    int32_t  blockStart;              // negative if no more in window
+    uint16_t symCount;
+    uint32_t clExtra;                 // extra bits of the code lengths
+    boolean  matchAvailable;
+    boolean  done;
+  };
+
+  struct Inflate
+  {
+    uint8_t  win[ FTP_INFLATE_WINDOW ];
+    uint8_t  in[ FTP_INFLATE_INPUT ];
+    uint16_t lens[ 320 ];
+    uint16_t litCount[ 16 ], litSym[ 288 ], distCount[ 16 ], distSym[ 30 ];
+    uint16_t inPos, inLen;
+    uint32_t total;                   // bytes decoded
+    uint16_t copyLen, copyDist;       // string being copied
+    uint16_t storedLeft;
+    boolean  lastBlock;
+  };
+
+  union
+  {
+    Deflate  d;
+    Inflate  i;
+  };
+  uint32_t bitBuf;
+  uint8_t  bitCount;
+  uint8_t  level;
+  uint8_t  state;
+  uint32_t adler;
+#endif
+  uint16_t outPos, outLen;
+};
+
+#endif // FTP_DEFLATE_H
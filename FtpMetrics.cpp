@@ -0,0 +1,82 @@
+/*
+ * FTP Server - counters and histograms of the activity of the server
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FtpServer.h"
+
+static const char * const counterNames[ FTP_M_COUNTERS ] = {
+  "clients", "refused", "login_fails", "timeouts", "transfers", "aborts",
+  "data_fails", "bytes_in", "bytes_out" };
+
+#define FTP_CMD_NAME( name, feat ) #name,
+static const char * const commandNames[] = { FTP_COMMANDS( FTP_CMD_NAME ) "other" };
+#undef FTP_CMD_NAME
+
+static const char * const histNames[ FTP_H_COUNT ] = {
+  "command_us", "connect_ms", "open_us", "rate_kBps" };
+
+void FtpHistogram::init()
+{
+  count = 0;
+  max = 0;
+  for( uint8_t i = 0; i < FTP_H_BUCKETS; i ++ )
+    bucket[ i ] = 0;
+}
+
+uint32_t FtpHistogram::quantile( uint8_t pct ) const
+{
+  // rank of the sample, rounded up
+  uint32_t rank = ( count / 100 ) * pct + (( count % 100 ) * pct + 99 ) / 100;
+  uint32_t n = 0;
+  for( uint8_t b = 0; b < FTP_H_BUCKETS - 1; b ++ )
+  {
+    n += bucket[ b ];
+    if( n >= rank && n > 0 )
+    {
+      uint32_t bound = ( 1UL << b ) - 1;
+      return bound < max ? bound : max;
+    }
+  }
+  return max;
+}
+
+void FtpMetrics::init()
+{
+  #if FTP_METRICS
+    for( uint8_t i = 0; i < FTP_M_COUNTERS; i ++ )
+      counters[ i ] = 0;
+    for( uint8_t i = 0; i <= FTP_CMD_COUNT; i ++ )
+      commands[ i ] = 0;
+    for( uint8_t i = 0; i < FTP_H_COUNT; i ++ )
+      hist[ i ].init();
+  #endif
+}
+
+const char * FtpMetrics::counterName( uint8_t i )
+{
+  return counterNames[ i ];
+}
+
+const char * FtpMetrics::commandName( uint8_t i )
+{
+  return commandNames[ i ];
+}
+
+const char * FtpMetrics::histName( uint8_t i )
+{
+  return histNames[ i ];
+}
@@ -0,0 +1,121 @@
+/*
+ * FTP Server - counters and histograms of the activity of the server
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Included by FtpServer.h, after the table of commands.
+ *
+ * Recording a sample is a few integer operations, so it is done on every
+ *   command and transfer. SITE METRICS dumps everything as text, and a
+ *   sketch reads the same values with FtpServer::getMetrics().
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_METRICS_H
+#define FTP_METRICS_H
+
+// Set to 0 to save the memory of the metrics (about 600 bytes)
+#ifndef FTP_METRICS
+  #if defined( __AVR__ )
+    #define FTP_METRICS 0
+  #else
+    #define FTP_METRICS 1
+  #endif
+#endif
+
+// Counters. They wrap around at 2^32: compute rates from the difference
+//   of two readings
+#define FTP_M_CLIENTS       0     // clients accepted
+#define FTP_M_REFUSED       1     // clients refused, all sessions busy
+#define FTP_M_LOGIN_FAILS   2     // wrong user or password
+#define FTP_M_TIMEOUTS      3     // sessions closed for inactivity
+#define FTP_M_TRANSFERS     4     // transfers completed
+#define FTP_M_ABORTS        5     // transfers aborted
+#define FTP_M_DATA_FAILS    6     // data connections not established
+#define FTP_M_BYTES_IN      7     // bytes received by STOR
+#define FTP_M_BYTES_OUT     8     // bytes sent by RETR and listings
+#define FTP_M_COUNTERS      9
+
+// Histograms
+#define FTP_H_COMMAND       0     // time to execute a command (us)
+#define FTP_H_CONNECT       1     // time to establish data connection (ms)
+#define FTP_H_OPEN          2     // time to open a file (us)
+#define FTP_H_RATE          3     // speed of completed transfers (kbytes/s)
+#define FTP_H_COUNT         4
+
+// Bucket i > 0 counts the values from 2^(i-1) to 2^i - 1, bucket 0 counts
+//   zeros and the last bucket all values above
+#define FTP_H_BUCKETS       24
+
+class FtpHistogram
+{
+public:
+  void     init();
+  void     add( uint32_t v )
+  {
+    uint8_t b = v == 0 ? 0 : sizeof( unsigned long ) * 8 - __builtin_clzl( v );
+    bucket[ b < FTP_H_BUCKETS ? b : FTP_H_BUCKETS - 1 ] ++;
+    count ++;
+    if( v > max )
+      max = v;
+  }
+
+  // Upper bound of the values of the bucket where pct % of the samples
+  //   are reached
+  uint32_t quantile( uint8_t pct ) const;
+
+  uint32_t count;
+  uint32_t max;
+  uint32_t bucket[ FTP_H_BUCKETS ];
+};
+
+class FtpMetrics
+{
+public:
+  void     init();
+  void     inc( uint8_t counter )               { add( counter, 1 ); }
+  void     add( uint8_t counter, uint32_t n )
+  {
+    #if FTP_METRICS
+      counters[ counter ] += n;
+    #endif
+  }
+  // Command of index cmd (FTP_CMD_IDX_xxx, FTP_CMD_COUNT if not known) has
+  //   been executed in us microseconds
+  void     command( uint8_t cmd, uint32_t us )
+  {
+    #if FTP_METRICS
+      commands[ cmd ] ++;
+      hist[ FTP_H_COMMAND ].add( us );
+    #endif
+  }
+  void     sample( uint8_t h, uint32_t v )
+  {
+    #if FTP_METRICS
+      hist[ h ].add( v );
+    #endif
+  }
+
+  static const char * counterName( uint8_t i );
+  static const char * commandName( uint8_t i );
+  static const char * histName( uint8_t i );
+
+  #if FTP_METRICS
+    uint32_t     counters[ FTP_M_COUNTERS ];
+    uint32_t     commands[ FTP_CMD_COUNT + 1 ];
+    FtpHistogram hist[ FTP_H_COUNT ];
+  #endif
+};
+
+#endif // FTP_METRICS_H
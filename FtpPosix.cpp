@@ -0,0 +1,622 @@
+/*
+ * FTP Server - POSIX implementation of the network and file system layers
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Only compiled when FtpServer is not built for an Arduino board, nor with
+ *   another backend (FTP_BACKEND_HEADER).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if ! defined( ARDUINO ) && ! defined( FTP_BACKEND_HEADER )
+
+#include "FtpPosix.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+PosixSerial Serial;
+PosixFs     POSIX_FS;
+
+uint32_t millis()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, & ts );
+  return (uint32_t) ( ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+uint32_t micros()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, & ts );
+  return (uint32_t) ( ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+// Convert a time of the host to FAT date and time
+
+static void fatDateTime( time_t t, uint16_t * pdate, uint16_t * ptime )
+{
+  struct tm tm;
+  localtime_r( & t, & tm );
+  if( tm.tm_year < 80 )
+  {
+    * pdate = ( 1 << 5 ) | 1;       // FAT can not store dates before 1980
+    * ptime = 0;
+    return;
+  }
+  * pdate = (( tm.tm_year - 80 ) << 9 ) | (( tm.tm_mon + 1 ) << 5 ) | tm.tm_mday;
+  * ptime = ( tm.tm_hour << 11 ) | ( tm.tm_min << 5 ) | ( tm.tm_sec >> 1 );
+}
+
+/*******************************************************************************
+ **                                 OUTPUT                                     **
+ *******************************************************************************/
+
+size_t PosixPrint::write( const char * buffer, size_t size )
+{
+  return write((const uint8_t *) buffer, size );
+}
+
+size_t PosixPrint::write( uint8_t c )
+{
+  return write( & c, 1 );
+}
+
+size_t PosixPrint::print( const char * s )
+{
+  return write( s, strlen( s ));
+}
+
+size_t PosixPrint::print( char c )
+{
+  return write((uint8_t) c );
+}
+
+size_t PosixPrint::print( long n )
+{
+  char str[ 12 ];
+  return write( str, sprintf( str, "%ld", n ));
+}
+
+size_t PosixPrint::print( unsigned long n )
+{
+  char str[ 12 ];
+  return write( str, sprintf( str, "%lu", n ));
+}
+
+size_t PosixPrint::println()
+{
+  return write( "\r\n", 2 );
+}
+
+size_t PosixSerial::write( const uint8_t * buffer, size_t size )
+{
+  return fwrite( buffer, 1, size, stdout );
+}
+
+/*******************************************************************************
+ **                                NETWORK                                     **
+ *******************************************************************************/
+
+IPAddress::IPAddress()
+{
+  memset( bytes, 0, 4 );
+}
+
+IPAddress::IPAddress( uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3 )
+{
+  bytes[ 0 ] = b0;
+  bytes[ 1 ] = b1;
+  bytes[ 2 ] = b2;
+  bytes[ 3 ] = b3;
+}
+
+static IPAddress ipOfSockAddr( struct sockaddr_in * sa )
+{
+  uint8_t * b = (uint8_t *) & sa->sin_addr.s_addr;
+  return IPAddress( b[ 0 ], b[ 1 ], b[ 2 ], b[ 3 ] );
+}
+
+PosixClient::PosixClient()
+{
+  fd = -1;
+}
+
+PosixClient::PosixClient( int sock )
+{
+  fd = sock;
+}
+
+// Write what the socket can take without waiting, as the buffer of a
+//   W5x00 chip, so a peer which does not read blocks no other session
+//
+// return:
+//    number of bytes written, which may be less than size
+
+size_t PosixClient::write( const uint8_t * buffer, size_t size )
+{
+  size_t done = 0;
+  while( fd >= 0 && done < size )
+  {
+    ssize_t nb = send( fd, buffer + done, size - done,
+                       MSG_NOSIGNAL | MSG_DONTWAIT );
+    if( nb > 0 )
+      done += nb;
+    else if( nb < 0 && errno == EINTR )
+      continue;
+    else
+      break;
+  }
+  return done;
+}
+
+int PosixClient::available()
+{
+  int nb = 0;
+  if( fd < 0 || ioctl( fd, FIONREAD, & nb ) < 0 )
+    return 0;
+  return nb;
+}
+
+// Free space in the send buffer of the socket
+
+int PosixClient::availableForWrite()
+{
+  int size, queued;
+  socklen_t len = sizeof( size );
+  if( fd < 0 || getsockopt( fd, SOL_SOCKET, SO_SNDBUF, & size, & len ) < 0 ||
+      ioctl( fd, SIOCOUTQ, & queued ) < 0 )
+    return 0;
+  // Linux reports twice the size usable for data
+  size = size / 2 - queued;
+  return size > 0 ? size : 0;
+}
+
+int PosixClient::read()
+{
+  uint8_t c;
+  if( read( & c, 1 ) != 1 )
+    return -1;
+  return c;
+}
+
+int PosixClient::read( uint8_t * buffer, size_t size )
+{
+  if( fd < 0 )
+    return -1;
+  ssize_t nb = recv( fd, buffer, size, MSG_DONTWAIT );
+  return nb > 0 ? nb : -1;
+}
+
+// Socket is connected, or closed by peer with data still to read
+
+uint8_t PosixClient::connected()
+{
+  if( fd < 0 )
+    return 0;
+  if( available() > 0 )
+    return 1;
+  char c;
+  ssize_t nb = recv( fd, & c, 1, MSG_PEEK | MSG_DONTWAIT );
+  if( nb > 0 )
+    return 1;
+  return nb < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR );
+}
+
+int PosixClient::connect( IPAddress ip, uint16_t port )
+{
+  stop();
+  fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if( fd < 0 )
+    return 0;
+  struct sockaddr_in sa;
+  memset( & sa, 0, sizeof( sa ));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons( port );
+  uint8_t * b = (uint8_t *) & sa.sin_addr.s_addr;
+  for( uint8_t i = 0; i < 4; i ++ )
+    b[ i ] = ip[ i ];
+  if( ::connect( fd, (struct sockaddr *) & sa, sizeof( sa )) < 0 )
+  {
+    stop();
+    return 0;
+  }
+  fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+  return 1;
+}
+
+// Begin to open a connection, without waiting for its establishment
+//   (see connecting())
+
+int PosixClient::connectStart( IPAddress ip, uint16_t port )
+{
+  stop();
+  fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+  if( fd < 0 )
+    return 0;
+  struct sockaddr_in sa;
+  memset( & sa, 0, sizeof( sa ));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons( port );
+  uint8_t * b = (uint8_t *) & sa.sin_addr.s_addr;
+  for( uint8_t i = 0; i < 4; i ++ )
+    b[ i ] = ip[ i ];
+  if( ::connect( fd, (struct sockaddr *) & sa, sizeof( sa )) < 0 &&
+      errno != EINPROGRESS )
+  {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+// Return 1 while the connection begun by connectStart() is being
+//   established. If it has failed, the socket is closed
+
+uint8_t PosixClient::connecting()
+{
+  if( fd < 0 )
+    return 0;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  if( poll( & pfd, 1, 0 ) == 0 )
+    return 1;
+  int       err = 0;
+  socklen_t len = sizeof( err );
+  if( getsockopt( fd, SOL_SOCKET, SO_ERROR, & err, & len ) < 0 || err != 0 )
+    stop();
+  return 0;
+}
+
+// Send up to size bytes of file, from its current position, without
+//   waiting and without copying them in user space
+//
+// sendfile() has no MSG_NOSIGNAL, so the program must ignore SIGPIPE, or
+//   a connection closed by the client would kill it
+//
+// return:
+//    number of bytes sent, 0 if the socket can take none now, -1 if
+//    nothing more can be sent (end of file, or connection broken)
+
+int32_t PosixClient::sendFile( PosixFile & file, uint32_t size )
+{
+  if( fd < 0 || file.fd < 0 )
+    return -1;
+  ssize_t nb = ::sendfile( fd, file.fd, NULL, size );
+  if( nb > 0 )
+    return nb;
+  if( nb < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ))
+    return 0;
+  return -1;
+}
+
+void PosixClient::stop()
+{
+  if( fd >= 0 )
+    ::close( fd );
+  fd = -1;
+}
+
+IPAddress PosixClient::localIP()
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof( sa );
+  if( fd < 0 || getsockname( fd, (struct sockaddr *) & sa, & len ) < 0 )
+    return IPAddress();
+  return ipOfSockAddr( & sa );
+}
+
+IPAddress PosixClient::remoteIP()
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof( sa );
+  if( fd < 0 || getpeername( fd, (struct sockaddr *) & sa, & len ) < 0 )
+    return IPAddress();
+  return ipOfSockAddr( & sa );
+}
+
+PosixServer::PosixServer( uint16_t port )
+{
+  this->port = port;
+  fd = -1;
+}
+
+void PosixServer::begin()
+{
+  if( fd >= 0 )
+    return;
+  fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+  if( fd < 0 )
+    return;
+  int on = 1;
+  setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, & on, sizeof( on ));
+  struct sockaddr_in sa;
+  memset( & sa, 0, sizeof( sa ));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons( port );
+  sa.sin_addr.s_addr = htonl( INADDR_ANY );
+  if( bind( fd, (struct sockaddr *) & sa, sizeof( sa )) < 0 ||
+      listen( fd, 8 ) < 0 )
+  {
+    perror( "PosixServer::begin" );
+    ::close( fd );
+    fd = -1;
+  }
+}
+
+void PosixServer::stop()
+{
+  if( fd >= 0 )
+    ::close( fd );
+  fd = -1;
+}
+
+PosixClient PosixServer::connected()
+{
+  if( fd < 0 )
+    return PosixClient();
+  int sock = accept4( fd, NULL, NULL, SOCK_NONBLOCK );
+  if( sock >= 0 )
+  {
+    int on = 1;
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, & on, sizeof( on ));
+  }
+  return PosixClient( sock );
+}
+
+/*******************************************************************************
+ **                              FILE SYSTEM                                   **
+ *******************************************************************************/
+
+PosixFile::PosixFile()
+{
+  fd = -1;
+}
+
+boolean PosixFile::open( const char * path, int mode )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  close();
+  fd = ::open( POSIX_FS.hostPath( hpath, path ), mode, 0644 );
+  return fd >= 0;
+}
+
+// Open path relative to directory dir, which is itself an open file,
+//   without walking again the path of dir
+
+boolean PosixFile::open( PosixFile * dir, const char * path, int mode )
+{
+  close();
+  fd = ::openat( dir->fd, path, mode, 0644 );
+  return fd >= 0;
+}
+
+// This file is a directory. Return true if path, relative to it, exists
+
+boolean PosixFile::exists( const char * path )
+{
+  struct stat st;
+  return fd >= 0 && fstatat( fd, path, & st, 0 ) == 0;
+}
+
+int PosixFile::read( void * buffer, size_t size )
+{
+  return fd < 0 ? -1 : ::read( fd, buffer, size );
+}
+
+int PosixFile::write( const void * buffer, size_t size )
+{
+  return fd < 0 ? -1 : ::write( fd, buffer, size );
+}
+
+boolean PosixFile::seekSet( uint32_t pos )
+{
+  return fd >= 0 && lseek( fd, pos, SEEK_SET ) == (off_t) pos;
+}
+
+boolean PosixFile::preAllocate( uint32_t size )
+{
+  return fd >= 0 && posix_fallocate( fd, 0, size ) == 0;
+}
+
+boolean PosixFile::truncate( uint32_t size )
+{
+  return fd >= 0 && ftruncate( fd, size ) == 0;
+}
+
+void PosixFile::close()
+{
+  if( fd >= 0 )
+    ::close( fd );
+  fd = -1;
+}
+
+uint32_t PosixFile::fileSize()
+{
+  struct stat st;
+  if( fd < 0 || fstat( fd, & st ) < 0 )
+    return 0;
+  return st.st_size;
+}
+
+boolean PosixFile::isDir()
+{
+  struct stat st;
+  return fd >= 0 && fstat( fd, & st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+PosixDir::PosixDir()
+{
+  dir = NULL;
+}
+
+PosixDir::~PosixDir()
+{
+  closeDir();
+}
+
+boolean PosixDir::openDir( const char * path )
+{
+  closeDir();
+  dir = opendir( POSIX_FS.hostPath( this->path, path ));
+  return dir != NULL;
+}
+
+void PosixDir::closeDir()
+{
+  if( dir != NULL )
+    closedir( dir );
+  dir = NULL;
+}
+
+boolean PosixDir::nextFile()
+{
+  struct dirent * de;
+  while( dir != NULL && ( de = readdir( dir )) != NULL )
+  {
+    if( ! strcmp( de->d_name, "." ) || ! strcmp( de->d_name, ".." ))
+      continue;
+    char hpath[ POSIX_PATH_SIZE ];
+    struct stat st;
+    // skip entries whose path doesn't fit, rather than stat a cut one
+    if( snprintf( hpath, POSIX_PATH_SIZE, "%s/%s", path, de->d_name )
+        >= POSIX_PATH_SIZE || stat( hpath, & st ) < 0 )
+      continue;
+    strncpy( name, de->d_name, _MAX_LFN );
+    name[ _MAX_LFN ] = 0;
+    dirEntry = S_ISDIR( st.st_mode );
+    size = dirEntry ? 0 : st.st_size;
+    fatDateTime( st.st_mtime, & modDate, & modTime );
+    return true;
+  }
+  return false;
+}
+
+boolean PosixFs::begin( const char * rootDir )
+{
+  struct stat st;
+  strncpy( root, rootDir, _MAX_LFN );
+  root[ _MAX_LFN ] = 0;
+  // no trailing '/', as paths from the server begin with one
+  uint16_t l = strlen( root );
+  while( l > 0 && root[ l - 1 ] == '/' )
+    root[ -- l ] = 0;
+  return stat( rootDir, & st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+char * PosixFs::hostPath( char * hostPath, const char * path )
+{
+  // a path too long is made empty, so that nothing is found there
+  if( snprintf( hostPath, POSIX_PATH_SIZE, "%s%s%s",
+                root, path[ 0 ] == '/' ? "" : "/", path ) >= POSIX_PATH_SIZE )
+    hostPath[ 0 ] = 0;
+  return hostPath;
+}
+
+boolean PosixFs::exists( const char * path )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  struct stat st;
+  return stat( hostPath( hpath, path ), & st ) == 0;
+}
+
+boolean PosixFs::isDir( const char * path )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  struct stat st;
+  return stat( hostPath( hpath, path ), & st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+boolean PosixFs::remove( const char * path )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  return unlink( hostPath( hpath, path )) == 0;
+}
+
+boolean PosixFs::mkdir( const char * path )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  return ::mkdir( hostPath( hpath, path ), 0755 ) == 0;
+}
+
+boolean PosixFs::rmdir( const char * path )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  return ::rmdir( hostPath( hpath, path )) == 0;
+}
+
+boolean PosixFs::rename( const char * oldPath, const char * newPath )
+{
+  char hold[ POSIX_PATH_SIZE ], hnew[ POSIX_PATH_SIZE ];
+  return ::rename( hostPath( hold, oldPath ), hostPath( hnew, newPath )) == 0;
+}
+
+boolean PosixFs::timeStamp( const char * path, uint16_t year, uint8_t month, uint8_t day,
+                            uint8_t hour, uint8_t minute, uint8_t second )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  struct tm tm;
+  struct utimbuf ut;
+  memset( & tm, 0, sizeof( tm ));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day;
+  tm.tm_hour = hour;
+  tm.tm_min = minute;
+  tm.tm_sec = second;
+  tm.tm_isdst = -1;
+  ut.actime = ut.modtime = mktime( & tm );
+  return utime( hostPath( hpath, path ), & ut ) == 0;
+}
+
+boolean PosixFs::getFileModTime( const char * path, uint16_t * pdate, uint16_t * ptime )
+{
+  char hpath[ POSIX_PATH_SIZE ];
+  struct stat st;
+  if( stat( hostPath( hpath, path ), & st ) < 0 )
+    return false;
+  fatDateTime( st.st_mtime, pdate, ptime );
+  return true;
+}
+
+uint32_t PosixFs::free()
+{
+  struct statvfs sv;
+  if( statvfs( root[ 0 ] ? root : "/", & sv ) < 0 )
+    return 0;
+  return (uint64_t) sv.f_bavail * sv.f_frsize >> 20;
+}
+
+uint32_t PosixFs::capacity()
+{
+  struct statvfs sv;
+  if( statvfs( root[ 0 ] ? root : "/", & sv ) < 0 )
+    return 0;
+  return (uint64_t) sv.f_blocks * sv.f_frsize >> 20;
+}
+
+#endif // ! defined( ARDUINO ) && ! defined( FTP_BACKEND_HEADER )
@@ -0,0 +1,226 @@
+/*
+ * FTP Server - POSIX implementation of the network and file system layers
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Stand-ins for the few pieces of the Arduino core, of the Ethernet library
+ *   and of FatLib used by FtpServer, built on POSIX sockets and files.
+ * Paths received from clients are relative to the directory given to
+ *   POSIX_FS.begin().
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_POSIX_H
+#define FTP_POSIX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+typedef bool boolean;
+
+#define F( s ) s
+
+#ifndef O_READ
+  #define O_READ  O_RDONLY
+#endif
+#ifndef O_WRITE
+  #define O_WRITE O_WRONLY
+#endif
+
+#define _MAX_LFN 255
+#define POSIX_PATH_SIZE ( 2 * _MAX_LFN + 10 ) // root directory + path
+
+uint32_t millis();
+uint32_t micros();
+
+/*******************************************************************************
+ **                                 OUTPUT                                     **
+ *******************************************************************************/
+
+// Minimal equivalent of class Print of the Arduino core
+
+class PosixPrint
+{
+public:
+  virtual size_t write( const uint8_t * buffer, size_t size ) = 0;
+  size_t  write( const char * buffer, size_t size );
+  size_t  write( uint8_t c );
+
+  size_t  print( const char * s );
+  size_t  print( char c );
+  size_t  print( long n );
+  size_t  print( unsigned long n );
+  size_t  print( int n )            { return print((long) n ); }
+  size_t  print( unsigned int n )   { return print((unsigned long) n ); }
+  size_t  print( unsigned char n )  { return print((unsigned long) n ); }
+  size_t  println();
+  template< typename T >
+  size_t  println( T v )            { return print( v ) + println(); }
+};
+
+// Console used for debugging messages
+
+class PosixSerial : public PosixPrint
+{
+public:
+  using   PosixPrint::write;
+  size_t  write( const uint8_t * buffer, size_t size );
+};
+
+extern PosixSerial Serial;
+
+/*******************************************************************************
+ **                                NETWORK                                     **
+ *******************************************************************************/
+
+class IPAddress
+{
+public:
+  IPAddress();
+  IPAddress( uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3 );
+
+  uint8_t   operator[]( int i ) const { return bytes[ i ]; }
+  uint8_t & operator[]( int i )       { return bytes[ i ]; }
+  bool      operator==( const IPAddress & ip ) const
+              { return memcmp( bytes, ip.bytes, 4 ) == 0; }
+
+private:
+  uint8_t bytes[ 4 ];
+};
+
+// A connected TCP socket. As EthernetClient, it is a handle:
+//   copies refer to the same socket, which is closed by stop()
+
+class PosixClient : public PosixPrint
+{
+public:
+  PosixClient();
+  explicit PosixClient( int sock );
+
+  using   PosixPrint::write;
+  size_t  write( const uint8_t * buffer, size_t size );
+  int     available();
+  int     availableForWrite();
+  int     read();
+  int     read( uint8_t * buffer, size_t size );
+  uint8_t connected();
+  int     connect( IPAddress ip, uint16_t port );
+  int     connectStart( IPAddress ip, uint16_t port );
+  uint8_t connecting();
+  int32_t sendFile( class PosixFile & file, uint32_t size );
+  void    stop();
+  IPAddress localIP();
+  IPAddress remoteIP();
+  operator bool() const             { return fd >= 0; }
+
+private:
+  int     fd;
+};
+
+class PosixServer
+{
+public:
+  PosixServer( uint16_t port );
+
+  void    begin();
+  void    stop();                   // stop listening
+  PosixClient connected();          // return each new client once
+
+private:
+  uint16_t port;
+  int      fd;
+};
+
+/*******************************************************************************
+ **                              FILE SYSTEM                                   **
+ *******************************************************************************/
+
+class PosixFile
+{
+public:
+  PosixFile();
+
+  boolean  open( const char * path, int mode = O_READ );
+  boolean  open( PosixFile * dir, const char * path, int mode = O_READ );
+  boolean  exists( const char * path );
+  int      read( void * buffer, size_t size );
+  int      write( const void * buffer, size_t size );
+  boolean  seekSet( uint32_t pos );
+  boolean  preAllocate( uint32_t size );
+  boolean  truncate( uint32_t size );
+  void     close();
+  uint32_t fileSize();
+  boolean  isDir();
+
+private:
+  friend class PosixClient;
+
+  int      fd;
+};
+
+class PosixDir
+{
+public:
+  PosixDir();
+  ~PosixDir();
+
+  boolean  openDir( const char * path );
+  boolean  nextFile();
+  void     closeDir();
+  boolean  isDir()                  { return dirEntry; }
+  uint32_t fileSize()               { return size; }
+  char *   fileName()               { return name; }
+  uint16_t fileModDate()            { return modDate; }
+  uint16_t fileModTime()            { return modTime; }
+
+private:
+  DIR *    dir;
+  char     path[ POSIX_PATH_SIZE ];
+  char     name[ _MAX_LFN + 1 ];
+  boolean  dirEntry;
+  uint32_t size;
+  uint16_t modDate, modTime;
+};
+
+class PosixFs
+{
+public:
+  boolean  begin( const char * rootDir );
+  boolean  exists( const char * path );
+  boolean  isDir( const char * path );
+  boolean  remove( const char * path );
+  boolean  mkdir( const char * path );
+  boolean  rmdir( const char * path );
+  boolean  rename( const char * oldPath, const char * newPath );
+  boolean  timeStamp( const char * path, uint16_t year, uint8_t month, uint8_t day,
+                      uint8_t hour, uint8_t minute, uint8_t second );
+  boolean  getFileModTime( const char * path, uint16_t * pdate, uint16_t * ptime );
+  uint32_t free();                  // free space in MB
+  uint32_t capacity();              // size of the file system in MB
+
+  // Build in hostPath the name of path in the host file system
+  char *   hostPath( char * hostPath, const char * path );
+
+private:
+  char     root[ _MAX_LFN + 1 ];
+};
+
+extern PosixFs POSIX_FS;
+
+#endif // FTP_POSIX_H
@@ -14,14 +14,21 @@
  *
  * Use FatLib to select between FatFs and SdFat
  *
+ * Network and file system are accessed through FtpBackend.h, which also
+ *   allows to run the server on a POSIX host (see FtpPosix.h)
+ *
  * Use Ethernet library with some modifications:
  *   modification for WIZ820io (see http://forum.arduino.cc/index.php?topic=139147.0 
  *     and https://github.com/jbkim/W5200-Arduino-Ethernet-library )
  *   need to add the function EthernetClient EthernetServer::connected()
  *     (see http://forum.arduino.cc/index.php?topic=169165.15 
  *      and http://forum.arduino.cc/index.php?topic=182354.0 )
+ *     This function must return each connected client only once, as the
+ *     server hands every new client over to its own session.
  *     In EthernetServer.h add:
  *           EthernetClient connected();
+ *       and the private member:
+ *           uint16_t _given;
  *     In EthernetServer.cpp add:
  *           EthernetClient EthernetServer::connected()
  *           {
@@ -32,26 +39,70 @@
  *                 EthernetClient client(sock);
  *                 if( client.status() == SnSR::ESTABLISHED ||
  *                     client.status() == SnSR::CLOSE_WAIT )
- *                   return client;
+ *                 {
+ *                   if( ! ( _given & ( 1 << sock )))
+ *                   {
+ *                     _given |= 1 << sock;
+ *                     return client;
+ *                   }
+ *                 }
+ *                 else
+ *                   _given &= ~ ( 1 << sock );
  *               }
  *             return EthernetClient(MAX_SOCK_NUM);
  *           }
+ *   need to add the function void EthernetServer::stop(), which closes the
+ *     listening socket (accept() opens a new one when a client connects),
+ *     so the ports of passive mode do not hold sockets once connected.
+ *     In EthernetServer.h add:
+ *           void stop();
+ *     In EthernetServer.cpp add:
+ *           void EthernetServer::stop()
+ *           {
+ *             for( int sock = 0; sock < MAX_SOCK_NUM; sock++ )
+ *               if( EthernetClass::_server_port[sock] == _port )
+ *               {
+ *                 EthernetClient client(sock);
+ *                 if( client.status() == SnSR::LISTEN )
+ *                   client.stop();
+ *               }
+ *           }
+ *   need to add to EthernetClient the functions connectStart() and
+ *     connecting(), so the server is not blocked while an active mode data
+ *     connection is being established.
+ *     In EthernetClient.h add:
+ *           int connectStart(IPAddress ip, uint16_t port);
+ *           uint8_t connecting();
+ *     In EthernetClient.cpp add a copy of connect(IPAddress, uint16_t)
+ *       named connectStart, without its last loop waiting for the
+ *       ESTABLISHED status, and:
+ *           uint8_t EthernetClient::connecting()
+ *           {
+ *             uint8_t s = status();
+ *             return _sock != MAX_SOCK_NUM &&
+ *                    ( s == SnSR::INIT || s == SnSR::SYNSENT );
+ *           }
  * 
  * Commands implemented: 
  *   USER, PASS
  *   CDUP, CWD, QUIT
  *   MODE, STRU, TYPE
+ *   OPTS MODE Z
  *   PASV, PORT
- *   ABOR
+ *   ABOR, ALLO
  *   DELE
  *   LIST, MLSD, NLST
  *   NOOP, PWD
- *   RETR, STOR
+ *   REST, RETR, STOR
  *   MKD,  RMD
  *   RNTO, RNFR
  *   MDTM
  *   FEAT, SIZE
- *   SITE FREE
+ *   SITE FREE, SITE TRACE, SITE METRICS, SITE RATE
+ *
+ * Several clients are served at the same time (see FTP_MAX_SESSIONS)
+ *
+ * MODE Z compresses transfers with deflate (see FtpDeflate.h)
  *
  * Tested with those clients:
  *   under Windows:
@@ -79,904 +130,2297 @@
 
 #include "FtpServer.h"
 
-EthernetServer ftpServer( FTP_CTRL_PORT );
-EthernetServer dataServer( FTP_DATA_PORT_PASV );
+// Longest line of a listing: MLSD facts, name and end of line
+#define LIST_LINE_MAX ( _MAX_LFN + 64 )
+
+// Fast formatting of listings, without sprintf()
+//
+// Each function writes at p and returns the pointer after what was written
+
+static char * putStr( char * p, const char * s )
+{
+  while( * s )
+    * p ++ = * s ++;
+  return p;
+}
+
+static char * putUInt( char * p, uint32_t n )
+{
+  char    digits[ 10 ];
+  uint8_t i = 0;
+  do
+  {
+    digits[ i ++ ] = '0' + n % 10;
+    n /= 10;
+  }
+  while( n > 0 );
+  while( i > 0 )
+    * p ++ = digits[ -- i ];
+  return p;
+}
+
+static char * put2Digits( char * p, uint8_t n )
+{
+  p[ 0 ] = '0' + n / 10;
+  p[ 1 ] = '0' + n % 10;
+  return p + 2;
+}
+
+// Lines of the reply to FEAT, taken from the table of commands
+#define FTP_CMD_FEATURE( name, feat ) feat,
+static const char * const features[] = { FTP_COMMANDS( FTP_CMD_FEATURE ) };
+#undef FTP_CMD_FEATURE
+
+// Names of the ends of transfers in SITE TRACE, indexed by FTP_TRACE_xxx
+static const char * const traceResults[] = {
+  "ok", "aborted", "no-data-connection", "closed-by-client", "file-error",
+  "bad-compressed-data", "client-gone" };
+
+FTP_NET_SERVER ftpServer( FTP_CTRL_PORT );
+
+/*******************************************************************************
+ **                                                                            **
+ **                                  REPLIES                                   **
+ **                                                                            **
+ *******************************************************************************/
+
+FtpReply::FtpReply()
+{
+  len = 0;
+}
+
+FtpReply & FtpReply::add( const char * s )
+{
+  while( * s && len < FTP_REPLY_SIZE )
+    text[ len ++ ] = * s ++;
+  return * this;
+}
+
+FtpReply & FtpReply::add( uint32_t n )
+{
+  char str[ 11 ];
+  * putUInt( str, n ) = 0;
+  return add( str );
+}
+
+// Send the reply with a single write, so it goes in one segment
+//
+// What the client does not take now is kept, and sent first by the next
+//   call, so a client which does not read its replies blocks nobody
+//
+// return:
+//    true if the whole reply has been sent
+
+boolean FtpReply::send( FTP_NET_CLIENT & client )
+{
+  if( len == 0 )
+    return true;
+  if( len == FTP_REPLY_SIZE )        // too long, end the truncated line
+  {
+    text[ len - 2 ] = '\r';
+    text[ len - 1 ] = '\n';
+  }
+  uint16_t nb = client.write((uint8_t *) text, len );
+  if( nb < len )
+    memmove( text, text + nb, len - nb );
+  len -= nb;
+  return len == 0;
+}
+
+void FtpReply::clear()
+{
+  len = 0;
+}
+
+/*******************************************************************************
+ **                                                                            **
+ **                              RATE LIMITS                                   **
+ **                                                                            **
+ *******************************************************************************/
+
+void FtpRateLimit::set( uint32_t bytesPerSec )
+{
+  rate = bytesPerSec;
+  tokens = 0;
+  fraction = 0;
+  millisLast = millis();
+}
+
+uint32_t FtpRateLimit::allowed( uint32_t max )
+{
+  if( rate == 0 )
+    return max;
+  // at least a full segment, so slow transfers are not cut in small ones
+  uint32_t burst = (uint64_t) rate * FTP_RATE_BURST_MS / 1000;
+  if( burst < FTP_MSS )
+    burst = FTP_MSS;
+  uint32_t ms = millis() - millisLast;
+  millisLast += ms;
+  uint64_t add = (uint64_t) ms * rate + fraction;
+  if( tokens + add / 1000 >= burst )
+  {
+    tokens = burst;
+    fraction = 0;
+  }
+  else
+  {
+    tokens += add / 1000;
+    fraction = add % 1000;
+  }
+  return tokens < max ? tokens : max;
+}
+
+void FtpRateLimit::take( uint32_t n )
+{
+  if( rate > 0 )
+    tokens = n < tokens ? tokens - n : 0;
+}
+
+/*******************************************************************************
+ **                                                                            **
+ **                                  SERVER                                    **
+ **                                                                            **
+ *******************************************************************************/
+
+FtpServer::FtpServer()
+{
+  for( uint16_t i = 0; i < FTP_PASV_PORTS; i ++ )
+  {
+    pasvServers[ i ] = NULL;
+    pasvBusy[ i ] = false;
+  }
+}
 
 void FtpServer::init()
 {
   // Tells the ftp server to begin listening for incoming connection
   ftpServer.begin();
-  dataServer.begin();
+  // listeners are made by the first call only; later calls close them
+  for( uint16_t i = 0; i < FTP_PASV_PORTS; i ++ )
+  {
+    if( pasvServers[ i ] == NULL )
+      pasvServers[ i ] = new FTP_NET_SERVER( FTP_DATA_PORT_PASV + i );
+    else if( pasvBusy[ i ] )
+      pasvServers[ i ]->stop();
+    pasvBusy[ i ] = false;
+  }
+  pasvNext = 0;
   millisTimeOut = ( uint32_t ) FTP_TIME_OUT * 60 * 1000;
+  alignedWrites = 0;
+  partialWrites = 0;
+  traceCount = 0;
+  metrics.init();
+  rateAll[ FTP_DOWN ].set( FTP_RATE_DOWN );
+  rateAll[ FTP_UP ].set( FTP_RATE_UP );
+  rateSession[ FTP_DOWN ] = FTP_RATE_SESSION_DOWN;
+  rateSession[ FTP_UP ] = FTP_RATE_SESSION_UP;
+  listCache.init();
+  statCache.init();
+  for( uint8_t i = 0; i < FTP_BUF_POOL; i ++ )
+    bufBusy[ i ] = false;
+  #if FTP_RNFR_SLOTS > 0
+    for( uint8_t i = 0; i < FTP_RNFR_SLOTS; i ++ )
+      rnfrBusy[ i ] = false;
+  #endif
+  #if FTP_ZSTREAMS > 0
+    for( uint8_t i = 0; i < FTP_ZSTREAMS; i ++ )
+      zBusy[ i ] = false;
+  #endif
+  for( uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++ )
+    sessions[ i ].init( this, i );
+  iSession = 0;
+}
+
+void FtpServer::service()
+{
+  serviceSessions();
+}
+
+// Serve sessions during budget microseconds at most
+//
+// Sessions are served repeatedly, as long as they make progress, so that
+//   transfers go on at full speed when the caller has time to spare
+//
+// return:
+//    number of microseconds used
+
+uint32_t FtpServer::service( uint32_t budget )
+{
+  uint32_t start = micros();
+  uint32_t used;
+
+  do
+  {
+    boolean progress = serviceSessions();
+    used = micros() - start;
+    if( ! progress )
+      break;
+  }
+  while( used < budget );
+  return used;
+}
+
+// Serve each session once
+//
+// return:
+//    true if something was done (command, transfer, new client...)
+
+boolean FtpServer::serviceSessions()
+{
+  boolean progress = false;
+
+  // Hand a newly connected client over to a free session
+  FTP_NET_CLIENT newClient = ftpServer.connected();
+  if( newClient )
+  {
+    FtpSession * pSession = freeSession();
+    if( pSession != NULL )
+    {
+      metrics.inc( FTP_M_CLIENTS );
+      pSession->begin( newClient );
+    }
+    else
+    {
+      metrics.inc( FTP_M_REFUSED );
+      newClient.print("421 Too many users, try again later\r\n");
+      newClient.stop();
+    }
+    progress = true;
+  }
+
+  // Serve every session once, starting with a different one at each call
+  for( uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++ )
+    if( sessions[ ( iSession + i ) % FTP_MAX_SESSIONS ].service())
+      progress = true;
+  iSession = ( iSession + 1 ) % FTP_MAX_SESSIONS;
+  return progress;
+}
+
+void FtpServer::fileChanged( const char * path )
+{
+  invalidate( path );
+}
+
+// Forget what the caches know about path
+
+void FtpServer::invalidate( const char * path )
+{
+  listCache.invalidate( path );
+  statCache.invalidate( path );
+}
+
+// Keep the trace of a transfer, in place of the oldest one
+
+void FtpServer::traceAdd( const FtpTrace * t )
+{
+  #if FTP_TRACE_SLOTS > 0
+    traces[ traceCount % FTP_TRACE_SLOTS ] = * t;
+  #endif
+  traceCount ++;
+}
+
+boolean FtpServer::getTrace( uint16_t n, FtpTrace * t )
+{
+  #if FTP_TRACE_SLOTS > 0
+    if( n < FTP_TRACE_SLOTS && n < traceCount )
+    {
+      * t = traces[ ( traceCount - 1 - n ) % FTP_TRACE_SLOTS ];
+      return true;
+    }
+  #endif
+  return false;
+}
+
+// Give a stream for a transfer in MODE Z
+//
+// return:
+//    the stream, or NULL if they are all in use
+
+FtpZStream * FtpServer::zTake()
+{
+  #if FTP_ZSTREAMS > 0
+    for( uint8_t i = 0; i < FTP_ZSTREAMS; i ++ )
+      if( ! zBusy[ i ] )
+      {
+        zBusy[ i ] = true;
+        return & zStreams[ i ];
+      }
+  #endif
+  return NULL;
+}
+
+void FtpServer::zRelease( FtpZStream * zs )
+{
+  #if FTP_ZSTREAMS > 0
+    if( zs != NULL )
+      zBusy[ zs - zStreams ] = false;
+  #endif
+}
+
+// Give a buffer of FTP_XFER_SIZE bytes for a transfer
+//
+// return:
+//    the buffer, or NULL if they are all in use
+
+char * FtpServer::bufTake()
+{
+  for( uint8_t i = 0; i < FTP_BUF_POOL; i ++ )
+    if( ! bufBusy[ i ] )
+    {
+      bufBusy[ i ] = true;
+      return bufPool[ i ];
+    }
+  return NULL;
+}
+
+void FtpServer::bufRelease( char * buf )
+{
+  if( buf != NULL )
+    bufBusy[ ( buf - bufPool[ 0 ] ) / sizeof( bufPool[ 0 ] )] = false;
+}
+
+#if FTP_RNFR_SLOTS > 0
+
+// Give a slot of FTP_CWD_SIZE bytes for the path of RNFR
+//
+// return:
+//    the slot, or NULL if they are all in use
+
+char * FtpServer::rnfrTake()
+{
+  for( uint8_t i = 0; i < FTP_RNFR_SLOTS; i ++ )
+    if( ! rnfrBusy[ i ] )
+    {
+      rnfrBusy[ i ] = true;
+      return rnfrSlots[ i ];
+    }
+  return NULL;
+}
+
+void FtpServer::rnfrRelease( char * path )
+{
+  if( path != NULL )
+    rnfrBusy[ ( path - rnfrSlots[ 0 ] ) / sizeof( rnfrSlots[ 0 ] )] = false;
+}
+
+#endif
+
+// Give a port of passive mode, not used by another session and, if
+//   possible, not used recently
+//
+// return:
+//    index of the port, or -1 if they are all in use
+
+int16_t FtpServer::pasvTake()
+{
+  for( uint16_t n = 0; n < FTP_PASV_PORTS; n ++ )
+  {
+    uint16_t i = pasvNext;
+    pasvNext = ( pasvNext + 1 ) % FTP_PASV_PORTS;
+    if( ! pasvBusy[ i ] )
+    {
+      pasvBusy[ i ] = true;
+      pasvServers[ i ]->begin();
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Stop listening on port i and make it available again
+
+void FtpServer::pasvRelease( int16_t i )
+{
+  if( i < 0 )
+    return;
+  pasvServers[ i ]->stop();
+  pasvBusy[ i ] = false;
+}
+
+void FtpServer::setRateLimits( uint32_t down, uint32_t up,
+                               uint32_t sessionDown, uint32_t sessionUp )
+{
+  setRate( FTP_DOWN, false, down );
+  setRate( FTP_UP, false, up );
+  setRate( FTP_DOWN, true, sessionDown );
+  setRate( FTP_UP, true, sessionUp );
+}
+
+// Set the limit of all transfers in direction dir, or of the transfers of
+//   each session
+
+void FtpServer::setRate( uint8_t dir, boolean perSession, uint32_t bytesPerSec )
+{
+  if( ! perSession )
+    rateAll[ dir ].set( bytesPerSec );
+  else
+  {
+    rateSession[ dir ] = bytesPerSec;
+    for( uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++ )
+      sessions[ i ].setRate( dir, bytesPerSec );
+  }
+}
+
+FtpSession * FtpServer::freeSession()
+{
+  for( uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++ )
+    if( sessions[ i ].isFree())
+      return & sessions[ i ];
+  return NULL;
+}
+
+void FtpSession::init( FtpServer * pServer, uint8_t num )
+{
+  server = pServer;
+  sessionNum = num;
   millisDelay = 0;
   cmdStatus = 0;
+  pasvPort = -1;
+  zs = NULL;
+  buf = NULL;
+  rnfrPath = NULL;
+  listSlot = -1;
+  setRate( FTP_DOWN, server->rateSession[ FTP_DOWN ] );
+  setRate( FTP_UP, server->rateSession[ FTP_UP ] );
   iniVariables();
 }
 
-void FtpServer::iniVariables()
+void FtpSession::iniVariables()
 {
   // Default for data port
   dataPort = FTP_DATA_PORT_DFLT;
   
   // Default Data connection is Active
   dataPassiveConn = false;
+  pasvClose();
+
+  transferMode = 'S';
+  transferType = 'I';
+  zLevel = FTP_DEFLATE_LEVEL;
+  zClose();
+  bufClose();
   
   // Set the root directory
+  #if FTP_CWD_HANDLE
+    cwdDir.close();
+  #endif
+  cwdOpen = false;
   strcpy( cwdName, "/" );
+  cwdLen = 1;
 
-  rnfrCmd = false;
+  rnfrClose();
   transferStatus = 0;
+  allocSize = 0;
+  preAllocated = false;
+  restartPos = 0;
 }
 
-void FtpServer::service()
+boolean FtpSession::isFree()
+{
+  return cmdStatus == 2;
+}
+
+// Start a session with a client accepted by the server
+
+void FtpSession::begin( FTP_NET_CLIENT & newClient )
+{
+  client = newClient;
+  clientConnected();
+  millisEndConnection = millis() + 10 * 1000 ; // wait client id during 10 s.
+  cmdStatus = 3;
+}
+
+// Serve the session: read command, transfer a buffer...
+//
+// return:
+//    true if something was done
+
+boolean FtpSession::service()
 {
   if((int32_t) ( millisDelay - millis() ) > 0 )
-    return;
+    return false;
 
+  boolean progress = true;
   if( cmdStatus == 0 )
   {
     if( client.connected())
       disconnectClient();
     cmdStatus = 1;
   }
-  else if( cmdStatus == 1 )         // Ftp server waiting for connection
+  else if( cmdStatus == 1 )         // Session is released
   {
-    abortTransfer();
+    abortTransfer( FTP_TRACE_CLIENT );
+    client.stop();
     iniVariables();
     #ifdef FTP_DEBUG
-      Serial.print(F("Ftp server waiting for connection on port "));
+      Serial.print(F("Ftp session "));
+      Serial.print(sessionNum);
+      Serial.print(F(" waiting for connection on port "));
       Serial.println(FTP_CTRL_PORT);
     #endif
     cmdStatus = 2;
   }
-  else if( cmdStatus == 2 )         // Ftp server idle
+  else if( cmdStatus == 2 )         // Session idle, waiting for a client
+    return false;
+  else
   {
-    client = ftpServer.connected();
-    if( client > 0 )                // A client connected
+    // execute all commands received, in order; none while the reply to
+    //   the previous one is not sent
+    int8_t rc;
+    progress = false;
+    while( reply.send( client ) && ( rc = readLine()) != -1 )
     {
-      clientConnected();      
-      millisEndConnection = millis() + 10 * 1000 ; // wait client id during 10 s.
-      cmdStatus = 3;
-    }
-  }
-  else if( readChar() > 0 )         // got response
-  {
-    if( cmdStatus == 3 )            // Ftp server waiting for user identity
-      if( userIdentity() )
-        cmdStatus = 4;
-      else
-        cmdStatus = 0;
-    else if( cmdStatus == 4 )       // Ftp server waiting for user registration
-      if( userPassword() )
+      // during a transfer, only ABOR, and NOOP once the transfer has
+      //   begun, are executed; other commands wait for its end
+      if( rc > 0 && cmdStatus == 5 && transferStatus > 0 &&
+          verb != FTP_VERB( "ABOR" ) &&
+          ( verb != FTP_VERB( "NOOP" ) || transferStatus == 3 ))
       {
-        cmdStatus = 5;
-        millisEndConnection = millis() + millisTimeOut;
+        lineHeld = true;
+        if( ! takeAbort())
+          break;
+        // ABOR received after the held line runs first, and ends the
+        //   transfer; the held line is returned again by readLine()
+        uint32_t heldVerb = verb;
+        char *   heldParameters = parameters;
+        verb = FTP_VERB( "ABOR" );
+        parameters = heldParameters + strlen( heldParameters );
+        processCommand();
+        verb = heldVerb;
+        parameters = heldParameters;
+        progress = true;
+        continue;
       }
-      else
-        cmdStatus = 0;
-    else if( cmdStatus == 5 )       // Ftp server waiting for user command
-      if( ! processCommand())
-        cmdStatus = 0;
-      else
-        millisEndConnection = millis() + millisTimeOut;
+      progress = true;
+      if( rc > 0 )                  // got response
+      {
+        if( cmdStatus == 3 )        // Ftp server waiting for user identity
+          if( userIdentity() )
+            cmdStatus = 4;
+          else
+            cmdStatus = 0;
+        else if( cmdStatus == 4 )   // Ftp server waiting for user registration
+          if( userPassword() )
+          {
+            cmdStatus = 5;
+            millisEndConnection = millis() + server->millisTimeOut;
+          }
+          else
+            cmdStatus = 0;
+        else if( cmdStatus == 5 )   // Ftp server waiting for user command
+          if( ! processCommand())
+            cmdStatus = 0;
+          else
+            millisEndConnection = millis() + server->millisTimeOut;
+      }
+      reply.send( client );
+      if( cmdStatus < 3 )           // session closed
+        break;
+    }
+    if( ! progress && ! client.connected() )
+    {
+      cmdStatus = 1;
+      progress = true;
+    }
   }
-  else if( ! client.connected() )
-    cmdStatus = 1;
 
-  if( transferStatus == 1 )         // Retrieve data
+  uint32_t bytesBefore = bytesTransfered;
+  uint8_t  bufBefore = bufCount;
+  uint16_t posBefore = bufPos;
+  uint16_t lenBefore = bufLen[ 0 ];
+  uint32_t fileBefore = filePos;
+  if( transferStatus == 3 )         // Wait for data connection
+  {
+    if( ! dataWait())
+      progress = true;
+  }
+  else if( transferStatus == 1 )    // Retrieve data
   {
     if( ! doRetrieve())
       transferStatus = 0;
+    else if( bufCount == bufBefore && bufPos == posBefore &&
+             bytesTransfered == bytesBefore )
+      trace.idleLoops ++;
+    progress = progress || transferStatus == 0 || bufCount != bufBefore ||
+               bufPos != posBefore || bytesTransfered != bytesBefore;
   }
   else if( transferStatus == 2 )    // Store data
   {
     if( ! doStore())
       transferStatus = 0;
+    else if( filePos == fileBefore && bytesTransfered == bytesBefore )
+      trace.idleLoops ++;
+    progress = progress || transferStatus == 0 || filePos != fileBefore ||
+               bytesTransfered != bytesBefore;
+  }
+  else if( transferStatus == 4 )    // Send listing
+  {
+    if( ! doSendList())
+      transferStatus = 0;
+    else if( bufPos == posBefore && bufLen[ 0 ] == lenBefore &&
+             bytesTransfered == bytesBefore )
+      trace.idleLoops ++;
+    progress = progress || transferStatus == 0 || bufPos != posBefore ||
+               bufLen[ 0 ] != lenBefore || bytesTransfered != bytesBefore;
   }
   else if( cmdStatus > 2 && ! ((int32_t) ( millisEndConnection - millis() ) > 0 ))
   {
-    client.print("530 Timeout\r\n");
+    reply.add("530 Timeout\r\n");
+    server->metrics.inc( FTP_M_TIMEOUTS );
     millisDelay = millis() + 200;    // delay of 200 ms
     cmdStatus = 0;
+    progress = true;
   }
+  reply.send( client );
+  return progress;
 }
 
-void FtpServer::clientConnected()
+void FtpSession::clientConnected()
 {
   #ifdef FTP_DEBUG
-    Serial.println(F("Client connected!"));
+    Serial.print(F("Client connected to session "));
+    Serial.println(sessionNum);
   #endif
-  client.print("220--- Welcome to FTP for Arduino ---\r\n");
-  client.print("220---   By Jean-Michel Gallego   ---\r\n");
-  client.print("220 --   Version ");
-  client.print("FTP_SERVER_VERSION");
-  client.print("   --\r\n");
+  reply.clear();                    // left unsent to the previous client
+  reply.add("220--- Welcome to FTP for Arduino ---\r\n");
+  reply.add("220---   By Jean-Michel Gallego   ---\r\n");
+  reply.add("220 --   Version ");
+  reply.add(FTP_SERVER_VERSION);
+  reply.add("   --\r\n");
+  reply.send( client );
   iCL = 0;
+  lineLen = 0;
+  skipLine = false;
+  lineHeld = false;
 }
 
-void FtpServer::disconnectClient()
+void FtpSession::disconnectClient()
 {
   #ifdef FTP_DEBUG
     Serial.println(F(" Disconnecting client"));
   #endif
-  abortTransfer();
-  client.print("221 Goodbye\r\n");
+  abortTransfer( FTP_TRACE_CLIENT );
+  reply.add("221 Goodbye\r\n");
+  reply.send( client );
   client.stop();
 }
 
-boolean FtpServer::userIdentity()
+boolean FtpSession::userIdentity()
 {
-  if( strcmp( command, "USER" ))
-    client.print("500 Syntax error\r\n");
+  if( verb != FTP_VERB( "USER" ))
+    reply.add("500 Syntax error\r\n");
   if( strcmp( parameters, FTP_USER ))
-    client.print("530 \r\n");
+    reply.add("530 \r\n");
   else
   {
-    client.print("331 OK. Password required\r\n");
-    strcpy( cwdName, "/" );
+    reply.add("331 OK. Password required\r\n");
+    changeDir( "/" );
     return true;
   }
+  server->metrics.inc( FTP_M_LOGIN_FAILS );
   millisDelay = millis() + 100;  // delay of 100 ms
   return false;
 }
 
-boolean FtpServer::userPassword()
+boolean FtpSession::userPassword()
 {
-  if( strcmp( command, "PASS" ))
-    client.print("500 Syntax error\r\n");
+  if( verb != FTP_VERB( "PASS" ))
+    reply.add("500 Syntax error\r\n");
   else if( strcmp( parameters, FTP_PASS ))
-    client.print("530 \r\n");
+    reply.add("530 \r\n");
   else
   {
     #ifdef FTP_DEBUG
       Serial.println(F("OK. Waiting for commands."));
     #endif
-    client.print("230 OK.\r\n");
+    reply.add("230 OK.\r\n");
     return true;
   }
+  server->metrics.inc( FTP_M_LOGIN_FAILS );
   millisDelay = millis() + 100;  // delay of 100 ms
   return false;
 }
 
-boolean FtpServer::processCommand()
-{
-  ///////////////////////////////////////
-  //                                   //
-  //      ACCESS CONTROL COMMANDS      //
-  //                                   //
-  ///////////////////////////////////////
+// Execute the command received from client
+//
+// The verb packed by readLine() selects the handler cmdXXXX() through a
+//   switch on constants generated from FTP_COMMANDS, so the cost of the
+//   dispatch does not depend on the command
+//
+// return:
+//    false if client has quit
 
-  //
-  //  CDUP - Change to Parent Directory 
-  //
-  if( ! strcmp( command, "CDUP" ))
+boolean FtpSession::processCommand()
+{
+  uint32_t t = micros();
+  uint8_t  index = FTP_CMD_COUNT;
+  switch( verb )
   {
-    boolean ok = false;
-    
-    if( strlen( cwdName ) > 1 )            // do nothing if cwdName is root
-    {
-      // if cwdName ends with '/', remove it (must not append)
-      if( cwdName[ strlen( cwdName ) - 1 ] == '/' ) {
-        cwdName[ strlen( cwdName ) - 1 ] = 0;
-      }
+    #define FTP_CMD_CASE( name, feat ) \
+      case FTP_VERB( #name ): cmd##name(); index = FTP_CMD_IDX_##name; break;
+    FTP_COMMANDS( FTP_CMD_CASE )
+    #undef FTP_CMD_CASE
 
-      // search last '/'
-      char * pSep = strrchr( cwdName, '/' );
-      ok = pSep > cwdName;
-      // if found, ends the string on its position
-      if( ok )
-      {
-        * pSep = 0;
-        ok = FAT.exists( cwdName );
-      }
-    }
-    // if an error appends, move to root
-    if( ok ) {
-      client.print("200 Ok. Current directory is ");
-      client.print(cwdName);
-      client.print("\r\n");
-    } else {
-      strcpy( cwdName, "/" );
-      client.print("200 Ok. Current directory is ");
-      client.print(cwdName);
-      client.print("\r\n");
-    }
+    //
+    //  Unrecognized commands ...
+    //
+    default:
+      reply.add("500 Unknow command\r\n");
+  }
+  server->metrics.command( index, micros() - t );
+  // RNTO must follow RNFR
+  if( verb != FTP_VERB( "RNFR" ))
+    rnfrClose();
+  return verb != FTP_VERB( "QUIT" );
+}
+
+///////////////////////////////////////
+//                                   //
+//      ACCESS CONTROL COMMANDS      //
+//                                   //
+///////////////////////////////////////
+
+//
+//  CDUP - Change to Parent Directory 
+//
+
+void FtpSession::cmdCDUP()
+{
+  char path[ FTP_CWD_SIZE ];
+  
+  // if an error appends, move to root
+  if( ! makePath( path, (char *) ".." ) || ! changeDir( path ))
+    changeDir( "/" );
+  reply.add("200 Ok. Current directory is ");
+  reply.add(cwdName);
+  reply.add("\r\n");
 #ifdef FTP_DEBUG
-    Serial.print(F("New directory is: '"));
-    Serial.print(cwdName);
-    Serial.println(F("'"));
+  Serial.print(F("New directory is: '"));
+  Serial.print(cwdName);
+  Serial.println(F("'"));
 #endif
-  }
-  //
-  //  CWD - Change Working Directory
-  //
-  else if( ! strcmp( command, "CWD" )) {
-    char path[ FTP_CWD_SIZE ];
-    if( strcmp( parameters, "." ) == 0 ) { // 'CWD .' is the same as PWD command
-      client.print("257 \"");
-      client.print(cwdName);
-      client.print("\" is your current directory\r\n");
-    } else if( makePath( path )) {
-      if( ! FAT.exists( path )) {
-        client.print("550 Can't change directory to ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else {
-        strcpy( cwdName, path );
-        client.print("250 Ok. Current directory is ");
-        client.print(cwdName);
-        client.print("\r\n");
-      }
+}
+
+//
+//  CWD - Change Working Directory
+//
+
+void FtpSession::cmdCWD()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( strcmp( parameters, "." ) == 0 ) { // 'CWD .' is the same as PWD command
+    reply.add("257 \"");
+    reply.add(cwdName);
+    reply.add("\" is your current directory\r\n");
+  } else if( makePath( path )) {
+    if( ! changeDir( path )) {
+      reply.add("550 Can't change directory to ");
+      reply.add(parameters);
+      reply.add("\r\n");
+    } else {
+      reply.add("250 Ok. Current directory is ");
+      reply.add(cwdName);
+      reply.add("\r\n");
     }
   }
-  //
-  //  PWD - Print Directory
-  //
-  else if( ! strcmp( command, "PWD" )) {
-    client.print("257 \"");
-    client.print(cwdName);
-    client.print("\" is your current directory\r\n");
+}
+
+//
+//  PWD - Print Directory
+//
+
+void FtpSession::cmdPWD()
+{
+  reply.add("257 \"");
+  reply.add(cwdName);
+  reply.add("\" is your current directory\r\n");
+}
+
+//
+//  QUIT
+//
+
+void FtpSession::cmdQUIT()
+{
+  disconnectClient();
+}
+
+///////////////////////////////////////
+//                                   //
+//    TRANSFER PARAMETER COMMANDS    //
+//                                   //
+///////////////////////////////////////
+
+//
+//  MODE - Transfer Mode 
+//
+
+void FtpSession::cmdMODE()
+{
+  if( ! strcmp( parameters, "S" ))
+  {
+    transferMode = 'S';
+    reply.add("200 S Ok\r\n");
   }
-  //
-  //  QUIT
-  //
-  else if( ! strcmp( command, "QUIT" ))
+  // else if( ! strcmp( parameters, "B" ))
+  //  client << "200 B Ok\r\n";
+  #if FTP_ZSTREAMS > 0
+  else if( ! strcmp( parameters, "Z" ))
   {
-    disconnectClient();
-    return false;
+    transferMode = 'Z';
+    reply.add("200 Z Ok\r\n");
   }
+  #endif
+  else
+    reply.add("504 Only S(tream) and Z are suported\r\n");
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //    TRANSFER PARAMETER COMMANDS    //
-  //                                   //
-  ///////////////////////////////////////
+//
+//  OPTS - Options of a command (see RFC 2389)
+//
+//  Only OPTS MODE Z LEVEL n, which sets the level of compression
+//
 
-  //
-  //  MODE - Transfer Mode 
-  //
-  else if( ! strcmp( command, "MODE" ))
+void FtpSession::cmdOPTS()
+{
+  if( ! strncmp( parameters, "MODE Z LEVEL ", 13 ) &&
+      isdigit( parameters[ 13 ] ) && parameters[ 14 ] == 0 )
   {
-    if( ! strcmp( parameters, "S" ))
-      client.print("200 S Ok\r\n");
-    // else if( ! strcmp( parameters, "B" ))
-    //  client << "200 B Ok\r\n";
-    else
-      client.print("504 Only S(tream) is suported\r\n");
+    zLevel = parameters[ 13 ] - '0';
+    reply.add("200 MODE Z LEVEL set to ");
+    reply.add(zLevel);
+    reply.add("\r\n");
   }
-  //
-  //  PASV - Passive Connection management
-  //
-  else if( ! strcmp( command, "PASV" ))
+  else
+  {
+    reply.add("501 Option not understood ");
+    reply.add(parameters);
+    reply.add("\r\n");
+  }
+}
+
+//
+//  PASV - Passive Connection management
+//
+
+void FtpSession::cmdPASV()
+{
+  data.stop();
+  pasvClose();
+  pasvPort = server->pasvTake();
+  if( pasvPort < 0 )
+  {
+    reply.add("425 No passive port available\r\n");
+    return;
+  }
+  dataIp = FTP_LOCAL_IP( client );
+  dataPort = FTP_DATA_PORT_PASV + pasvPort;
+  #ifdef FTP_DEBUG
+    Serial.println(F("Connection management set to passive"));
+    Serial.print(F("Data port set to "));
+    Serial.println(dataPort);
+  #endif
+  reply.add("227 Entering Passive Mode (");
+  reply.add(dataIp[0]);reply.add(",");
+  reply.add(dataIp[1]);reply.add(",");
+  reply.add(dataIp[2]);reply.add(",");
+  reply.add(dataIp[3]);reply.add(",");
+  reply.add(dataPort >> 8);reply.add(",");
+  reply.add(dataPort & 255);
+  reply.add(").\r\n");
+
+  dataPassiveConn = true;
+}
+
+//
+//  PORT - Data Port
+//
+
+void FtpSession::cmdPORT()
+{
+  data.stop();
+  pasvClose();
+  // get IP of data client
+  dataIp[ 0 ] = atoi( parameters );
+  char * p = strchr( parameters, ',' );
+  for( uint8_t i = 1; i < 4; i ++ )
+  {
+    dataIp[ i ] = atoi( ++ p );
+    p = strchr( p, ',' );
+  }
+  // get port of data client
+  dataPort = 256 * atoi( ++ p );
+  p = strchr( p, ',' );
+  dataPort += atoi( ++ p );
+  if( p == NULL )
+    reply.add("501 Can't interpret parameters\r\n");
+  else
   {
-    data.stop();
-    dataServer.begin();
-    dataIp = Ethernet.localIP();
-    dataPort = FTP_DATA_PORT_PASV;
-    //data.connect( dataIp, dataPort );
-    //data = dataServer.available();
     #ifdef FTP_DEBUG
-      Serial.println(F("Connection management set to passive"));
-      Serial.print(F("Data port set to "));
+      Serial.print(F("Data IP set to "));
+      Serial.print(dataIp[0]);Serial.write(',');
+      Serial.print(dataIp[1]);Serial.write(',');
+      Serial.print(dataIp[2]);Serial.write(',');
+      Serial.print(dataIp[3]);Serial.write(',');
       Serial.println(dataPort);
     #endif
-    client.print("227 Entering Passive Mode (");
-    client.print(dataIp[0]);client.print(",");
-    client.print(dataIp[1]);client.print(",");
-    client.print(dataIp[2]);client.print(",");
-    client.print(dataIp[3]);client.print(",");
-    client.print(dataPort >> 8);client.print(",");
-    client.print(dataPort & 255);
-    client.print(").\r\n");
-
-    dataPassiveConn = true;
-  }
-  //
-  //  PORT - Data Port
-  //
-  else if( ! strcmp( command, "PORT" ))
+    reply.add("200 PORT command successful\r\n");
+    dataPassiveConn = false;
+  }
+}
+
+//
+//  STRU - File Structure
+//
+
+void FtpSession::cmdSTRU()
+{
+  if( ! strcmp( parameters, "F" ))
+    reply.add("200 F Ok\r\n");
+  // else if( ! strcmp( parameters, "R" ))
+  //  client << "200 B Ok\r\n";
+  else
+    reply.add("504 Only F(ile) is suported\r\n");
+}
+
+//
+//  TYPE - Data Type
+//
+
+void FtpSession::cmdTYPE()
+{
+  if( ! strcmp( parameters, "A" ) || ! strcmp( parameters, "A N" )) {
+    transferType = 'A';
+    reply.add("200 TYPE is now ASCII\r\n");
+  } else if( ! strcmp( parameters, "I" ) || ! strcmp( parameters, "L 8" )) {
+    transferType = 'I';
+    reply.add("200 TYPE is now 8-bit binary\r\n");
+  } else
+    reply.add("504 Unknow TYPE\r\n");
+}
+
+///////////////////////////////////////
+//                                   //
+//        FTP SERVICE COMMANDS       //
+//                                   //
+///////////////////////////////////////
+
+//
+//  ABOR - Abort
+//
+
+void FtpSession::cmdABOR()
+{
+  abortTransfer( FTP_TRACE_ABORTED );
+  reply.add("226 Data connection closed\r\n");
+}
+
+//
+//  ALLO - Allocate storage for next STOR
+//
+
+void FtpSession::cmdALLO()
+{
+  if( ! isdigit( parameters[ 0 ] ))
+    reply.add("501 No size\r\n");
+  else
   {
-    data.stop();
-    // get IP of data client
-    dataIp[ 0 ] = atoi( parameters );
-    char * p = strchr( parameters, ',' );
-    for( uint8_t i = 1; i < 4; i ++ )
+    allocSize = strtoul( parameters, NULL, 10 );
+    reply.add("200 ");
+    reply.add(allocSize);
+    reply.add(" bytes will be allocated\r\n");
+  }
+}
+
+//
+//  DELE - Delete a File 
+//
+
+void FtpSession::cmdDELE()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
+  {
+    if( ! pathExists( path )) {
+      reply.add("550 File ");
+      reply.add(parameters);
+      reply.add(" not found\r\n");
+    } else {
+      if( FTP_FS.remove( path )) {
+        server->invalidate( path );
+        reply.add("250 Deleted ");
+        reply.add(parameters);
+        reply.add("\r\n");
+      } else {
+        reply.add("450 Can't delete ");
+        reply.add(path);
+        reply.add("\r\n");
+      }
+    }
+  }
+}
+
+//
+//  LIST - List 
+//
+
+void FtpSession::cmdLIST()
+{
+  doList( 'L' );
+}
+
+//
+//  MLSD - Listing for Machine Processing (see RFC 3659)
+//
+
+void FtpSession::cmdMLSD()
+{
+  doList( 'M' );
+}
+
+//
+//  NLST - Name List 
+//
+
+void FtpSession::cmdNLST()
+{
+  doList( 'N' );
+}
+
+//
+//  NOOP
+//
+
+void FtpSession::cmdNOOP()
+{
+  // dataPort = 0;
+  reply.add("200 Zzz...\r\n");
+}
+
+//
+//  REST - Restart transfer at given position
+//
+
+void FtpSession::cmdREST()
+{
+  if( ! isdigit( parameters[ 0 ] ))
+    reply.add("501 No restart position\r\n");
+  else
+  {
+    restartPos = strtoul( parameters, NULL, 10 );
+    reply.add("350 Restarting at ");
+    reply.add(restartPos);
+    reply.add("\r\n");
+  }
+}
+
+//
+//  RETR - Retrieve
+//
+
+void FtpSession::cmdRETR()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( transferStatus > 0 )
+    reply.add("425 Data connection busy\r\n");
+  else if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
+  {
+    if( ! pathExists( path )) {
+      reply.add("550 File ");
+      reply.add(path);
+      reply.add(" not found\r\n");
+    } else if( ! zOpen()) {
+      reply.add("451 Not enough memory for MODE Z\r\n");
+    // sendFile() of plain binary transfers needs no buffer
+    } else if(( ! FTP_SENDFILE || zs != NULL || transferType == 'A' )
+               && ! bufOpen()) {
+      reply.add("425 No transfer buffer free, try again later\r\n");
+      zClose();
+    } else if( ! openFile( file, path, O_READ )) {
+      reply.add("450 Can't open ");
+      reply.add(path);
+      reply.add("\r\n");
+      zClose();
+      bufClose();
+    // a restart position past the end of the file is refused, though
+    //   some file systems would seek there
+    } else if( restartPos > 0 && ( restartPos > file.fileSize() ||
+                                   ! file.seekSet( restartPos ))) {
+      reply.add("554 Can't restart at ");
+      reply.add(restartPos);
+      reply.add("\r\n");
+      closeFile();
+    } else
     {
-      dataIp[ i ] = atoi( ++ p );
-      p = strchr( p, ',' );
+      #ifdef FTP_DEBUG
+        Serial.print(F("Sending "));
+        Serial.println(parameters);
+      #endif
+      fileStart = restartPos;
+      traceBegin( 'R', path );
+      dataOpen( 1 );
     }
-    // get port of data client
-    dataPort = 256 * atoi( ++ p );
-    p = strchr( p, ',' );
-    dataPort += atoi( ++ p );
-    if( p == NULL )
-      client.print("501 Can't interpret parameters\r\n");
-    else
+  }
+  restartPos = 0;
+}
+
+// Data connection of RETR is established: start to send the file
+
+void FtpSession::startRetrieve()
+{
+  reply.add("150-Connected to port ");
+  reply.add(dataPort);
+  reply.add("\r\n");
+
+  reply.add("150 ");
+  reply.add(file.fileSize() - fileStart);
+  if( transferType == 'A' )
+    reply.add(" bytes of file to download in ASCII mode\r\n");
+  else
+    reply.add(" bytes to download\r\n");
+  millisBeginTrans = millis();
+  bytesTransfered = 0;
+  bufFirst = 0;
+  bufCount = 0;
+  bufPos = 0;
+  fileEnd = false;
+  crText = false;
+  #if FTP_SENDFILE
+    // buf was taken only if sendFile() can't be used
+    direct = buf == NULL;
+    fileLeft = file.fileSize() - fileStart;
+  #endif
+  if( zs != NULL )
+    zs->deflateBegin( zLevel );
+  transferStatus = 1;
+}
+
+//
+//  STOR - Store
+//
+
+void FtpSession::cmdSTOR()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( transferStatus > 0 )
+    reply.add("425 Data connection busy\r\n");
+  else if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
+  {
+    if( ! zOpen()) {
+      reply.add("451 Not enough memory for MODE Z\r\n");
+    } else if( ! bufOpen()) {
+      reply.add("425 No transfer buffer free, try again later\r\n");
+      zClose();
+    // after REST, write over the file from the restart position
+    } else if( ! openFile( file, path, restartPos > 0 ? O_CREAT | O_WRITE
+                                         : O_CREAT | O_WRITE | O_TRUNC )) {
+      reply.add("451 Can't open/create ");
+      reply.add(parameters);
+      reply.add("\r\n");
+      zClose();
+      bufClose();
+    // a restart position past the end of the file is refused, though
+    //   some file systems would seek there
+    } else if( restartPos > 0 && ( restartPos > file.fileSize() ||
+                                   ! file.seekSet( restartPos ))) {
+      reply.add("554 Can't restart at ");
+      reply.add(restartPos);
+      reply.add("\r\n");
+      closeFile();
+    } else
     {
       #ifdef FTP_DEBUG
-        Serial.print(F("Data IP set to "));
-        Serial.print(dataIp[0]);Serial.write(',');
-        Serial.print(dataIp[1]);Serial.write(',');
-        Serial.print(dataIp[2]);Serial.write(',');
-        Serial.print(dataIp[3]);Serial.write(',');
-        Serial.println(dataPort);
+        Serial.print(F("Receiving "));
+        Serial.println(parameters);
       #endif
-      client.print("200 PORT command successful\r\n");
-      dataPassiveConn = false;
+      fileStart = restartPos;
+      fileAlloc = restartPos == 0 ? allocSize : 0;
+      strcpy( transferPath, path );
+      server->invalidate( path );
+      traceBegin( 'S', path );
+      dataOpen( 2 );
     }
   }
-  //
-  //  STRU - File Structure
-  //
-  else if( ! strcmp( command, "STRU" ))
+  allocSize = 0;
+  restartPos = 0;
+}
+
+// Data connection of STOR is established: start to receive the file
+
+void FtpSession::startStore()
+{
+  reply.add("150 Connected to port ");
+  reply.add(dataPort);
+  reply.add("\r\n");
+  // reserve contiguous clusters for the size announced by ALLO
+  if( fileAlloc > 0 )
   {
-    if( ! strcmp( parameters, "F" ))
-      client.print("200 F Ok\r\n");
-    // else if( ! strcmp( parameters, "R" ))
-    //  client << "200 B Ok\r\n";
-    else
-      client.print("504 Only F(ile) is suported\r\n");
+    preAllocated = file.preAllocate( fileAlloc );
+    #ifdef FTP_DEBUG
+      if( ! preAllocated )
+        Serial.println(F("Can't preallocate file"));
+    #endif
   }
-  //
-  //  TYPE - Data Type
-  //
-  else if( ! strcmp( command, "TYPE" ))
+  millisBeginTrans = millis();
+  bytesTransfered = 0;
+  stageLen = 0;
+  filePos = fileStart;
+  crText = false;
+  if( zs != NULL )
+    zs->inflateBegin();
+  transferStatus = 2;
+}
+
+//
+//  MKD - Make Directory
+//
+
+void FtpSession::cmdMKD()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( strlen( parameters ) == 0 )
+    reply.add("501 No directory name\r\n");
+  else if( makePath( path ))
   {
-    if( ! strcmp( parameters, "A" ))
-      client.print("200 TYPE is now ASII\r\n");
-    else if( ! strcmp( parameters, "I" ))
-      client.print("200 TYPE is now 8-bit binary\r\n");
-    else
-      client.print("504 Unknow TYPE\r\n");
+    if( pathExists( path )) {
+      reply.add("521 \"");
+      reply.add(parameters);
+      reply.add("\" directory already exists\r\n");
+    } else {
+      #ifdef FTP_DEBUG
+        Serial.print(F("Creating directory "));
+        Serial.println(parameters);
+      #endif
+      if( FTP_FS.mkdir( path )) {
+        server->invalidate( path );
+        reply.add("257 \"");
+        reply.add(parameters);
+        reply.add("\" created\r\n");
+      } else {
+        reply.add("550 Can't create \"");
+        reply.add(parameters);
+        reply.add("\"\r\n");
+      }
+    }
   }
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //        FTP SERVICE COMMANDS       //
-  //                                   //
-  ///////////////////////////////////////
+//
+//  RMD - Remove a Directory 
+//
 
-  //
-  //  ABOR - Abort
-  //
-  else if( ! strcmp( command, "ABOR" ))
+void FtpSession::cmdRMD()
+{
+  char path[ FTP_CWD_SIZE ];
+  if( strlen( parameters ) == 0 )
+    reply.add("501 No directory name\r\n");
+  else if( makePath( path ))
   {
-    abortTransfer();
-    client.print("226 Data connection closed\r\n");
+    #ifdef FTP_DEBUG
+      Serial.print(F("Deleting "));
+      Serial.println(path);
+    #endif
+    if( ! pathExists( path )) {
+      reply.add("550 File ");
+      reply.add(parameters);
+      reply.add(" not found\r\n");
+    } else if( FTP_FS.rmdir( path )) {
+      server->invalidate( path );
+      reply.add("250 \"");
+      reply.add(parameters);
+      reply.add("\" deleted\r\n");
+    } else {
+      reply.add("501 Can't delete \"");
+      reply.add(parameters);
+      reply.add("\"\r\n");
+    }
   }
-  //
-  //  DELE - Delete a File 
-  //
-  else if( ! strcmp( command, "DELE" ))
+}
+
+//
+//  RNFR - Rename From 
+//
+
+void FtpSession::cmdRNFR()
+{
+  char path[ FTP_CWD_SIZE ];
+  rnfrClose();
+  if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path ))
-    {
-      if( ! FAT.exists( path )) {
-        client.print("550 File ");
-        client.print(parameters);
-        client.print(" not found\r\n");
-      } else {
-        if( FAT.remove( path )) {
-          client.print("250 Deleted ");
-          client.print(parameters);
-          client.print("\r\n");
+    if( ! pathExists( path )) {
+      reply.add("550 File ");
+      reply.add(parameters);
+      reply.add(" not found\r\n");
+    } else if( ! rnfrOpen()) {
+      reply.add("451 Too many renames at once, try again later\r\n");
+    } else {
+      #ifdef FTP_DEBUG
+        Serial.print(F("Renaming "));
+        Serial.println(path);
+      #endif
+      strcpy( rnfrPath, path );
+      reply.add("350 RNFR accepted - file exists, ready for destination\r\n");
+    }
+  }
+}
+
+//
+//  RNTO - Rename To 
+//
+
+void FtpSession::cmdRNTO()
+{
+  char path[ FTP_CWD_SIZE ];
+  char dir[ FTP_FIL_SIZE ];
+  if( rnfrPath == NULL )
+    reply.add("503 Need RNFR before RNTO\r\n");
+  else if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
+  {
+    if( pathExists( path )) {
+      reply.add("553 ");
+      reply.add(parameters);
+      reply.add(" already exists\r\n");
+    } else {
+      strcpy( dir, path );
+      char * psep = strrchr( dir, '/' );
+      boolean fail = psep == NULL;
+      if( ! fail )
+      {
+        if( psep == dir )
+          psep ++;
+        * psep = 0;
+        #if FAT_SYST == 0
+          fail = ! file.open( dir ) || ! file.isDir();
+          file.close();
+        #else
+          fail = ! FTP_FS.isDir( dir );
+        #endif
+        if( fail ) {
+          reply.add("550 \"");
+          reply.add(dir);
+          reply.add("\" is not directory\r\n");
         } else {
-          client.print("450 Can't delete ");
-          client.print(path);
-          client.print("\r\n");
+          #ifdef FTP_DEBUG
+            Serial.print(F("Renaming "));
+            Serial.print(rnfrPath);
+            Serial.print(" to ");
+            Serial.println(path);
+          #endif
+          if( FTP_FS.rename( rnfrPath, path ))
+          {
+            server->invalidate( rnfrPath );
+            server->invalidate( path );
+            reply.add("250 File successfully renamed or moved\r\n");
+          }
+          else
+            fail = true;
         }
       }
+      if( fail )
+        reply.add("451 Rename/move failure\r\n");
     }
   }
-  //
-  //  LIST - List 
-  //
-  else if( ! strcmp( command, "LIST" ))
+  rnfrClose();
+}
+
+///////////////////////////////////////
+//                                   //
+//   EXTENSIONS COMMANDS (RFC 3659)  //
+//                                   //
+///////////////////////////////////////
+
+//
+//  FEAT - New Features
+//
+
+void FtpSession::cmdFEAT()
+{
+  reply.add("211-Extensions suported:\r\n");
+  for( uint8_t i = 0; i < sizeof( features ) / sizeof( features[ 0 ] ); i ++ )
+    if( features[ i ] != NULL )
+    {
+      reply.add(" ");
+      reply.add(features[ i ]);
+      reply.add("\r\n");
+    }
+  reply.add("211 End.\r\n");
+}
+
+//
+//  MDTM - File Modification Time (see RFC 3659)
+//
+
+void FtpSession::cmdMDTM()
+{
+  char path[ FTP_CWD_SIZE ];
+  char * fname = parameters;
+  FtpStat st;
+  uint16_t year;
+  uint8_t month, day, hour, minute, second, setTime;
+  setTime = getDateTime( & year, & month, & day, & hour, & minute, & second );
+  // fname point to file name
+  fname += setTime;
+  if( strlen( fname ) <= 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path, fname ))
   {
-    if( ! dataConnect())
-      client.print("425 No data connection\r\n");
-    else
+    if( ! getStat( path, setTime ? 0 : FTP_STAT_TIME, & st )) {
+      reply.add("550 No such file ");
+      reply.add(parameters);
+      reply.add("\r\n");
+    } else if( setTime ) // set file modification time
     {
-      client.print("150 Accepted data connection\r\n");
-      uint16_t nm = 0;
-      FAT_DIR dir;
-      if( ! dir.openDir( cwdName )) {
-        client.print("550 Can't open directory ");
-        client.print(cwdName);
-        client.print("\r\n");
-      } else {
-        while( dir.nextFile())
-        {
-          if( dir.isDir() )
-            data.print("+/");
-          else {
-            data.print("+r,s");
-            data.print(dir.fileSize());
-          }
-          data.print(",\t");
-          data.print(dir.fileName());
-          data.print("\r\n");
-          nm ++;
-        }
-        client.print("226 ");
-        client.print(nm);
-        client.print(" matches total\r\n");
+      if( FTP_FS.timeStamp( path, year, month, day, hour, minute, second ))
+      {
+        server->invalidate( path );
+        reply.add("200 Ok\r\n");
       }
-      data.stop();
+      else
+        reply.add("550 Unable to modify time\r\n");
+    }
+    else // get file modification time
+    {
+      if( st.flags & FTP_STAT_TIME )
+      {
+        char dtStr[ 15 ];
+        reply.add("213 ");
+        reply.add(makeDateTimeStr( dtStr, st.modDate, st.modTime ));
+        reply.add("\r\n");
+      }
+      else
+        reply.add("550 Unable to retrieve time\r\n");
     }
   }
-  //
-  //  MLSD - Listing for Machine Processing (see RFC 3659)
-  //
-  else if( ! strcmp( command, "MLSD" ))
+}
+
+//
+//  SIZE - Size of the file
+//
+
+void FtpSession::cmdSIZE()
+{
+  char    path[ FTP_CWD_SIZE ];
+  FtpStat st;
+  if( strlen( parameters ) == 0 )
+    reply.add("501 No file name\r\n");
+  else if( makePath( path ))
   {
-    if( ! dataConnect())
-      client.print("425 No data connection\r\n");
-    else
+    if( ! getStat( path, FTP_STAT_SIZE, & st )) {
+      reply.add("550 No such file ");
+      reply.add(parameters);
+      reply.add("\r\n");
+    } else if( ! ( st.flags & FTP_STAT_SIZE )) {
+      reply.add("450 Can't open ");
+      reply.add(parameters);
+      reply.add("\r\n");
+    } else if( transferType == 'A' && ! textSize( path, & st.size )) {
+      reply.add("450 Can't read ");
+      reply.add(parameters);
+      reply.add("\r\n");
+    } else {
+      reply.add("213 ");
+      reply.add(st.size);
+      reply.add("\r\n");
+    }
+  }
+}
+
+// Add to * size the CR which TYPE A adds to the lines of file path
+//
+// The file is read through a transfer buffer taken for the time of the
+//   count
+//
+// return:
+//    false if the file can't be read or no buffer is free
+
+boolean FtpSession::textSize( const char * path, uint32_t * size )
+{
+  FTP_FILE f;
+  char *   b = server->bufTake();
+  if( b == NULL )
+    return false;
+  boolean  ok = openFile( f, path, O_READ );
+  boolean  cr = false;
+  int16_t  nb = 0;
+  while( ok && ( nb = f.read( b, FTP_XFER_SIZE )) > 0 )
+    * size += ftpTextAdded( b, nb, & cr );
+  f.close();
+  server->bufRelease( b );
+  return ok && nb == 0;
+}
+
+//
+//  SITE - System command
+//
+
+void FtpSession::cmdSITE()
+{
+  if( ! strcmp( parameters, "FREE" )) {
+    reply.add("200 ");
+    reply.add(FTP_FS.free());
+    reply.add(" MB free of ");
+    reply.add(FTP_FS.capacity());
+    reply.add(" MB capacity\r\n");
+  } else if( ! strcmp( parameters, "TRACE" )) {
+    siteTrace();
+  } else if( ! strcmp( parameters, "METRICS" )) {
+    siteMetrics();
+  } else if( ! strncmp( parameters, "RATE", 4 ) &&
+             ( parameters[ 4 ] == 0 || parameters[ 4 ] == ' ' )) {
+    siteRate();
+  } else {
+    reply.add("500 Unknow SITE command ");
+    reply.add(parameters);
+    reply.add("\r\n");
+  }
+}
+
+// Reply to SITE TRACE with the traces of the last transfers, oldest first
+//
+// Each line gives the command, session, mode, bytes on the data connection,
+//   total time, and how it was spent: waiting for the data connection,
+//   reading/writing the file and the data connection, then the number of
+//   calls to service() without progress, how it ended, and the path
+
+void FtpSession::siteTrace()
+{
+  FtpTrace t;
+  uint16_t n = 0;
+  while( server->getTrace( n, & t ))
+    n ++;
+  while( n > 0 && server->getTrace( -- n, & t ))
+  {
+    reply.add("200-");
+    reply.add(t.cmd == 'R' ? "RETR" : t.cmd == 'S' ? "STOR" :
+              t.cmd == 'L' ? "LIST" : t.cmd == 'M' ? "MLSD" : "NLST");
+    reply.add(" s");
+    reply.add(t.session);
+    reply.add(t.mode == 'Z' ? " Z " : " S ");
+    reply.add(t.bytes);
+    reply.add(" bytes ");
+    reply.add(t.millisEnd - t.millisStart);
+    reply.add(" ms: wait ");
+    reply.add(t.millisData - t.millisStart);
+    reply.add(" ms, file ");
+    reply.add(t.microsFile / 1000);
+    reply.add(" ms, net ");
+    reply.add(t.microsNet / 1000);
+    reply.add(" ms, ");
+    reply.add(t.idleLoops);
+    reply.add(" idle, ");
+    reply.add(traceResults[ t.result ]);
+    reply.add(" ");
+    reply.add(t.path);
+    reply.add("\r\n");
+    reply.send( client );
+  }
+  reply.add("200 ");
+  reply.add(server->getTraceCount());
+  reply.add(" transfers since start\r\n");
+}
+
+// Reply to SITE METRICS with the counters, the number of each command
+//   executed, and the histograms: number of samples, maximum, quantiles
+//   and the non empty buckets as "upper bound:count"
+
+void FtpSession::siteMetrics()
+{
+  #if FTP_METRICS
+    const FtpMetrics & m = server->metrics;
+    for( uint8_t i = 0; i < FTP_M_COUNTERS; i ++ )
     {
-      client.print("150 Accepted data connection\r\n");
-      uint16_t nm = 0;
-      FAT_DIR dir;
-      char dtStr[ 15 ];
-      if( ! dir.openDir( cwdName )) {
-        client.print("550 Can't open directory ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else {
-        while( dir.nextFile())
+      reply.add("200-").add(FtpMetrics::counterName( i )).add(" ");
+      reply.add(m.counters[ i ]).add("\r\n");
+      reply.send( client );
+    }
+    for( uint8_t i = 0; i <= FTP_CMD_COUNT; i ++ )
+      if( m.commands[ i ] > 0 )
+      {
+        reply.add("200-cmd_").add(FtpMetrics::commandName( i )).add(" ");
+        reply.add(m.commands[ i ]).add("\r\n");
+        reply.send( client );
+      }
+    for( uint8_t i = 0; i < FTP_H_COUNT; i ++ )
+    {
+      const FtpHistogram & h = m.hist[ i ];
+      reply.add("200-").add(FtpMetrics::histName( i ));
+      reply.add(" n=").add(h.count).add(" max=").add(h.max);
+      reply.add(" p50=").add(h.quantile( 50 ));
+      reply.add(" p90=").add(h.quantile( 90 ));
+      reply.add(" p99=").add(h.quantile( 99 ));
+      for( uint8_t b = 0; b < FTP_H_BUCKETS; b ++ )
+        if( h.bucket[ b ] > 0 )
         {
-          data.print("Type=");
-          data.print(dir.isDir() ? "dir" : "file");
-          data.print(";");
-          data.print("Size=");
-          data.print(dir.fileSize());
-          data.print(";");
-          data.print("Modify=");
-          data.print(makeDateTimeStr( dtStr, dir.fileModDate(), dir.fileModTime()));
-          data.print("; ");
-          data.print(dir.fileName());
-          data.print("\r\n");
-          nm ++;
+          reply.add(" ");
+          if( b == FTP_H_BUCKETS - 1 )
+            reply.add("inf");
+          else
+            reply.add(( 1UL << b ) - 1 );
+          reply.add(":").add(h.bucket[ b ]);
         }
-        client.print("226-options: -a -l\r\n");
-        client.print("226 ");
-        client.print(nm);
-        client.print(" matches total\r\n");
-      }
-      data.stop();
+      reply.add("\r\n");
+      reply.send( client );
     }
+    reply.add("200 End\r\n");
+  #else
+    reply.add("502 Metrics are not compiled in\r\n");
+  #endif
+}
+
+// SITE RATE [SESSION] DOWN|UP bytes/s sets a limit of bandwidth, of all
+//   transfers or of the transfers of each session (0: no limit)
+//
+// Then, or without parameters, the limits are given in the reply
+
+void FtpSession::siteRate()
+{
+  char *  p = parameters + 4;
+  boolean perSession = false;
+  while( * p == ' ' )
+    p ++;
+  if( * p != 0 )
+  {
+    if( ! strncmp( p, "SESSION ", 8 ))
+    {
+      perSession = true;
+      p += 8;
+    }
+    int8_t dir = ! strncmp( p, "DOWN ", 5 ) ? FTP_DOWN :
+                 ! strncmp( p, "UP ", 3 ) ? FTP_UP : -1;
+    if( dir >= 0 )
+      p += dir == FTP_DOWN ? 5 : 3;
+    char * end;
+    uint32_t bytesPerSec = strtoul( p, & end, 10 );
+    if( dir < 0 || ! isdigit( * p ) || * end != 0 )
+    {
+      reply.add("501 Syntax: SITE RATE [SESSION] DOWN|UP bytes/s\r\n");
+      return;
+    }
+    server->setRate( dir, perSession, bytesPerSec );
   }
-  //
-  //  NLST - Name List 
-  //
-  else if( ! strcmp( command, "NLST" ))
+  for( uint8_t dir = FTP_DOWN; dir <= FTP_UP; dir ++ )
   {
-    if( ! dataConnect())
-      client.print( "425 No data connection\r\n");
+    uint32_t all = server->rateAll[ dir ].getRate();
+    uint32_t session = server->rateSession[ dir ];
+    reply.add(dir == FTP_DOWN ? "200-Download: all " : "200 Upload: all ");
+    if( all > 0 )
+      reply.add(all);
     else
-    {
-      client.print("150 Accepted data connection\r\n");
-      uint16_t nm = 0;
-      FAT_DIR dir;
-      if( ! dir.openDir( cwdName )) {
-        client.print("550 Can't open directory ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else {
-        while( dir.nextFile())
-        {
-          data.print(dir.fileName());
-          data.print("\r\n");
-          nm ++;
-        }
-        client.print("226 ");
-        client.print(nm);
-        client.print(" matches total\r\n");
-      }
+      reply.add("none");
+    reply.add(", session ");
+    if( session > 0 )
+      reply.add(session);
+    else
+      reply.add("none");
+    reply.add(" bytes/s\r\n");
+  }
+}
+
+// Send listing of current directory for LIST ( kind 'L' ), MLSD ( 'M' )
+//   or NLST ( 'N' ), once the data connection is established
+
+void FtpSession::doList( char kind )
+{
+  if( transferStatus > 0 )
+  {
+    reply.add("425 Data connection busy\r\n");
+    return;
+  }
+  if( ! zOpen())
+  {
+    reply.add("451 Not enough memory for MODE Z\r\n");
+    return;
+  }
+  if( ! bufOpen())
+  {
+    reply.add("425 No transfer buffer free, try again later\r\n");
+    zClose();
+    return;
+  }
+  traceBegin( kind, cwdName );
+  dataOpen( kind );
+}
+
+// Data connection of a listing is established: start to send it
+//
+// Entries are taken from the cache of listings when the directory has been
+//   read recently, else read from the card and stored in the cache
+
+void FtpSession::startList( char kind )
+{
+  reply.add("150 Accepted data connection\r\n");
+  FtpListCache & cache = server->listCache;
+  listKind = kind;
+  listCount = 0;
+  listPos = 0;
+  listSlot = cache.find( cwdName );
+  listCached = listSlot >= 0;
+  if( ! listCached )
+  {
+    uint32_t t = micros();
+    boolean  ok = listDir.openDir( cwdName );
+    trace.microsFile += micros() - t;
+    if( ! ok ) {
+      reply.add("550 Can't open directory ");
+      reply.add(cwdName);
+      reply.add("\r\n");
+      traceEnd( FTP_TRACE_FILE );
       data.stop();
+      zClose();
+      bufClose();
+      return;
     }
+    listSlot = cache.begin( cwdName );
   }
-  //
-  //  NOOP
-  //
-  else if( ! strcmp( command, "NOOP" ))
+  if( zs != NULL )
+    zs->deflateBegin( zLevel );
+  bufLen[ 0 ] = 0;
+  bufPos = 0;
+  fileEnd = false;
+  transferStatus = 4;
+}
+
+// Send listing to client
+//
+// As RETR, only what the socket can take without waiting, and the limits
+//   of downloads allow, is written, so a client which does not read its
+//   listing holds back no other session.
+//   Lines are formatted in buf when it has been sent, and in MODE Z go
+//   through zs
+
+boolean FtpSession::doSendList()
+{
+  if( zs != NULL )
   {
-    // dataPort = 0;
-    client.print("200 Zzz...\r\n");
+    int32_t nb = zs->pending();
+    int32_t room = rateAllowed( FTP_DOWN, data.availableForWrite());
+    if( room < nb )
+      nb = room;
+    if( nb > 0 )
+    {
+      nb = dataSend( zs->pendingData(), nb );
+      rateTake( FTP_DOWN, nb );
+      zs->take( nb );
+    }
+    if( nb == 0 && zs->pending() > 0 && ! data.connected())
+    {
+      abortTransfer( FTP_TRACE_CLOSED );
+      return false;
+    }
+    if( zs->pending() == 0 && bufPos < bufLen[ 0 ] )
+      bufPos += zs->deflate((uint8_t *) buf + bufPos, bufLen[ 0 ] - bufPos );
   }
-  //
-  //  RETR - Retrieve
-  //
-  else if( ! strcmp( command, "RETR" ))
+  else if( bufPos < bufLen[ 0 ] )
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path ))
+    int32_t nb = bufLen[ 0 ] - bufPos;
+    int32_t room = rateAllowed( FTP_DOWN, data.availableForWrite());
+    if( room < nb )
+      nb = room;
+    if( nb > 0 )
     {
-      if( ! FAT.exists( path )) {
-        client.print("550 File ");
-        client.print(path);
-        client.print(" not found\r\n");
-      } else if( ! file.open( path, O_READ )) {
-        client.print("450 Can't open ");
-        client.print(path);
-        client.print("\r\n");
-      } else if( ! dataConnect())
-        client.print("425 No data connection\r\n");
-      else
-      {
-        #ifdef FTP_DEBUG
-          Serial.print(F("Sending "));
-          Serial.println(parameters);
-        #endif
-        client.print("150-Connected to port ");
-        client.print(dataPort);
-        client.print("\r\n");
-
-        client.print("150 ");
-        client.print(file.fileSize());
-        client.print(" bytes to download\r\n");
-        millisBeginTrans = millis();
-        bytesTransfered = 0;
-        transferStatus = 1;
-      }
+      nb = dataSend((uint8_t *) buf + bufPos, nb );
+      rateTake( FTP_DOWN, nb );
+      bufPos += nb;
+    }
+    if( nb == 0 && ! data.connected())
+    {
+      abortTransfer( FTP_TRACE_CLOSED );
+      return false;
     }
   }
-  //
-  //  STOR - Store
-  //
-  else if( ! strcmp( command, "STOR" ))
+  if( ! fileEnd && bufLen[ 0 ] - bufPos < FTP_MSS )
+    fillList();
+  if( fileEnd && bufPos == bufLen[ 0 ] && ( zs == NULL || zs->deflateEnd()))
+  {
+    if( ! listCached )
+      server->listCache.end( listSlot );
+    listSlot = -1;
+    traceEnd( FTP_TRACE_DONE );
+    closeFile();
+    if( listKind == 'M' )
+      reply.add("226-options: -a -l\r\n");
+    reply.add("226 ");
+    reply.add(listCount);
+    reply.add(" matches total\r\n");
+    data.stop();
+    return false;
+  }
+  return true;
+}
+
+// Format in buf the next lines of the listing, as long as the longest one
+//   still fits
+
+void FtpSession::fillList()
+{
+  FtpListCache & cache = server->listCache;
+  FtpListEntry   entry;
+
+  memmove( buf, buf + bufPos, bufLen[ 0 ] - bufPos );
+  bufLen[ 0 ] -= bufPos;
+  bufPos = 0;
+  while( bufLen[ 0 ] + LIST_LINE_MAX <= FTP_XFER_SIZE )
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path ))
+    if( listCached )
     {
-      if( ! file.open( path, O_CREAT | O_WRITE )) {
-        client.print("451 Can't open/create ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else if( ! dataConnect())
+      if( ! cache.next( listSlot, & listPos, & entry ))
+        fileEnd = true;
+    }
+    else
+    {
+      uint32_t t = micros();
+      if( listDir.nextFile())
       {
-        client.print("425 No data connection\r\n");
-        file.close();
+        entry.name = listDir.fileName();
+        entry.isDir = listDir.isDir();
+        entry.size = listDir.fileSize();
+        entry.modDate = listDir.fileModDate();
+        entry.modTime = listDir.fileModTime();
+        listSlot = cache.add( listSlot, & entry );
       }
       else
-      {
-        #ifdef FTP_DEBUG
-          Serial.print(F("Receiving "));
-          Serial.println(parameters);
-        #endif
-        client.print("150 Connected to port ");
-        client.print(dataPort);
-        client.print("\r\n");
-        millisBeginTrans = millis();
-        bytesTransfered = 0;
-        transferStatus = 2;
-      }
+        fileEnd = true;
+      trace.microsFile += micros() - t;
     }
+    if( fileEnd )
+      break;
+    bufLen[ 0 ] = formatListEntry( buf + bufLen[ 0 ], listKind, & entry ) - buf;
+    listCount ++;
   }
-  //
-  //  MKD - Make Directory
-  //
-  else if( ! strcmp( command, "MKD" ))
+}
+
+// Write at p the line of listing for entry
+//
+// return:
+//    pointer after the end of the line
+
+char * FtpSession::formatListEntry( char * p, char kind, FtpListEntry * entry )
+{
+  if( kind == 'L' )
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No directory name\r\n");
-    else if( makePath( path ))
-    {
-      if( FAT.exists( path )) {
-        client.print("521 \"");
-        client.print(parameters);
-        client.print("\" directory already exists\r\n");
-      } else {
-        #ifdef FTP_DEBUG
-          Serial.print(F("Creating directory "));
-          Serial.println(parameters);
-        #endif
-        if( FAT.mkdir( path )) {
-          client.print("257 \"");
-          client.print(parameters);
-          client.print("\" created\r\n");
-        } else {
-          client.print("550 Can't create \"");
-          client.print(parameters);
-          client.print("\"\r\n");
-        }
-      }
+    if( entry->isDir )
+      p = putStr( p, "+/" );
+    else {
+      p = putStr( p, "+r,s" );
+      p = putUInt( p, entry->size );
     }
+    p = putStr( p, ",\t" );
   }
-  //
-  //  RMD - Remove a Directory 
-  //
-  else if( ! strcmp( command, "RMD" ))
+  else if( kind == 'M' )
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No directory name\r\n");
-    else if( makePath( path ))
-    {
-      #ifdef FTP_DEBUG
-        Serial.print(F("Deleting "));
-        Serial.println(path);
-      #endif
-      if( ! FAT.exists( path )) {
-        client.print("550 File ");
-        client.print(parameters);
-        client.print(" not found\r\n");
-      } else if( FAT.rmdir( path )) {
-        client.print("250 \"");
-        client.print(parameters);
-        client.print("\" deleted\r\n");
-      } else {
-        client.print("501 Can't delete \"");
-        client.print(parameters);
-        client.print("\"\r\n");
-      }
-    }
+    p = putStr( p, entry->isDir ? "Type=dir;Size=" : "Type=file;Size=" );
+    p = putUInt( p, entry->size );
+    p = putStr( p, ";Modify=" );
+    makeDateTimeStr( p, entry->modDate, entry->modTime );
+    p = putStr( p + 14, "; " );
   }
-  //
-  //  RNFR - Rename From 
-  //
-  else if( ! strcmp( command, "RNFR" ))
+  p = putStr( p, entry->name );
+  return putStr( p, "\r\n" );
+}
+
+// Write to the data connection, counting bytes and time for the trace
+//
+// return:
+//    number of bytes written, less than len if the connection took no more
+
+uint16_t FtpSession::dataSend( const uint8_t * p, uint16_t len )
+{
+  uint32_t t = micros();
+  uint16_t nb = data.write( p, len );
+  trace.microsNet += micros() - t;
+  bytesTransfered += nb;
+  return nb;
+}
+
+// Open the data connection for RETR ( next = 1 ), STOR ( 2 ) or a listing
+//   (its kind)
+//
+// The connection is established in the background: service() calls
+//   dataWait() until the command can go on, or 425 is sent after
+//   FTP_DATA_CONNECT_TIMEOUT ms
+
+void FtpSession::dataOpen( uint8_t next )
+{
+  dataNext = next;
+  millisDataTimeOut = millis() + FTP_DATA_CONNECT_TIMEOUT;
+  transferStatus = 3;
+  if( ! data.connected() && ! dataPassiveConn &&
+      ! data.connectStart( dataIp, dataPort ))
+    millisDataTimeOut = millis();   // fail at once
+  dataWait();
+}
+
+// Stop listening on the port given by PASV, which can be given again
+
+void FtpSession::pasvClose()
+{
+  server->pasvRelease( pasvPort );
+  pasvPort = -1;
+}
+
+// Wait for the data connection
+//
+// return:
+//    true, while the connection is being established
+
+boolean FtpSession::dataWait()
+{
+  boolean ok = false;
+  if( dataPassiveConn )
   {
-    buf[ 0 ] = 0;
-    if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( buf ))
+    if( ! data.connected() && pasvPort >= 0 )
     {
-      if( ! FAT.exists( buf )) {
-        client.print("550 File ");
-        client.print(parameters);
-        client.print(" not found\r\n");
-      } else {
+      data = server->pasvServers[ pasvPort ]->connected();
+      // only the client of the control connection may connect
+      if( data && ! ( data.remoteIP() == client.remoteIP()))
+      {
         #ifdef FTP_DEBUG
-          Serial.print(F("Renaming "));
-          Serial.println(buf);
+          Serial.println(F("Data connection from another address refused"));
         #endif
-        client.print("350 RNFR accepted - file exists, ready for destination\r\n");
-        rnfrCmd = true;
+        data.stop();
       }
+      else if( data )
+        pasvClose();
     }
+    ok = data.connected();
+  }
+  else
+  {
+    if( data.connected() && ! data.connecting())
+      ok = true;
+    else if( ! data.connecting())   // refused
+      millisDataTimeOut = millis();
   }
-  //
-  //  RNTO - Rename To 
-  //
-  else if( ! strcmp( command, "RNTO" ))
-  {
-    char path[ FTP_CWD_SIZE ];
-    char dir[ FTP_FIL_SIZE ];
-    if( strlen( buf ) == 0 || ! rnfrCmd )
-      client.print("503 Need RNFR before RNTO\r\n");
-    else if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path ))
+  if( ! ok && (int32_t) ( millisDataTimeOut - millis() ) > 0 )
+    return true;
+
+  transferStatus = 0;
+  trace.millisData = millis();
+  if( ok )
+    server->metrics.sample( FTP_H_CONNECT, trace.millisData - trace.millisStart );
+  if( ! ok )
+  {
+    traceEnd( FTP_TRACE_NO_DATA );
+    reply.add("425 No data connection\r\n");
+    file.close();
+    zClose();
+    bufClose();
+    data.stop();
+    pasvClose();
+  }
+  else if( dataNext == 1 )
+    startRetrieve();
+  else if( dataNext == 2 )
+    startStore();
+  else
+    startList( dataNext );
+  return false;
+}
+
+// Send file to client
+//
+// Reading the file and sending to the socket are pipelined through
+//   FTP_RETR_BUFFERS buffers: only what the socket can take without waiting
+//   is written, so the next buffer is read from the card while the
+//   ethernet chip is busy sending the previous ones
+//
+// In MODE Z, the buffers are compressed by zs and what is sent is its
+//   output
+
+boolean FtpSession::doRetrieve()
+{
+  #if FTP_SENDFILE
+    if( direct )
+      return doSendFile();
+  #endif
+  if( zs != NULL )
+  {
+    int32_t nb = zs->pending();
+    int32_t room = rateAllowed( FTP_DOWN, data.availableForWrite());
+    if( room < nb )
+      nb = room;
+    if( nb > 0 )
     {
-      if( FAT.exists( path )) {
-        client.print("553 ");
-        client.print(parameters);
-        client.print(" already exists\r\n");
-      } else {
-        strcpy( dir, path );
-        char * psep = strrchr( dir, '/' );
-        boolean fail = psep == NULL;
-        if( ! fail )
-        {
-          if( psep == dir )
-            psep ++;
-          * psep = 0;
-          #if FAT_SYST == 0
-            fail = ! file.open( dir ) || ! file.isDir();
-            file.close();
-          #else
-            fail = ! FAT.isDir( dir );
-          #endif
-          if( fail ) {
-            client.print("550 \"");
-            client.print(dir);
-            client.print("\" is not directory\r\n");
-          } else {
-            #ifdef FTP_DEBUG
-              Serial.print(F("Renaming "));
-              Serial.print(buf);
-              Serial.print(" to ");
-              Serial.println(path);
-            #endif
-            if( FAT.rename( buf, path ))
-              client.print("250 File successfully renamed or moved\r\n");
-            else
-              fail = true;
-          }
-        }
-        if( fail )
-          client.print("451 Rename/move failure\r\n");
-      }
+      nb = dataSend( zs->pendingData(), nb );
+      rateTake( FTP_DOWN, nb );
+      zs->take( nb );
+    }
+    if( nb == 0 && zs->pending() > 0 && ! data.connected())
+    {
+      abortTransfer( FTP_TRACE_CLOSED );
+      return false;
+    }
+    if( zs->pending() == 0 && bufCount > 0 )
+      advanceBuffer( zs->deflate((uint8_t *) buf + bufFirst * FTP_BUF_SIZE + bufPos,
+                                 bufLen[ bufFirst ] - bufPos ));
+  }
+  else if( bufCount > 0 )
+  {
+    int16_t nb = bufLen[ bufFirst ] - bufPos;
+    int32_t room = rateAllowed( FTP_DOWN, data.availableForWrite());
+    if( room < nb )
+      nb = room;
+    if( nb > 0 )
+    {
+      nb = dataSend((uint8_t *) buf + bufFirst * FTP_BUF_SIZE + bufPos, nb );
+      rateTake( FTP_DOWN, nb );
+      advanceBuffer( nb );
     }
-    rnfrCmd = false;
-  }
-
-  ///////////////////////////////////////
-  //                                   //
-  //   EXTENSIONS COMMANDS (RFC 3659)  //
-  //                                   //
-  ///////////////////////////////////////
-
-  //
-  //  FEAT - New Features
-  //
-  else if( ! strcmp( command, "FEAT" ))
-  {
-    client.print("211-Extensions suported:\r\n");
-    client.print(" MDTM\r\n");
-    client.print(" MLSD\r\n");
-    client.print(" SIZE\r\n");
-    client.print(" SITE FREE\r\n");
-    client.print("211 End.\r\n");
-  }
-  //
-  //  MDTM - File Modification Time (see RFC 3659)
-  //
-  else if( ! strcmp( command, "MDTM" ))
-  {
-    char path[ FTP_CWD_SIZE ];
-    char * fname = parameters;
-    uint16_t year;
-    uint8_t month, day, hour, minute, second, setTime;
-    setTime = getDateTime( & year, & month, & day, & hour, & minute, & second );
-    // fname point to file name
-    fname += setTime;
-    if( strlen( fname ) <= 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path, fname ))
+    if( nb == 0 && ! data.connected())
     {
-      if( ! FAT.exists( path )) {
-        client.print("550 No such file ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else if( setTime ) // set file modification time
-      {
-        if( FAT.timeStamp( path, year, month, day, hour, minute, second ))
-          client.print("200 Ok\r\n");
-        else
-          client.print("550 Unable to modify time\r\n");
-      }
-      else // get file modification time
-      {
-        uint16_t date, time;
-        if( FAT.getFileModTime( path, & date, & time ))
-        {
-          char dtStr[ 15 ];
-          client.print("213 ");
-          client.print(makeDateTimeStr( dtStr, date, time ));
-          client.print("\r\n");
-        }
-        else
-          client.print("550 Unable to retrieve time\r\n");
-      }
+      abortTransfer( FTP_TRACE_CLOSED );
+      return false;
     }
   }
-  //
-  //  SIZE - Size of the file
-  //
-  else if( ! strcmp( command, "SIZE" ))
+  if( ! fileEnd && bufCount < FTP_RETR_BUFFERS )
   {
-    char path[ FTP_CWD_SIZE ];
-    if( strlen( parameters ) == 0 )
-      client.print("501 No file name\r\n");
-    else if( makePath( path ))
+    uint8_t  i = ( bufFirst + bufCount ) % FTP_RETR_BUFFERS;
+    char *   b = buf + i * FTP_BUF_SIZE;
+    uint32_t t = micros();
+    int16_t  nb;
+    // in TYPE A, text is read in the second half of the buffer and
+    //   expanded from its beginning
+    if( transferType == 'A' )
     {
-      if( ! FAT.exists( path )) {
-        client.print("550 No such file ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else if( ! file.open( path )) {
-        client.print("450 Can't open ");
-        client.print(parameters);
-        client.print("\r\n");
-      } else {
-        client.print("213 ");
-        client.print(file.fileSize());
-        client.print("\r\n");
-        file.close();
-      }
+      nb = file.read( b + FTP_BUF_SIZE / 2, FTP_BUF_SIZE / 2 );
+      if( nb > 0 )
+        nb = ftpTextToNet( b, b + FTP_BUF_SIZE / 2, nb, & crText );
     }
-  }
-  //
-  //  SITE - System command
-  //
-  else if( ! strcmp( command, "SITE" ))
-  {
-    if( ! strcmp( parameters, "FREE" )) {
-      client.print("200 ");
-      client.print(FAT.free());
-      client.print(" MB free of ");
-      client.print(FAT.capacity());
-      client.print(" MB capacity\r\n");
-    } else {
-      client.print("500 Unknow SITE command ");
-      client.print(parameters);
-      client.print("\r\n");
+    else
+      nb = file.read( b, FTP_BUF_SIZE );
+    trace.microsFile += micros() - t;
+    if( nb > 0 )
+    {
+      bufLen[ i ] = nb;
+      bufCount ++;
     }
+    else
+      fileEnd = true;
+  }
+  if( fileEnd && bufCount == 0 && ( zs == NULL || zs->deflateEnd()))
+  {
+    closeTransfer();
+    return false;
   }
-  //
-  //  Unrecognized commands ...
-  //
-  else
-    client.print("500 Unknow command\r\n");
-  
   return true;
 }
 
-int FtpServer::dataConnect()
-{
-  if( ! data.connected() )
-    if( dataPassiveConn )
-      data = dataServer.connected();
-    else
-      data.connect( dataIp, dataPort );
-  return data;
-}
+#if FTP_SENDFILE
 
-boolean FtpServer::doRetrieve()
+// Send file to client without copying it: the backend moves the bytes
+//   from the file to the socket, as much as the socket can take
+
+boolean FtpSession::doSendFile()
 {
-  int16_t nb = file.read( buf, FTP_BUF_SIZE );
+  uint32_t n = rateAllowed( FTP_DOWN, fileLeft < FTP_SENDFILE_CHUNK
+                                      ? fileLeft : FTP_SENDFILE_CHUNK );
+  uint32_t t = micros();
+  int32_t  nb = n > 0 ? data.sendFile( file, n ) : 0;
+  trace.microsNet += micros() - t;
   if( nb > 0 )
   {
-    data.write( buf, nb );
+    fileLeft -= nb;
     bytesTransfered += nb;
-    return true;
+    rateTake( FTP_DOWN, nb );
+  }
+  else if( nb < 0 || ! data.connected())
+  {
+    // file shortened while sent, or client gone
+    abortTransfer( data.connected() ? FTP_TRACE_FILE : FTP_TRACE_CLOSED );
+    return false;
+  }
+  if( fileLeft == 0 )
+  {
+    closeTransfer();
+    return false;
+  }
+  return true;
+}
+
+#endif
+
+// nb bytes of the first buffer have been sent: go to the next buffer when
+//   it is empty
+
+void FtpSession::advanceBuffer( uint16_t nb )
+{
+  bufPos += nb;
+  if( bufPos == bufLen[ bufFirst ] )
+  {
+    bufFirst = ( bufFirst + 1 ) % FTP_RETR_BUFFERS;
+    bufCount --;
+    bufPos = 0;
   }
-  closeTransfer();
-  return false;
 }
 
-boolean FtpServer::doStore()
+// Receive file from client
+//
+// Incoming data are gathered in buf and written to the file only when
+//   they fill it up to a sector boundary, so the file system is not
+//   forced to read/modify/write sectors for each received segment
+//
+// In MODE Z, incoming data go to zs, which decompresses them to buf. Once
+//   the client has closed the connection, the data still in zs are
+//   decompressed before the transfer ends
+//
+// In TYPE A, data are converted where they arrive in buf. A CR held back
+//   at the end of previous data may have to be written before them, so
+//   they arrive one byte further
+
+boolean FtpSession::doStore()
 {
-  if( data.connected() )
+  boolean  connected = data.connected();
+  uint16_t target = FTP_XFER_SIZE - filePos % FTP_SECTOR_SIZE;
+  uint16_t skip = transferType == 'A' && crText ? 1 : 0;
+  if( stageLen > 0 && stageLen + skip >= target )
+  {
+    if( ! writeStage())
+      return false;
+    target = FTP_XFER_SIZE - filePos % FTP_SECTOR_SIZE;
+  }
+  // buf of a single sector, 1 byte before its end: go past the boundary
+  if( stageLen + skip >= target )
+    target = stageLen + skip + 1;
+  if( zs != NULL )
+  {
+    uint16_t room;
+    uint8_t * in = zs->inflateInput( & room );
+    room = rateAllowed( FTP_UP, room );
+    uint32_t t = micros();
+    int16_t  nb = connected && room > 0 ? data.read( in, room ) : 0;
+    trace.microsNet += micros() - t;
+    if( nb > 0 )
+    {
+      zs->inflateInputAdd( nb );
+      bytesTransfered += nb;
+      rateTake( FTP_UP, nb );
+    }
+    int32_t n = zs->inflate((uint8_t *) buf + stageLen + skip,
+                            target - stageLen - skip, ! connected );
+    if( n == -2 )                   // window of stream larger than ours
+    {
+      traceEnd( FTP_TRACE_BAD_DATA );
+      closeFile();
+      data.stop();
+      transferStatus = 0;
+      reply.add("504 Window of compressed data larger than ");
+      reply.add((uint32_t) FTP_INFLATE_WINDOW).add(" bytes\r\n");
+      return false;
+    }
+    if( n < 0 )
+    {
+      #ifdef FTP_DEBUG
+        Serial.println(F("Invalid compressed data"));
+      #endif
+      abortTransfer( FTP_TRACE_BAD_DATA );
+      return false;
+    }
+    stageLen += stageText( skip, n );
+    if( stageLen == target && ! writeStage())
+      return false;
+    if( connected || n > 0 )
+      return true;
+  }
+  else if( connected )
   {
-    int16_t nb = data.read((uint8_t *) buf, FTP_BUF_SIZE );
+    uint16_t room = rateAllowed( FTP_UP, target - stageLen - skip );
+    uint32_t t = micros();
+    int16_t  nb = room > 0 ? data.read((uint8_t *) buf + stageLen + skip, room ) : 0;
+    trace.microsNet += micros() - t;
     if( nb > 0 )
     {
-      file.write( buf, nb );
+      stageLen += stageText( skip, nb );
       bytesTransfered += nb;
+      rateTake( FTP_UP, nb );
+      if( stageLen == target && ! writeStage())
+        return false;
     }
     return true;
   }
+  // CR at the very end of the text
+  if( transferType == 'A' && crText )
+    buf[ stageLen ++ ] = '\r';
+  if( stageLen > 0 && ! writeStage())
+    return false;
   closeTransfer();
   return false;
 }
 
-void FtpServer::closeTransfer()
+// n bytes have been received at buf + stageLen + skip. Convert them in
+//   TYPE A
+//
+// return:
+//    number of bytes added to buf at stageLen
+
+uint16_t FtpSession::stageText( uint16_t skip, uint16_t n )
+{
+  if( transferType != 'A' )
+    return n;
+  return ftpTextFromNet( buf + stageLen, buf + stageLen + skip, n, & crText );
+}
+
+// Write to file the data gathered in buf
+//
+// return:
+//    false if the file can not be written (transfer is then aborted)
+
+boolean FtpSession::writeStage()
+{
+  if( filePos % FTP_SECTOR_SIZE == 0 && stageLen % FTP_SECTOR_SIZE == 0 )
+    server->alignedWrites ++;
+  else
+    server->partialWrites ++;
+  uint32_t t = micros();
+  boolean  ok = file.write( buf, stageLen ) == stageLen;
+  trace.microsFile += micros() - t;
+  if( ! ok )
+  {
+    abortTransfer( FTP_TRACE_FILE );
+    return false;
+  }
+  filePos += stageLen;
+  stageLen = 0;
+  return true;
+}
+
+void FtpSession::closeTransfer()
 {
   uint32_t deltaT = (int32_t) ( millis() - millisBeginTrans );
   if( deltaT > 0 && bytesTransfered > 0 )
   {
-    client.print("226-File successfully transferred\r\n");
-    client.print("226 ");
-    client.print(deltaT);
-    client.print(" ms, ");
-    client.print(bytesTransfered / deltaT);
-    client.print(" kbytes/s\r\n");
+    reply.add("226-File successfully transferred\r\n");
+    reply.add("226 ");
+    reply.add(deltaT);
+    reply.add(" ms, ");
+    reply.add(bytesTransfered / deltaT);
+    reply.add(" kbytes/s\r\n");
   }
   else
-    client.print("226 File successfully transferred\r\n");
+    reply.add("226 File successfully transferred\r\n");
   
-  file.close();
+  traceEnd( FTP_TRACE_DONE );
+  closeFile();
   data.stop();
 }
 
-void FtpServer::abortTransfer()
+void FtpSession::abortTransfer( uint8_t reason )
 {
   if( transferStatus > 0 )
   {
-    file.close();
+    traceEnd( reason );
+    closeFile();
     data.stop(); 
-    client.print("426 Transfer aborted\r\n");
+    reply.add("426 Transfer aborted\r\n");
     #ifdef FTP_DEBUG
       Serial.println(F("Transfer aborted!"));
     #endif
@@ -984,84 +2428,288 @@ void FtpServer::abortTransfer()
   transferStatus = 0;
 }
 
-// Read a char from client connected to ftp server
+// Bytes which may be transferred now in direction dir (FTP_DOWN, FTP_UP),
+//   at most max, as allowed by the limits of the session and of the server.
+//   A transfer held back by a limit makes no progress, so service() goes on
+//   with the other sessions instead of waiting
+
+uint32_t FtpSession::rateAllowed( uint8_t dir, uint32_t max )
+{
+  return server->rateAll[ dir ].allowed( rate[ dir ].allowed( max ));
+}
+
+void FtpSession::rateTake( uint8_t dir, uint32_t n )
+{
+  rate[ dir ].take( n );
+  server->rateAll[ dir ].take( n );
+}
+
+// Take a stream for the next transfer, if it is in MODE Z
+//
+// return:
+//    false if no stream is available
+
+boolean FtpSession::zOpen()
+{
+  if( transferMode != 'Z' || zs != NULL )
+    return true;
+  zs = server->zTake();
+  return zs != NULL;
+}
+
+void FtpSession::zClose()
+{
+  server->zRelease( zs );
+  zs = NULL;
+}
+
+// Take a buffer for the next transfer
+//
+// return:
+//    false if no buffer is available
+
+boolean FtpSession::bufOpen()
+{
+  if( buf == NULL )
+    buf = server->bufTake();
+  return buf != NULL;
+}
+
+void FtpSession::bufClose()
+{
+  server->bufRelease( buf );
+  buf = NULL;
+}
+
+// Give room for the path of RNFR in rnfrPath
+//
+// return:
+//    false if all the slots are in use
+
+boolean FtpSession::rnfrOpen()
+{
+  #if FTP_RNFR_SLOTS > 0
+    rnfrPath = server->rnfrTake();
+  #else
+    rnfrPath = transferPath;
+  #endif
+  return rnfrPath != NULL;
+}
+
+// Forget the path given by RNFR
+
+void FtpSession::rnfrClose()
+{
+  #if FTP_RNFR_SLOTS > 0
+    server->rnfrRelease( rnfrPath );
+  #endif
+  rnfrPath = NULL;
+}
+
+// Start the trace of a transfer of path
+
+void FtpSession::traceBegin( char cmd, const char * path )
+{
+  memset( & trace, 0, sizeof( trace ));
+  trace.cmd = cmd;
+  trace.mode = transferMode;
+  trace.session = sessionNum;
+  uint16_t len = strlen( path );
+  if( len >= FTP_TRACE_PATH )
+    path += len - FTP_TRACE_PATH + 1;
+  strcpy( trace.path, path );
+  trace.millisStart = millis();
+  bytesTransfered = 0;
+}
+
+// End the trace of the transfer and give it to the server
+
+void FtpSession::traceEnd( uint8_t result )
+{
+  trace.result = result;
+  trace.bytes = bytesTransfered;
+  trace.millisEnd = millis();
+  if( trace.millisData == 0 )
+    trace.millisData = trace.millisEnd;
+  server->traceAdd( & trace );
+
+  FtpMetrics & m = server->metrics;
+  m.add( trace.cmd == 'S' ? FTP_M_BYTES_IN : FTP_M_BYTES_OUT, trace.bytes );
+  if( result == FTP_TRACE_NO_DATA )
+    m.inc( FTP_M_DATA_FAILS );
+  else if( result != FTP_TRACE_DONE )
+    m.inc( FTP_M_ABORTS );
+  else
+  {
+    m.inc( FTP_M_TRANSFERS );
+    uint32_t ms = trace.millisEnd - trace.millisData;
+    m.sample( FTP_H_RATE, trace.bytes / ( ms > 0 ? ms : 1 ));
+  }
+}
+
+// Close file or directory of transfer
+//
+// A file preallocated by ALLO is cut to the size actually received. The
+//   listing of a directory not read to its end is not kept in the cache
+
+void FtpSession::closeFile()
+{
+  if( preAllocated )
+    file.truncate( filePos );
+  preAllocated = false;
+  file.close();
+  zClose();
+  bufClose();
+  if( transferStatus == 2 || ( transferStatus == 3 && dataNext == 2 ))
+    server->invalidate( transferPath );
+  if( transferStatus == 4 )
+  {
+    if( ! listCached )
+      listDir.closeDir();
+    server->listCache.release( listSlot );
+    listSlot = -1;
+  }
+}
+
+// Read a command line from client connected to ftp server
+//
+//  All bytes available from client are read at once in cmdLine, where
+//    they wait to be executed when client sends several commands in a row.
+//    The line returned by the previous call is removed from cmdLine
 //
-//  update cmdLine and command buffers, iCL and parameters pointers
+//  update cmdLine buffer, verb, iCL, lineLen and parameters pointers
+//
+//  A line held back during a transfer is returned again, as it was parsed
 //
 //  return:
-//    -2 if buffer cmdLine is full
-//    -1 if line not completed
+//    -2 if line is too long or is not a command
+//    -1 if no complete line has been received
 //     0 if empty line received
-//    length of cmdLine (positive) if no empty line received 
+//     1 if a command has been received
 
-int8_t FtpServer::readChar()
+int8_t FtpSession::readLine()
 {
-  int8_t rc = -1;
+  if( lineHeld )
+  {
+    lineHeld = false;
+    return 1;
+  }
+  if( lineLen > 0 )
+  {
+    iCL -= lineLen;
+    memmove( cmdLine, cmdLine + lineLen, iCL );
+    lineLen = 0;
+  }
 
-  if( client.available())
+  char * pEol = (char *) memchr( cmdLine, '\n', iCL );
+  if( pEol == NULL )
   {
-    char c = client.read();
-    #ifdef FTP_DEBUG
-      Serial.print(c);
-    #endif
-    if( c == '\\' )
-      c = '/';
-    if( c != '\r' )
-      if( c != '\n' )
-      {
-        if( iCL < FTP_CMD_SIZE )
-          cmdLine[ iCL ++ ] = c;
-        else
-          rc = -2; //  Line too long
-      }
-      else
+    if( iCL < FTP_CMD_SIZE && client.available() > 0 )
+    {
+      int16_t nb = client.read((uint8_t *) cmdLine + iCL, FTP_CMD_SIZE - iCL );
+      if( nb > 0 )
       {
-        cmdLine[ iCL ] = 0;
-        command[ 0 ] = 0;
-        parameters = NULL;
-        // empty line?
-        if( iCL == 0 )
-          rc = 0;
-        else
-        {
-          rc = iCL;
-          // search for space between command and parameters
-          parameters = strchr( cmdLine, ' ' );
-          if( parameters != NULL )
-          {
-            if( parameters - cmdLine > 4 )
-              rc = -2; // Syntax error
-            else
-            {
-              strncpy( command, cmdLine, parameters - cmdLine );
-              command[ parameters - cmdLine ] = 0;
-              
-              while( * ( ++ parameters ) == ' ' )
-                ;
-            }
-          }
-          else if( strlen( cmdLine ) > 4 )
-            rc = -2; // Syntax error.
-          else
-            strcpy( command, cmdLine );
-          iCL = 0;
-        }
+        pEol = (char *) memchr( cmdLine + iCL, '\n', nb );
+        iCL += nb;
       }
-    if( rc > 0 )
-      for( uint8_t i = 0 ; i < strlen( command ); i ++ )
-        command[ i ] = toupper( command[ i ] );
-    if( rc == -2 )
+    }
+    if( pEol == NULL )
     {
+      if( iCL < FTP_CMD_SIZE )
+        return -1;
+      // Line too long: forget it, up to its end
       iCL = 0;
-      client.print("500 Syntax error\r\n");
+      if( skipLine )
+        return 0;
+      skipLine = true;
+      reply.add("500 Syntax error\r\n");
+      return -2;
+    }
+  }
+  lineLen = pEol - cmdLine + 1;
+  if( skipLine )                    // end of a line too long
+  {
+    skipLine = false;
+    return 0;
+  }
+
+  * pEol = 0;
+  if( pEol > cmdLine && pEol[ -1 ] == '\r' )
+    * -- pEol = 0;
+  for( char * p = cmdLine; p < pEol; p ++ )
+    if( * p == '\\' )
+      * p = '/';
+  #ifdef FTP_DEBUG
+    Serial.println(cmdLine);
+  #endif
+
+  verb = 0;
+  parameters = pEol;                // no parameters
+  // empty line?
+  if( pEol == cmdLine )
+    return 0;
+  // search for space between command and parameters
+  char *   pSpace = strchr( cmdLine, ' ' );
+  uint16_t lVerb = pSpace == NULL ? pEol - cmdLine : pSpace - cmdLine;
+  if( lVerb > 4 )
+  {
+    reply.add("500 Syntax error\r\n");
+    return -2;
+  }
+  // pack verb in upper case, padded with 0
+  for( uint8_t i = 0; i < 4; i ++ )
+    verb = verb << 8 | ( i < lVerb ? toupper( cmdLine[ i ] ) : 0 );
+  if( pSpace != NULL )
+  {
+    parameters = pSpace;
+    while( * ( ++ parameters ) == ' ' )
+      ;
+  }
+  return 1;
+}
+
+// Search the lines received after the line held back for ABOR, reading
+//   first what the client has sent since, and remove it from cmdLine so it
+//   can be executed before the held line
+//
+//  return:
+//    true if an ABOR line has been found
+
+boolean FtpSession::takeAbort()
+{
+  if( iCL < FTP_CMD_SIZE && client.available() > 0 )
+  {
+    int16_t nb = client.read((uint8_t *) cmdLine + iCL, FTP_CMD_SIZE - iCL );
+    if( nb > 0 )
+      iCL += nb;
+  }
+  uint16_t pos = lineLen;
+  char *   pEol;
+  while(( pEol = (char *) memchr( cmdLine + pos, '\n', iCL - pos )) != NULL )
+  {
+    char *   p = cmdLine + pos;
+    uint16_t len = pEol - p + 1;
+    uint16_t lVerb = pEol > p && pEol[ -1 ] == '\r' ? len - 2 : len - 1;
+    uint32_t v = 0;
+    if( lVerb >= 4 && ( lVerb == 4 || p[ 4 ] == ' ' ))
+      for( uint8_t i = 0; i < 4; i ++ )
+        v = v << 8 | toupper( p[ i ] );
+    if( v == FTP_VERB( "ABOR" ))
+    {
+      iCL -= len;
+      memmove( p, p + len, iCL - pos );
+      return true;
     }
+    pos += len;
   }
-  return rc;
+  return false;
 }
 
 // Make complete path/name from cwdName and parameters
 //
 // 3 possible cases: parameters can be absolute path, relative path or only the name
+// The path is normalized: '.', '..' and repeated '/' are resolved, so it never
+//   goes above the root and can be compared with cwdName
 //
 // parameters:
 //   fullName : where to store the path/name
@@ -1069,18 +2717,20 @@ int8_t FtpServer::readChar()
 // return:
 //    true, if done
 
-boolean FtpServer::makePath( char * fullName )
+boolean FtpSession::makePath( char * fullName )
 {
   return makePath( fullName, parameters );
 }
 
-boolean FtpServer::makePath( char * fullName, char * param )
+boolean FtpSession::makePath( char * fullName, char * param )
 {
   if( param == NULL )
     param = parameters;
     
-  // Root or empty?
-  if( strcmp( param, "/" ) == 0 || strlen( param ) == 0 )
+  uint16_t lParam = strlen( param );
+  uint16_t l = 0;
+  // Empty? Means root
+  if( lParam == 0 )
   {
     strcpy( fullName, "/" );
     return true;
@@ -1088,24 +2738,192 @@ boolean FtpServer::makePath( char * fullName, char * param )
   // If relative path, concatenate with current dir
   if( param[0] != '/' ) 
   {
-    strcpy( fullName, cwdName );
-    if( fullName[ strlen( fullName ) - 1 ] != '/' )
-      strncat( fullName, "/", FTP_CWD_SIZE );
-    strncat( fullName, param, FTP_CWD_SIZE );
+    l = cwdLen;
+    memcpy( fullName, cwdName, l );
   }
-  else
-    strcpy( fullName, param );
-  // If ends with '/', remove it
-  uint16_t strl = strlen( fullName ) - 1;
-  if( fullName[ strl ] == '/' && strl > 1 )
-    fullName[ strl ] = 0;
-  if( strlen( fullName ) < FTP_CWD_SIZE )
+  if( l + 1 + lParam < FTP_CWD_SIZE )
+  {
+    fullName[ l ++ ] = '/';
+    memcpy( fullName + l, param, lParam + 1 );
+    normalizePath( fullName );
     return true;
+  }
 
-  client.print("500 Command line too long\r\n");
+  reply.add("500 Command line too long\r\n");
   return false;
 }
 
+// Resolve in place '.', '..' and empty components of an absolute path,
+//   and remove the trailing '/' (except for the root)
+
+void FtpSession::normalizePath( char * path )
+{
+  char * pSrc = path;
+  char * pDst = path;               // end of the components already kept
+
+  while( * pSrc != 0 )
+  {
+    while( * pSrc == '/' )
+      pSrc ++;
+    char * pEnd = pSrc;
+    while( * pEnd != 0 && * pEnd != '/' )
+      pEnd ++;
+    uint16_t l = pEnd - pSrc;
+    if( l == 0 || ( l == 1 && pSrc[ 0 ] == '.' ))
+      ;
+    else if( l == 2 && pSrc[ 0 ] == '.' && pSrc[ 1 ] == '.' )
+    {
+      // drop last component kept
+      while( pDst > path && * ( -- pDst ) != '/' )
+        ;
+    }
+    else
+    {
+      * pDst ++ = '/';
+      memmove( pDst, pSrc, l );
+      pDst += l;
+    }
+    pSrc = pEnd;
+  }
+  if( pDst == path )
+    * pDst ++ = '/';
+  * pDst = 0;
+}
+
+// Make path (normalized) the working directory, if it is one
+//
+// The directory is kept open, when the file system allows it, so names
+//   relative to it are found without walking again the whole path
+//
+// return:
+//    true, if done
+
+boolean FtpSession::changeDir( const char * path )
+{
+  #if FTP_CWD_HANDLE
+    FTP_FILE dir;
+    if( ! dir.open( path, O_READ ))
+      return false;
+    if( ! dir.isDir())
+    {
+      dir.close();
+      return false;
+    }
+    cwdDir.close();
+    cwdDir = dir;
+    cwdOpen = true;
+  #else
+    if( ! FTP_FS.isDir( path ))
+      return false;
+  #endif
+  if( path != cwdName )
+    strcpy( cwdName, path );
+  cwdLen = strlen( cwdName );
+  return true;
+}
+
+// Return the name of path relative to the working directory, or NULL if
+//   path is not in it or that directory is not open
+
+const char * FtpSession::inCwd( const char * path )
+{
+  if( ! cwdOpen || strncmp( path, cwdName, cwdLen ) != 0 )
+    return NULL;
+  if( cwdLen == 1 )                 // root
+    return path[ 1 ] != 0 ? path + 1 : NULL;
+  return path[ cwdLen ] == '/' ? path + cwdLen + 1 : NULL;
+}
+
+// Open file of normalized path, relative to the working directory if possible
+
+boolean FtpSession::openFile( FTP_FILE & f, const char * path, int mode )
+{
+  uint32_t t = micros();
+  boolean  ok;
+  #if FTP_CWD_HANDLE
+    const char * name = inCwd( path );
+    if( name != NULL )
+      ok = f.open( & cwdDir, name, mode );
+    else
+  #endif
+  ok = f.open( path, mode );
+  server->metrics.sample( FTP_H_OPEN, micros() - t );
+  return ok;
+}
+
+// Return true if file or directory of normalized path exists
+
+boolean FtpSession::pathExists( const char * path )
+{
+  FtpStat st;
+  return getStat( path, FTP_STAT_KNOWN, & st );
+}
+
+// Get information about file or directory of normalized path
+//
+// It is taken from the cache of recent lookups, else from the listing of
+//   its directory if it is cached, else from the file system
+//
+// parameters:
+//   need: FTP_STAT_... flags of the information wanted
+//   st: where to store it. Flags of st tell what has been found
+//
+// return:
+//    true, if path exists
+
+boolean FtpSession::getStat( const char * path, uint8_t need, FtpStat * st )
+{
+  need |= FTP_STAT_KNOWN;
+  if( ! server->statCache.find( path, st ))
+    st->flags = 0;
+  if(( st->flags & need ) == need || (( st->flags & FTP_STAT_KNOWN ) &&
+                                      ! ( st->flags & FTP_STAT_EXISTS )))
+    return st->flags & FTP_STAT_EXISTS;
+
+  FtpListEntry entry;
+  int8_t       inList = server->listCache.lookup( path, & entry );
+  if( inList == 0 )
+    st->flags = FTP_STAT_KNOWN;
+  else if( inList > 0 )
+  {
+    st->flags = FTP_STAT_KNOWN | FTP_STAT_EXISTS | FTP_STAT_SIZE | FTP_STAT_TIME |
+                ( entry.isDir ? FTP_STAT_DIR : 0 );
+    st->size = entry.size;
+    st->modDate = entry.modDate;
+    st->modTime = entry.modTime;
+  }
+  else
+  {
+    if( ! ( st->flags & FTP_STAT_KNOWN ))
+    {
+      boolean exists;
+      #if FTP_CWD_HANDLE
+        const char * name = inCwd( path );
+        if( name != NULL )
+          exists = cwdDir.exists( name );
+        else
+      #endif
+        exists = FTP_FS.exists( path );
+      st->flags = FTP_STAT_KNOWN | ( exists ? FTP_STAT_EXISTS : 0 );
+    }
+    if(( st->flags & FTP_STAT_EXISTS ) && ( need & ~ st->flags & FTP_STAT_SIZE ))
+    {
+      FTP_FILE f;
+      if( openFile( f, path, O_READ ))
+      {
+        st->flags |= FTP_STAT_SIZE | ( f.isDir() ? FTP_STAT_DIR : 0 );
+        st->size = f.fileSize();
+        f.close();
+      }
+    }
+    if(( st->flags & FTP_STAT_EXISTS ) && ( need & ~ st->flags & FTP_STAT_TIME ) &&
+       FTP_FS.getFileModTime( path, & st->modDate, & st->modTime ))
+      st->flags |= FTP_STAT_TIME;
+  }
+  server->statCache.store( path, st );
+  return st->flags & FTP_STAT_EXISTS;
+}
+
 // Calculate year, month, day, hour, minute and second
 //   from first parameter sent by MDTM command (YYYYMMDDHHMMSS)
 //
@@ -1117,7 +2935,7 @@ boolean FtpServer::makePath( char * fullName, char * param )
 //    0 if parameter is not YYYYMMDDHHMMSS
 //    length of parameter + space
 
-uint8_t FtpServer::getDateTime( uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
+uint8_t FtpSession::getDateTime( uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
                                 uint8_t * phour, uint8_t * pminute, uint8_t * psecond )
 {
   char dt[ 15 ];
@@ -1155,11 +2973,16 @@ uint8_t FtpServer::getDateTime( uint16_t * pyear, uint8_t * pmonth, uint8_t * pd
 // return:
 //    pointer to tstr
 
-char * FtpServer::makeDateTimeStr( char * tstr, uint16_t date, uint16_t time )
+char * FtpSession::makeDateTimeStr( char * tstr, uint16_t date, uint16_t time )
 {
-  sprintf( tstr, "%04u%02u%02u%02u%02u%02u",
-           (( date & 0xFE00 ) >> 9 ) + 1980, ( date & 0x01E0 ) >> 5, date & 0x001F,
-           ( time & 0xF800 ) >> 11, ( time & 0x07E0 ) >> 5, ( time & 0x001F ) << 1 );            
+  uint16_t year = (( date & 0xFE00 ) >> 9 ) + 1980;
+  char *   p = put2Digits( tstr, year / 100 );
+  p = put2Digits( p, year % 100 );
+  p = put2Digits( p, ( date & 0x01E0 ) >> 5 );
+  p = put2Digits( p, date & 0x001F );
+  p = put2Digits( p, ( time & 0xF800 ) >> 11 );
+  p = put2Digits( p, ( time & 0x07E0 ) >> 5 );
+  p = put2Digits( p, ( time & 0x001F ) << 1 );
+  * p = 0;
   return tstr;
 }
-
@@ -29,29 +29,248 @@
 #ifndef FTP_SERVER_H
 #define FTP_SERVER_H
 
-#include <Ethernet.h>
-#include <FatLib.h>
+#include "FtpBackend.h"
 
 #define FTP_SERVER_VERSION "FTP-2015-04-08"
 
 #define FTP_USER "arduino"
 #define FTP_PASS "Due"
 
-#define FTP_CTRL_PORT 21          // Command port on wich server is listening
+#ifndef FTP_CTRL_PORT
+  #define FTP_CTRL_PORT 21        // Command port on wich server is listening
+#endif
 #define FTP_DATA_PORT_DFLT 20     // Default data port in active mode
-#define FTP_DATA_PORT_PASV 55600  // Data port in passive mode
+#ifndef FTP_DATA_PORT_PASV
+  #define FTP_DATA_PORT_PASV 55600 // Data port in passive mode
+#endif
 
 #define FTP_TIME_OUT  5           // Disconnect client after 5 minutes of inactivity
+#ifndef FTP_DATA_CONNECT_TIMEOUT
+  #define FTP_DATA_CONNECT_TIMEOUT 10000 // ms to establish a data connection
+#endif
 #define FTP_CMD_SIZE _MAX_LFN + 8 // max size of a command
 #define FTP_CWD_SIZE _MAX_LFN + 8 // max size of a directory name
 #define FTP_FIL_SIZE _MAX_LFN     // max size of a file name
-#define FTP_BUF_SIZE 1024 //512   // size of file buffer for read/write
+#ifndef FTP_BUF_SIZE
+  #define FTP_BUF_SIZE 1024 //512 // size of file buffer for read/write
+#endif
+#ifndef FTP_RETR_BUFFERS           // buffers of FTP_BUF_SIZE pipelining RETR
+  #if defined( __AVR__ )
+    #define FTP_RETR_BUFFERS 1
+  #else
+    #define FTP_RETR_BUFFERS 2
+  #endif
+#endif
+#define FTP_XFER_SIZE ( FTP_BUF_SIZE * FTP_RETR_BUFFERS ) // buffer of a transfer
+#ifndef FTP_SENDFILE_CHUNK
+  #define FTP_SENDFILE_CHUNK 65536 // most bytes given to sendFile() at once
+#endif
+#define FTP_SECTOR_SIZE 512       // STOR writes whole sectors to the file
+#define FTP_MSS 1460              // size of a full TCP segment (listings)
 
-class FtpServer
+#if FTP_BUF_SIZE % FTP_SECTOR_SIZE != 0
+  #error FTP_BUF_SIZE must be a multiple of FTP_SECTOR_SIZE
+#endif
+
+// Number of clients served at the same time. Each session needs a socket
+//   for the control connection and one for the data connection, and the
+//   listening sockets of the servers must remain available
+#ifndef FTP_MAX_SESSIONS
+  #ifdef MAX_SOCK_NUM
+    #define FTP_MAX_SESSIONS (( MAX_SOCK_NUM - 2 ) / 2 )
+  #else
+    #define FTP_MAX_SESSIONS 16   // no limit of sockets on host
+  #endif
+#endif
+
+// Number of transfer buffers, of FTP_XFER_SIZE bytes, shared by the
+//   sessions. A session takes one when RETR, STOR or a listing is accepted
+//   and gives it back at the end of the transfer (RETR sent by sendFile()
+//   needs none). When they are all in use, the command is refused with 425
+#ifndef FTP_BUF_POOL
+  #if defined( __AVR__ )
+    #define FTP_BUF_POOL 1
+  #elif defined( ARDUINO )
+    #define FTP_BUF_POOL (( FTP_MAX_SESSIONS + 1 ) / 2 )
+  #else
+    #define FTP_BUF_POOL FTP_MAX_SESSIONS
+  #endif
+#endif
+
+// Number of paths given by RNFR which may wait for their RNTO at the same
+//   time. A slot is kept only until the next command of the session. With
+//   0 slots, the path is kept in the transferPath of the session, which
+//   is free then, as RNFR never runs during a transfer
+#ifndef FTP_RNFR_SLOTS
+  #if defined( __AVR__ )
+    #define FTP_RNFR_SLOTS 0
+  #else
+    #define FTP_RNFR_SLOTS 1
+  #endif
+#endif
+
+// Number of ports, from FTP_DATA_PORT_PASV, given in turn to PASV commands.
+//   A port listens only until the client connects to it, with the socket
+//   of the data connection of the session
+#ifndef FTP_PASV_PORTS
+  #define FTP_PASV_PORTS ( 2 * FTP_MAX_SESSIONS )
+#endif
+
+#define FTP_REPLY_SIZE FTP_CWD_SIZE + 64 // max size of a reply to a command
+
+// Limits of bandwidth in bytes/s (0: no limit) of all transfers together
+//   and of the transfers of each session, for downloads (RETR and
+//   listings) and uploads (STOR). SITE RATE changes them while the server
+//   runs
+#ifndef FTP_RATE_DOWN
+  #define FTP_RATE_DOWN 0
+#endif
+#ifndef FTP_RATE_UP
+  #define FTP_RATE_UP 0
+#endif
+#ifndef FTP_RATE_SESSION_DOWN
+  #define FTP_RATE_SESSION_DOWN 0
+#endif
+#ifndef FTP_RATE_SESSION_UP
+  #define FTP_RATE_SESSION_UP 0
+#endif
+#define FTP_RATE_BURST_MS 100     // a limited transfer gathers 100 ms of bytes
+#define FTP_DOWN 0                // index of downloads in the limits
+#define FTP_UP   1                //   and of uploads
+
+// Number of last transfers of which a trace is kept (see SITE TRACE)
+#ifndef FTP_TRACE_SLOTS
+  #if defined( __AVR__ )
+    #define FTP_TRACE_SLOTS 0
+  #else
+    #define FTP_TRACE_SLOTS 16
+  #endif
+#endif
+#define FTP_TRACE_PATH 32         // end of path kept in a trace
+
+// How a transfer has ended
+#define FTP_TRACE_DONE     0      // successfully
+#define FTP_TRACE_ABORTED  1      // by ABOR
+#define FTP_TRACE_NO_DATA  2      // data connection not established
+#define FTP_TRACE_CLOSED   3      // data connection closed by client
+#define FTP_TRACE_FILE     4      // file or directory can't be read/written
+#define FTP_TRACE_BAD_DATA 5      // compressed data not valid
+#define FTP_TRACE_CLIENT   6      // client has quit, or timeout
+
+// Trace of a transfer
+//
+// Times of file reads/writes and of socket reads/writes show whether a
+//   slow transfer is limited by the card or by the network
+
+struct FtpTrace
+{
+  char     cmd;                   // 'R' RETR, 'S' STOR, or kind of listing
+  char     mode;                  // 'S' or 'Z'
+  uint8_t  session;
+  uint8_t  result;                // FTP_TRACE_xxx
+  char     path[ FTP_TRACE_PATH ]; // end of path of file or directory
+  uint32_t bytes;                 // bytes sent or received on data connection
+  uint32_t millisStart,           // command received
+           millisData,            // data connection established
+           millisEnd;
+  uint32_t microsFile,            // time spent reading/writing the file
+           microsNet;             //   and the data connection
+  uint32_t idleLoops;             // calls of service() without progress
+};
+
+#include "FtpCache.h"
+#include "FtpDeflate.h"
+#include "FtpText.h"
+
+// Pack the (up to) 4 characters of a command in an integer
+#define FTP_VERB( s ) ((uint32_t) ( s )[ 0 ] << 24 | (uint32_t) ( s )[ 1 ] << 16 | \
+                       (uint32_t) ( s )[ 2 ] << 8 | (uint32_t) ( s )[ 3 ] )
+
+// Commands understood by the server, with the line they add to the reply
+//   to FEAT (or NULL). Command XXXX is executed by FtpSession::cmdXXXX()
+#define FTP_COMMANDS( CMD )       \
+  CMD( ABOR, NULL               ) \
+  CMD( ALLO, NULL               ) \
+  CMD( CDUP, NULL               ) \
+  CMD( CWD,  NULL               ) \
+  CMD( DELE, NULL               ) \
+  CMD( FEAT, NULL               ) \
+  CMD( LIST, NULL               ) \
+  CMD( MDTM, "MDTM"             ) \
+  CMD( MKD,  NULL               ) \
+  CMD( MLSD, "MLSD"             ) \
+  CMD( MODE, FTP_FEAT_MODE_Z    ) \
+  CMD( NLST, NULL               ) \
+  CMD( NOOP, NULL               ) \
+  CMD( OPTS, NULL               ) \
+  CMD( PASV, NULL               ) \
+  CMD( PORT, NULL               ) \
+  CMD( PWD,  NULL               ) \
+  CMD( QUIT, NULL               ) \
+  CMD( REST, "REST STREAM"      ) \
+  CMD( RETR, NULL               ) \
+  CMD( RMD,  NULL               ) \
+  CMD( RNFR, NULL               ) \
+  CMD( RNTO, NULL               ) \
+  CMD( SITE, "SITE FREE"        ) \
+  CMD( SIZE, "SIZE"             ) \
+  CMD( STOR, NULL               ) \
+  CMD( STRU, NULL               ) \
+  CMD( TYPE, NULL               )
+
+// Index of each command in the table: FTP_CMD_IDX_ABOR...
+#define FTP_CMD_INDEX( name, feat ) FTP_CMD_IDX_##name,
+enum { FTP_COMMANDS( FTP_CMD_INDEX ) FTP_CMD_COUNT };
+#undef FTP_CMD_INDEX
+
+#include "FtpMetrics.h"
+
+// Reply to a command, built piece by piece then sent with a single write
+
+class FtpReply
+{
+public:
+  FtpReply();
+
+  FtpReply & add( const char * s );
+  FtpReply & add( uint32_t n );
+  boolean    send( FTP_NET_CLIENT & client );
+  void       clear();
+
+private:
+  char     text[ FTP_REPLY_SIZE ];
+  uint16_t len;
+};
+
+// Token bucket limiting a rate of bytes: it fills at rate bytes/s up to
+//   FTP_RATE_BURST_MS of bytes, and each byte transferred takes a token
+
+class FtpRateLimit
 {
 public:
-  void    init();
-  void    service();
+  void     set( uint32_t bytesPerSec );
+  uint32_t getRate()                  { return rate; }
+  // Bytes which may be transferred now, at most max
+  uint32_t allowed( uint32_t max );
+  void     take( uint32_t n );
+
+private:
+  uint32_t rate;                      // bytes/s, 0 for no limit
+  uint32_t tokens;
+  uint16_t fraction;                  // thousandths of token gathered
+  uint32_t millisLast;                // tokens added up to this time
+};
+
+class FtpServer;
+
+class FtpSession
+{
+public:
+  void    init( FtpServer * pServer, uint8_t num );
+  boolean isFree();
+  void    begin( FTP_NET_CLIENT & newClient );
+  boolean service();
+  void    setRate( uint8_t dir, uint32_t bytesPerSec ) { rate[ dir ].set( bytesPerSec ); }
 
 private:
   void    iniVariables();
@@ -60,42 +279,203 @@ private:
   boolean userIdentity();
   boolean userPassword();
   boolean processCommand();
-  int     dataConnect();
+  #define FTP_CMD_HANDLER( name, feat ) void cmd##name();
+  FTP_COMMANDS( FTP_CMD_HANDLER )
+  #undef FTP_CMD_HANDLER
+  void    siteTrace();
+  void    siteMetrics();
+  void    siteRate();
+  void    doList( char kind );
+  char *  formatListEntry( char * p, char kind, FtpListEntry * entry );
+  void    startList( char kind );
+  boolean doSendList();
+  void    fillList();
+  uint16_t dataSend( const uint8_t * p, uint16_t len );
+  void    dataOpen( uint8_t next );
+  boolean dataWait();
+  void    startRetrieve();
+  void    startStore();
+  void    pasvClose();
+  boolean zOpen();
+  void    zClose();
+  boolean bufOpen();
+  void    bufClose();
+  boolean rnfrOpen();
+  void    rnfrClose();
+  void    advanceBuffer( uint16_t nb );
   boolean doRetrieve();
+  boolean doSendFile();
   boolean doStore();
+  boolean writeStage();
+  uint16_t stageText( uint16_t skip, uint16_t n );
+  boolean textSize( const char * path, uint32_t * size );
   void    closeTransfer();
-  void    abortTransfer();
+  void    abortTransfer( uint8_t reason );
+  uint32_t rateAllowed( uint8_t dir, uint32_t max );
+  void    rateTake( uint8_t dir, uint32_t n );
+  void    traceBegin( char cmd, const char * path );
+  void    traceEnd( uint8_t result );
+  void    closeFile();
   boolean makePath( char * fullname );
   boolean makePath( char * fullName, char * param );
+  static void normalizePath( char * path );
+  boolean changeDir( const char * path );
+  const char * inCwd( const char * path );
+  boolean openFile( FTP_FILE & f, const char * path, int mode );
+  boolean pathExists( const char * path );
+  boolean getStat( const char * path, uint8_t need, FtpStat * st );
   uint8_t getDateTime( uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
                        uint8_t * phour, uint8_t * pminute, uint8_t * second );
   char *  makeDateTimeStr( char * tstr, uint16_t date, uint16_t time );
-  int8_t  readChar();
+  int8_t  readLine();
+  boolean takeAbort();
 
+  FtpServer *    server;              // server owning this session
+  uint8_t        sessionNum;          // index of this session in the server
   IPAddress      dataIp;              // IP address of client for data
-  EthernetClient client;
-  EthernetClient data;
+  FTP_NET_CLIENT client;
+  FTP_NET_CLIENT data;
+  FtpReply       reply;               // reply being built for client
+  FtpTrace       trace;               // trace of current transfer
+  FtpRateLimit   rate[ 2 ];           // limits of downloads and uploads
   
-  FAT_FILE file;
+  FTP_FILE file;
   
   boolean  dataPassiveConn;
+  char     transferMode;              // 'S' (stream) or 'Z' (deflate)
+  char     transferType;              // 'I' (binary) or 'A' (text, CR LF)
+  boolean  crText;                    // TYPE A: last piece of text ended with CR
+  uint8_t  zLevel;                    // compression level set by OPTS MODE Z
+  FtpZStream * zs;                    // stream of current transfer in MODE Z
   uint16_t dataPort;
-  char     buf[ FTP_BUF_SIZE ];       // data buffer for transfers
+  int16_t  pasvPort;                  // index of port given by PASV, or -1
+  char *   buf;                       // data buffers of transfer, or NULL
+  uint16_t bufLen[ FTP_RETR_BUFFERS ]; // number of bytes in each buffer
+  uint16_t bufPos;                    // bytes of first buffer already sent
+  uint8_t  bufFirst,                  // first buffer waiting to be sent
+           bufCount;                  // number of buffers waiting to be sent
+  boolean  fileEnd;                   // whole file (or directory) has been read
+  #if FTP_SENDFILE
+    boolean  direct;                  // RETR goes through sendFile()
+    uint32_t fileLeft;                // bytes of the file still to send
+  #endif
+  char     listKind;                  // listing sent: 'L', 'M' or 'N'
+  boolean  listCached;                // listing is read from the cache
+  int8_t   listSlot;                  // slot of cache read or filled, or -1
+  uint32_t listPos;                   // position of next entry in the slot
+  uint32_t listCount;                 // entries of the listing formatted
+  FTP_DIR  listDir;                   // directory read, if not in the cache
+  uint16_t stageLen;                  // bytes received in buf, not yet written
+  uint32_t filePos;                   // position in file of first byte of buf
+  uint32_t allocSize;                 // size announced by ALLO for next STOR
+  boolean  preAllocated;              // file of STOR has been preallocated
+  uint32_t restartPos;                // position set by REST for next transfer
+  uint32_t fileStart;                 // position of next transfer in file
+  uint32_t fileAlloc;                 // size to preallocate for next STOR
+  char     transferPath[ FTP_CWD_SIZE ]; // file being stored
   char     cmdLine[ FTP_CMD_SIZE ];   // where to store incoming char from client
   char     cwdName[ FTP_CWD_SIZE ];   // name of current directory
-  char     command[ 5 ];              // command sent by client
-  boolean  rnfrCmd;                   // previous command was RNFR
+  uint16_t cwdLen;                    // length of cwdName
+  boolean  cwdOpen;                   // cwdDir is open on cwdName
+  #if FTP_CWD_HANDLE
+    FTP_FILE cwdDir;                  // handle of current directory
+  #endif
+  uint32_t verb;                      // command sent by client (FTP_VERB)
+  char *   rnfrPath;                  // path given by RNFR, or NULL
   char *   parameters;                // point to begin of parameters sent by client
   uint16_t iCL;                       // pointer to cmdLine next incoming char
+  uint16_t lineLen;                   // length of line being executed
+  boolean  skipLine;                  // ignore end of a line too long
+  boolean  lineHeld;                  // line parsed, waiting for end of transfer
   int8_t   cmdStatus,                 // status of ftp command connexion
-           transferStatus;            // status of ftp data transfer
-  uint32_t millisTimeOut,             // disconnect after 5 min of inactivity
-           millisDelay,
+           transferStatus,            // status of ftp data transfer
+           dataNext;                  // command waiting for data connection
+  uint32_t millisDelay,
            millisEndConnection,       // 
            millisBeginTrans,          // store time of beginning of a transaction
+           millisDataTimeOut,         // give up waiting for data connection
            bytesTransfered;           //
 };
 
-#endif // FTP_SERVER_H
+class FtpServer
+{
+public:
+  FtpServer();
+
+  void     init();
+  void     service();                 // serve each session once
+  uint32_t service( uint32_t budget ); // serve during budget us, return us used
+
+  // To be called when the sketch itself creates, modifies or removes a
+  //   file or a directory, so cached information about it is dropped
+  void     fileChanged( const char * path );
+
+  // Number of writes to file made by STOR of whole, aligned sectors
+  //   and of other sizes (usually the end of files)
+  uint32_t getAlignedWrites()         { return alignedWrites; }
+  uint32_t getPartialWrites()         { return partialWrites; }
+
+  // Copy to t the trace of the n-th last transfer (0 is the last one)
+  //
+  // return:
+  //    false if there is no such trace
+  boolean  getTrace( uint16_t n, FtpTrace * t );
+  uint32_t getTraceCount()            { return traceCount; }
+
+  // Counters and histograms of the activity of the server
+  const FtpMetrics & getMetrics()     { return metrics; }
 
+  // Limit the bandwidth of all transfers and of the transfers of each
+  //   session, in bytes/s (0: no limit)
+  void     setRateLimits( uint32_t down, uint32_t up,
+                          uint32_t sessionDown, uint32_t sessionUp );
 
+private:
+  friend class FtpSession;
+
+  boolean  serviceSessions();
+  void     invalidate( const char * path );
+  void     traceAdd( const FtpTrace * t );
+  FtpZStream * zTake();
+  void     zRelease( FtpZStream * zs );
+  char *   bufTake();
+  void     bufRelease( char * buf );
+  #if FTP_RNFR_SLOTS > 0
+    char * rnfrTake();
+    void   rnfrRelease( char * path );
+  #endif
+  int16_t  pasvTake();
+  void     pasvRelease( int16_t i );
+  void     setRate( uint8_t dir, boolean perSession, uint32_t bytesPerSec );
+  FtpSession * freeSession();
+
+  FtpSession sessions[ FTP_MAX_SESSIONS ];
+  uint8_t    iSession;                // session served first by next service()
+  uint32_t   millisTimeOut;           // disconnect after 5 min of inactivity
+  uint32_t   alignedWrites,           // STOR writes of whole sectors
+             partialWrites;           // other STOR writes
+  FtpListCache listCache;             // listings of recently read directories
+  FtpStatCache statCache;             // information about recently used paths
+  FTP_NET_SERVER * pasvServers[ FTP_PASV_PORTS ]; // listeners of passive mode
+  boolean  pasvBusy[ FTP_PASV_PORTS ];  // port is given to a session
+  uint16_t pasvNext;                  // next port to give
+  FtpMetrics metrics;
+  FtpRateLimit rateAll[ 2 ];          // limits of all downloads and uploads
+  uint32_t rateSession[ 2 ];          // limits of each session
+  uint32_t traceCount;                // transfers traced since init()
+  #if FTP_TRACE_SLOTS > 0
+    FtpTrace traces[ FTP_TRACE_SLOTS ]; // ring of last traces
+  #endif
+  char     bufPool[ FTP_BUF_POOL ][ FTP_XFER_SIZE ]; // buffers of transfers
+  boolean  bufBusy[ FTP_BUF_POOL ];
+  #if FTP_RNFR_SLOTS > 0
+    char     rnfrSlots[ FTP_RNFR_SLOTS ][ FTP_CWD_SIZE ]; // paths given by RNFR
+    boolean  rnfrBusy[ FTP_RNFR_SLOTS ];
+  #endif
+  #if FTP_ZSTREAMS > 0
+    FtpZStream zStreams[ FTP_ZSTREAMS ]; // shared by transfers in MODE Z
+    boolean  zBusy[ FTP_ZSTREAMS ];
+  #endif
+};
+
+#endif // FTP_SERVER_H
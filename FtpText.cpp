@@ -0,0 +1,133 @@
+/*
+ * FTP Server - conversion of line ends for TYPE A
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Text is scanned for the next CR or LF a machine word at a time, and the
+ *   bytes between line ends are moved with memmove(), so lines of usual
+ *   length are converted nearly at the speed of memory.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FtpServer.h"
+
+// Words of the size of a pointer: 2 bytes on AVR, 4 or 8 elsewhere
+
+typedef uintptr_t FtpWord;
+
+#define WORD_ONES  ( (FtpWord) -1 / 0xFF )  // 0x01 in each byte
+#define WORD_HIGHS ( WORD_ONES * 0x80 )     // 0x80 in each byte
+
+// Return first byte equal to c in [ p, end ), or end if there is none
+//
+// Once p is aligned, a word w holds c when w ^ ( c in each byte ) has a
+//   null byte, which ( x - 0x01.. ) & ~ x & 0x80.. detects
+
+static const char * findByte( const char * p, const char * end, char c )
+{
+  while( p < end && ( (uintptr_t) p % sizeof( FtpWord )) != 0 )
+  {
+    if( * p == c )
+      return p;
+    p ++;
+  }
+  const FtpWord pattern = WORD_ONES * (uint8_t) c;
+  while( end - p >= (int) sizeof( FtpWord ))
+  {
+    FtpWord w;
+    memcpy( & w, p, sizeof( w ));
+    w ^= pattern;
+    if((( w - WORD_ONES ) & ~ w & WORD_HIGHS ) != 0 )
+      break;
+    p += sizeof( FtpWord );
+  }
+  while( p < end && * p != c )
+    p ++;
+  return p;
+}
+
+uint16_t ftpTextToNet( char * out, const char * in, uint16_t len, boolean * cr )
+{
+  if( len == 0 )
+    return 0;
+  const char * end = in + len;
+  const boolean crEnd = end[ -1 ] == '\r';
+  boolean  crBefore = * cr;
+  char *   o = out;
+  while( in < end )
+  {
+    const char * lf = findByte( in, end, '\n' );
+    uint16_t n = lf - in;
+    if( n > 0 )
+      crBefore = lf[ -1 ] == '\r';
+    memmove( o, in, n );
+    o += n;
+    if( lf == end )
+      break;
+    if( ! crBefore )
+      * o ++ = '\r';
+    * o ++ = '\n';
+    crBefore = false;
+    in = lf + 1;
+  }
+  * cr = crEnd;
+  return o - out;
+}
+
+uint16_t ftpTextAdded( const char * in, uint16_t len, boolean * cr )
+{
+  if( len == 0 )
+    return 0;
+  const char * start = in;
+  const char * end = in + len;
+  uint16_t added = 0;
+  while(( in = findByte( in, end, '\n' )) < end )
+  {
+    if( in > start ? in[ -1 ] != '\r' : ! * cr )
+      added ++;
+    in ++;
+  }
+  * cr = end[ -1 ] == '\r';
+  return added;
+}
+
+uint16_t ftpTextFromNet( char * out, const char * in, uint16_t len, boolean * cr )
+{
+  if( len == 0 )
+    return 0;
+  const char * end = in + len;
+  char *   o = out;
+  // CR which ended previous piece
+  if( * cr && * in != '\n' )
+    * o ++ = '\r';
+  * cr = false;
+  while( in < end )
+  {
+    const char * pcr = findByte( in, end, '\r' );
+    uint16_t n = pcr - in;
+    memmove( o, in, n );
+    o += n;
+    if( pcr == end )
+      break;
+    if( pcr + 1 == end )
+    {
+      * cr = true;
+      break;
+    }
+    if( pcr[ 1 ] != '\n' )
+      * o ++ = '\r';
+    in = pcr + 1;
+  }
+  return o - out;
+}
@@ -0,0 +1,62 @@
+/*
+ * FTP Server - conversion of line ends for TYPE A
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Included by FtpServer.h.
+ *
+ * In TYPE A, lines end with CR LF on the data connection, whatever the
+ *   files use. Files are sent with each LF not preceded by CR turned into
+ *   CR LF, and received with each CR LF turned into LF. The conversions
+ *   work in place, on data cut anywhere: a CR at the end of a piece is
+ *   remembered in * cr until the next piece tells what follows it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_TEXT_H
+#define FTP_TEXT_H
+
+// Convert len bytes of a file at in to the network format, in out
+//
+// out receives up to 2 * len bytes. It may be the same buffer as in, as
+//   long as out + len <= in
+// * cr must be false at the beginning of the file. It tells, between
+//   calls, whether the previous piece ended with CR
+//
+// return:
+//    number of bytes written to out
+
+uint16_t ftpTextToNet( char * out, const char * in, uint16_t len, boolean * cr );
+
+// Same as ftpTextToNet(), but only count the bytes it would add (for SIZE)
+//
+// return:
+//    number of CR which ftpTextToNet() would add to the len bytes at in
+
+uint16_t ftpTextAdded( const char * in, uint16_t len, boolean * cr );
+
+// Convert len bytes received at in to the format of files, in out
+//
+// out receives up to len bytes, plus 1 if * cr. It may be in, or in - 1
+//   when * cr
+// * cr must be false at the beginning of the transfer. A CR ending the
+//   piece is not written, but kept in * cr. When it is still true at the
+//   end of the transfer, the CR must be added to the file
+//
+// return:
+//    number of bytes written to out
+
+uint16_t ftpTextFromNet( char * out, const char * in, uint16_t len, boolean * cr );
+
+#endif // FTP_TEXT_H
@@ -100,6 +100,9 @@ void setup()
 void loop()
 {
   ftpSrv.service();
+  // or, to keep transfers at full speed within a bounded time,
+  //   let the server work up to 5 ms in each loop:
+  // ftpSrv.service( 5000 );
  
   // more process... 
 }
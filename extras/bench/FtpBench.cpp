@@ -0,0 +1,364 @@
+/*
+ * Benchmark of the FTP server over loopback, on a POSIX host
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * The server runs in a child process on the POSIX backend, serving a
+ *   directory where test files and directories are created. The parent
+ *   drives it as an FTP client and prints:
+ *     - throughput of RETR and STOR for files of 4 KB to 16 MB
+ *     - time of LIST and MLSD of directories of 10 to 10000 entries, the
+ *       first time (directory read from disk) and then (from the cache)
+ *     - round trip time of NOOP, SIZE and MDTM
+ *
+ * Build from the directory of the library:
+ *   g++ -O2 -I. -DFTP_CTRL_PORT=2121 -o ftpbench \
+ *       extras/bench/FtpBench.cpp FtpServer.cpp FtpCache.cpp FtpDeflate.cpp \
+ *       FtpMetrics.cpp FtpText.cpp FtpPosix.cpp
+ *
+ * Run:
+ *   ./ftpbench /directory/for/test/files
+ *
+ * extras/bench/run.sh builds and runs it for several values of FTP_BUF_SIZE
+ */
+
+#include "FtpServer.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DATA_SIZE  65536        // bytes written to sockets at once
+#define BENCH_MIN_BYTES  ( 64UL << 20 ) // bytes transferred for each size
+#define BENCH_MAX_RUNS   200
+#define BENCH_RTT_RUNS   2000
+#define BENCH_LIST_RUNS  20
+
+static const uint32_t fileSizes[] = { 4096, 65536, 1UL << 20, 16UL << 20 };
+static const uint16_t dirSizes[] = { 10, 100, 1000, 10000 };
+
+FtpServer ftpSrv;
+
+static int  ctrl = -1;                // control connection
+static char rbuf[ 4096 ];             // data received on ctrl, not yet read
+static int  rlen = 0;
+static char line[ 1024 ];             // last line of the last reply
+static char data[ BENCH_DATA_SIZE ];
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, & ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail( const char * what )
+{
+  fprintf( stderr, "ftpbench: %s (last reply: %s)\n", what, line );
+  exit( 1 );
+}
+
+static int connectTo( uint16_t port )
+{
+  int fd = socket( AF_INET, SOCK_STREAM, 0 );
+  struct sockaddr_in sa;
+  memset( & sa, 0, sizeof( sa ));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons( port );
+  sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if( connect( fd, (struct sockaddr *) & sa, sizeof( sa )) < 0 )
+  {
+    close( fd );
+    return -1;
+  }
+  int on = 1;
+  setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, & on, sizeof( on ));
+  return fd;
+}
+
+// Read a line from the control connection to line
+
+static void readLine()
+{
+  for( ;; )
+  {
+    char * eol = (char *) memchr( rbuf, '\n', rlen );
+    if( eol != NULL )
+    {
+      int n = eol - rbuf + 1;
+      int l = n < (int) sizeof( line ) ? n : sizeof( line ) - 1;
+      memcpy( line, rbuf, l );
+      line[ l ] = 0;
+      memmove( rbuf, rbuf + n, rlen - n );
+      rlen -= n;
+      return;
+    }
+    if( rlen == sizeof( rbuf ))
+      rlen = 0;                       // line too long, forget it
+    int nb = read( ctrl, rbuf + rlen, sizeof( rbuf ) - rlen );
+    if( nb <= 0 )
+      fail( "control connection closed" );
+    rlen += nb;
+  }
+}
+
+// Read a reply, which may have several lines
+//
+// return:
+//    code of the reply
+
+static int readReply()
+{
+  readLine();
+  int code = atoi( line );
+  if( line[ 3 ] == '-' )
+    do
+      readLine();
+    while( ! ( atoi( line ) == code && line[ 3 ] == ' ' ));
+  return code;
+}
+
+static int command( const char * fmt, ... )
+{
+  char    cmd[ 512 ];
+  va_list ap;
+  va_start( ap, fmt );
+  int n = vsnprintf( cmd, sizeof( cmd ) - 2, fmt, ap );
+  va_end( ap );
+  strcpy( cmd + n, "\r\n" );
+  if( write( ctrl, cmd, n + 2 ) != n + 2 )
+    fail( "can't send command" );
+  return readReply();
+}
+
+static void expect( int code, const char * what )
+{
+  if( code / 100 != 2 && code / 100 != 3 )
+    fail( what );
+}
+
+// Open a data connection in passive mode
+
+static int pasv()
+{
+  if( command( "PASV" ) != 227 )
+    fail( "PASV" );
+  int h[ 6 ];
+  char * p = strchr( line, '(' );
+  if( p == NULL || sscanf( p, "(%d,%d,%d,%d,%d,%d)", h, h + 1, h + 2, h + 3,
+                           h + 4, h + 5 ) != 6 )
+    fail( "PASV reply" );
+  int fd = connectTo( h[ 4 ] * 256 + h[ 5 ] );
+  if( fd < 0 )
+    fail( "data connection" );
+  return fd;
+}
+
+// Send cmd, which transfers data from the server, and read them
+//
+// return:
+//    number of bytes received
+
+static uint32_t receive( const char * cmd )
+{
+  int fd = pasv();
+  if( command( "%s", cmd ) != 150 )
+    fail( cmd );
+  uint32_t total = 0;
+  int      nb;
+  while(( nb = read( fd, data, sizeof( data ))) > 0 )
+    total += nb;
+  close( fd );
+  expect( readReply(), cmd );
+  return total;
+}
+
+static void store( const char * name, uint32_t size )
+{
+  int fd = pasv();
+  if( command( "STOR %s", name ) != 150 )
+    fail( "STOR" );
+  while( size > 0 )
+  {
+    uint32_t n = size < sizeof( data ) ? size : sizeof( data );
+    if( write( fd, data, n ) != (ssize_t) n )
+      fail( "write data" );
+    size -= n;
+  }
+  close( fd );
+  expect( readReply(), "STOR" );
+}
+
+static int compareDouble( const void * a, const void * b )
+{
+  double d = * (const double *) a - * (const double *) b;
+  return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+// Value below which are pct % of the n values (sorted)
+
+static double percentile( double * v, int n, int pct )
+{
+  int i = ( n * pct + 99 ) / 100 - 1;
+  return v[ i < 0 ? 0 : i ];
+}
+
+/*******************************************************************************
+ **                                 TESTS                                      **
+ *******************************************************************************/
+
+static void makeFiles( const char * root )
+{
+  char path[ 512 ];
+  mkdir( root, 0755 );
+  for( uint8_t i = 0; i < sizeof( fileSizes ) / sizeof( fileSizes[ 0 ] ); i ++ )
+  {
+    struct stat st;
+    snprintf( path, sizeof( path ), "%s/f%lu", root, (unsigned long) fileSizes[ i ] );
+    if( stat( path, & st ) == 0 && (uint32_t) st.st_size == fileSizes[ i ] )
+      continue;
+    FILE * f = fopen( path, "wb" );
+    for( uint32_t n = 0; n < fileSizes[ i ]; n ++ )
+      fputc( n * 7 % 251, f );
+    fclose( f );
+  }
+  for( uint8_t i = 0; i < sizeof( dirSizes ) / sizeof( dirSizes[ 0 ] ); i ++ )
+  {
+    snprintf( path, sizeof( path ), "%s/d%u", root, dirSizes[ i ] );
+    mkdir( path, 0755 );
+    for( uint16_t n = 0; n < dirSizes[ i ]; n ++ )
+    {
+      snprintf( path, sizeof( path ), "%s/d%u/file_%05u.txt", root, dirSizes[ i ], n );
+      if( access( path, F_OK ) != 0 )
+        close( open( path, O_CREAT | O_WRONLY, 0644 ));
+    }
+  }
+}
+
+static void benchTransfers()
+{
+  for( uint8_t i = 0; i < sizeof( fileSizes ) / sizeof( fileSizes[ 0 ] ); i ++ )
+  {
+    uint32_t size = fileSizes[ i ];
+    uint32_t runs = BENCH_MIN_BYTES / size;
+    runs = runs < 3 ? 3 : runs > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : runs;
+    char cmd[ 32 ];
+    snprintf( cmd, sizeof( cmd ), "RETR f%lu", (unsigned long) size );
+
+    double t = now();
+    for( uint32_t r = 0; r < runs; r ++ )
+      if( receive( cmd ) != size )
+        fail( "RETR size" );
+    t = now() - t;
+    printf( "RETR %9lu bytes %9.1f MB/s %8.3f ms/file\n", (unsigned long) size,
+            size * (double) runs / t / 1e6, t * 1e3 / runs );
+
+    t = now();
+    for( uint32_t r = 0; r < runs; r ++ )
+      store( "upload.bin", size );
+    t = now() - t;
+    printf( "STOR %9lu bytes %9.1f MB/s %8.3f ms/file\n", (unsigned long) size,
+            size * (double) runs / t / 1e6, t * 1e3 / runs );
+  }
+  expect( command( "DELE upload.bin" ), "DELE" );
+}
+
+static void benchListings()
+{
+  double v[ BENCH_LIST_RUNS ];
+  const char * cmds[] = { "LIST", "MLSD" };
+
+  for( uint8_t c = 0; c < 2; c ++ )
+    for( uint8_t i = 0; i < sizeof( dirSizes ) / sizeof( dirSizes[ 0 ] ); i ++ )
+    {
+      expect( command( "CWD /d%u", dirSizes[ i ] ), "CWD" );
+      // a change in the directory drops its cached listing
+      expect( command( "MKD tmp" ), "MKD" );
+      expect( command( "RMD tmp" ), "RMD" );
+      double first = 0;
+      for( int r = 0; r <= BENCH_LIST_RUNS; r ++ )
+      {
+        double t = now();
+        receive( cmds[ c ] );
+        t = now() - t;
+        if( r == 0 )
+          first = t;
+        else
+          v[ r - 1 ] = t;
+      }
+      qsort( v, BENCH_LIST_RUNS, sizeof( double ), compareDouble );
+      printf( "%s %6u entries  first %8.3f ms  p50 %8.3f ms  p99 %8.3f ms\n",
+              cmds[ c ], dirSizes[ i ], first * 1e3,
+              percentile( v, BENCH_LIST_RUNS, 50 ) * 1e3,
+              percentile( v, BENCH_LIST_RUNS, 99 ) * 1e3 );
+    }
+  expect( command( "CWD /" ), "CWD" );
+}
+
+static void benchRoundTrips()
+{
+  static double v[ BENCH_RTT_RUNS ];
+  const char * cmds[] = { "NOOP", "SIZE f4096", "MDTM f4096" };
+
+  for( uint8_t c = 0; c < 3; c ++ )
+  {
+    for( int r = 0; r < BENCH_RTT_RUNS; r ++ )
+    {
+      double t = now();
+      expect( command( "%s", cmds[ c ] ), cmds[ c ] );
+      v[ r ] = now() - t;
+    }
+    qsort( v, BENCH_RTT_RUNS, sizeof( double ), compareDouble );
+    printf( "%-4.4s round trip  p50 %8.1f us  p99 %8.1f us\n", cmds[ c ],
+            percentile( v, BENCH_RTT_RUNS, 50 ) * 1e6,
+            percentile( v, BENCH_RTT_RUNS, 99 ) * 1e6 );
+  }
+}
+
+int main( int argc, char ** argv )
+{
+  const char * root = argc > 1 ? argv[ 1 ] : "/tmp/ftpbench";
+
+  makeFiles( root );
+  pid_t server = fork();
+  if( server == 0 )
+  {
+    // the server, its debugging messages thrown away
+    if( freopen( "/dev/null", "w", stdout ) == NULL || ! POSIX_FS.begin( root ))
+      exit( 1 );
+    signal( SIGPIPE, SIG_IGN );       // for sendfile() of RETR
+    ftpSrv.init();
+    while( true )
+      if( ftpSrv.service( 10000 ) < 100 )
+        sched_yield();
+  }
+
+  for( int i = 0; i < 100 && ( ctrl = connectTo( FTP_CTRL_PORT )) < 0; i ++ )
+    usleep( 20000 );
+  if( ctrl < 0 )
+    fail( "can't connect to server" );
+  setvbuf( stdout, NULL, _IOLBF, 0 );
+  expect( readReply(), "welcome" );
+  expect( command( "USER %s", FTP_USER ), "USER" );
+  expect( command( "PASS %s", FTP_PASS ), "PASS" );
+  expect( command( "TYPE I" ), "TYPE" );
+
+  printf( "FTP_BUF_SIZE %u  FTP_RETR_BUFFERS %u\n", FTP_BUF_SIZE, FTP_RETR_BUFFERS );
+  benchTransfers();
+  benchListings();
+  benchRoundTrips();
+
+  command( "QUIT" );
+  close( ctrl );
+  kill( server, SIGTERM );
+  waitpid( server, NULL, 0 );
+  return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Benchmark the FTP server over loopback (see FtpBench.cpp) for several
+#   sizes of its file buffer
+#
+# Run from the directory of the library:
+#   extras/bench/run.sh [directory for test files] [buffer sizes]
+#
+# Test files are kept in the directory (/tmp/ftpbench by default), so
+#   next runs start faster.
+
+DIR=${1:-/tmp/ftpbench}
+SIZES=${2:-512 1024 2048 4096}
+BIN=${TMPDIR:-/tmp}/ftpbench.$$
+
+for size in $SIZES
+do
+  g++ -O2 -I. -DFTP_CTRL_PORT=2121 -DFTP_BUF_SIZE=$size -o $BIN \
+      extras/bench/FtpBench.cpp FtpServer.cpp FtpCache.cpp FtpDeflate.cpp \
+      FtpMetrics.cpp FtpText.cpp FtpPosix.cpp || exit 1
+  $BIN "$DIR" || { rm -f $BIN; exit 1; }
+  echo
+done
+rm -f $BIN
@@ -0,0 +1,44 @@
+/*
+ * Run the FTP server as a process on a POSIX host (Linux, ...)
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Build from the directory of the library:
+ *   g++ -O2 -I. -DFTP_CTRL_PORT=2121 -o ftpserver \
+ *       extras/host/FtpServerHost.cpp FtpServer.cpp FtpCache.cpp FtpDeflate.cpp \
+ *       FtpMetrics.cpp FtpText.cpp FtpPosix.cpp
+ *
+ * Run:
+ *   ./ftpserver /directory/to/serve
+ *
+ * then connect to 127.0.0.1 port 2121 (user "arduino", password "Due")
+ */
+
+#include "FtpServer.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+FtpServer ftpSrv;
+
+int main( int argc, char ** argv )
+{
+  const char * root = argc > 1 ? argv[ 1 ] : ".";
+
+  setvbuf( stdout, NULL, _IONBF, 0 );
+  // RETR uses sendfile(), which raises SIGPIPE when the client is gone
+  signal( SIGPIPE, SIG_IGN );
+  if( ! POSIX_FS.begin( root ))
+  {
+    fprintf( stderr, "Can't serve directory %s\n", root );
+    return 1;
+  }
+  printf( "Serving %s on port %u\n", root, FTP_CTRL_PORT );
+
+  ftpSrv.init();
+  while( true )
+  {
+    if( ftpSrv.service( 10000 ) < 100 )  // nothing to do, let the cpu rest
+      usleep( 100 );
+  }
+  return 0;
+}
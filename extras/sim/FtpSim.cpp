@@ -0,0 +1,1136 @@
+/*
+ * FTP Server - simulated hardware, for deterministic performance tests
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Time is counted in nanoseconds, so that the transmission of a segment on
+ *   a fast link or the SPI copy of a few bytes are not rounded to zero.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FtpSim.h"
+
+#define SIM_CONNS        32           // connections open at the same time
+#define SIM_SEGMENTS     256          // segments in flight in one direction
+#define SIM_LISTENERS    32
+#define SIM_CLUSTER_SIZE 32768
+#define SIM_ENTRY_SIZE   32           // bytes of a directory entry
+
+SimConfig simConfig;
+boolean   simVerbose = false;
+SimSerial Serial;
+SimFs     SIM_FS;
+
+static uint64_t now = 0;              // ns
+
+void simDefaults()
+{
+  simConfig.linkBps = 100000000;
+  simConfig.rttMicros = 200;
+  simConfig.txBuffer = 2048;
+  simConfig.rxBuffer = 2048;
+  simConfig.peerBuffer = 65536;
+  simConfig.spiBytesPerSec = 2000000;
+  simConfig.sectorReadMicros = 300;
+  simConfig.sectorWriteMicros = 600;
+  simConfig.capacityMB = 1024;
+  simConfig.loopMicros = 20;
+}
+
+uint64_t simMicros()
+{
+  return now / 1000;
+}
+
+void simAdvance( uint32_t us )
+{
+  now += (uint64_t) us * 1000;
+}
+
+void simWaitUntil( uint64_t t )
+{
+  if( t * 1000 > now )
+    now = t * 1000;
+}
+
+uint32_t millis()
+{
+  return (uint32_t) ( now / 1000000 );
+}
+
+uint32_t micros()
+{
+  return (uint32_t) ( now / 1000 );
+}
+
+/*******************************************************************************
+ **                                 OUTPUT                                     **
+ *******************************************************************************/
+
+size_t SimPrint::write( const char * buffer, size_t size )
+{
+  return write((const uint8_t *) buffer, size );
+}
+
+size_t SimPrint::write( uint8_t c )
+{
+  return write( & c, 1 );
+}
+
+size_t SimPrint::print( const char * s )
+{
+  return write( s, strlen( s ));
+}
+
+size_t SimPrint::print( char c )
+{
+  return write((uint8_t) c );
+}
+
+size_t SimPrint::print( long n )
+{
+  char str[ 12 ];
+  return write( str, sprintf( str, "%ld", n ));
+}
+
+size_t SimPrint::print( unsigned long n )
+{
+  char str[ 12 ];
+  return write( str, sprintf( str, "%lu", n ));
+}
+
+size_t SimPrint::println()
+{
+  return write( "\r\n", 2 );
+}
+
+size_t SimSerial::write( const uint8_t * buffer, size_t size )
+{
+  if( simVerbose )
+    fwrite( buffer, 1, size, stdout );
+  return size;
+}
+
+/*******************************************************************************
+ **                                NETWORK                                     **
+ *******************************************************************************/
+
+// Bytes sent by one side of a connection, from the call of write() to the
+//   call of read() on the other side
+//
+// A segment leaves when the link of its side is free, arrives half a
+//   round trip after it has been transmitted, and is acknowledged another
+//   half round trip later. The sender may have no more than its socket
+//   buffer unacknowledged, and the receiver (ethernet chip or client)
+//   advertises no more than its socket buffer for bytes not read
+
+struct SimSegment
+{
+  uint32_t end;                       // value of written after the segment
+  uint64_t arrive;
+  uint64_t ack;
+};
+
+struct SimPipe
+{
+  uint8_t *  bytes;                   // bytes written and not read
+  uint32_t   cap;
+  uint32_t   written, read, acked;
+  SimSegment seg[ SIM_SEGMENTS ];
+  uint16_t   segFirst, segCount;
+  boolean    fin;                     // sender has closed
+  uint64_t   finArrive;
+};
+
+struct SimConn
+{
+  boolean  used;
+  uint16_t generation;
+  uint16_t port;
+  uint8_t  listenSide;                // side which accepts the connection
+  boolean  accepted;
+  uint64_t established[ 2 ];          // when each side sees it established
+  boolean  closed[ 2 ];
+  SimPipe  pipe[ 2 ];                 // pipe[ s ] carries what side s sends
+};
+
+struct SimListener
+{
+  uint16_t port;
+  uint8_t  side;
+  boolean  used;
+};
+
+static SimConn     conns[ SIM_CONNS ];
+static SimListener listeners[ SIM_LISTENERS ];
+static uint64_t    linkFree[ 2 ];     // end of transmissions of each side
+static uint16_t    generation = 0;
+
+static void fsReset();
+
+static const IPAddress sideIP[ 2 ] = { IPAddress( 192, 168, 1, 10 ),
+                                       IPAddress( 192, 168, 1, 20 ) };
+
+static uint64_t halfRtt()
+{
+  return (uint64_t) simConfig.rttMicros * 500;
+}
+
+// Time taken by the copy of n bytes between the processor and the chip
+
+static uint64_t spiTime( uint32_t n )
+{
+  return (uint64_t) n * 1000000000 / simConfig.spiBytesPerSec;
+}
+
+// Forget the segments acknowledged by now
+
+static void pipeUpdate( SimPipe * p )
+{
+  while( p->segCount > 0 && p->seg[ p->segFirst ].ack <= now )
+  {
+    p->acked = p->seg[ p->segFirst ].end;
+    p->segFirst = ( p->segFirst + 1 ) % SIM_SEGMENTS;
+    p->segCount --;
+  }
+}
+
+// Value of written for the bytes arrived by now
+
+static uint32_t pipeArrived( SimPipe * p )
+{
+  pipeUpdate( p );
+  uint32_t arrived = p->acked;
+  for( uint16_t i = 0; i < p->segCount; i ++ )
+  {
+    SimSegment * s = & p->seg[ ( p->segFirst + i ) % SIM_SEGMENTS ];
+    if( s->arrive > now )
+      break;
+    arrived = s->end;
+  }
+  return arrived;
+}
+
+// Bytes side can write without waiting
+
+static uint32_t pipeRoom( SimConn * c, uint8_t side )
+{
+  SimPipe * p = & c->pipe[ side ];
+  pipeUpdate( p );
+  uint32_t tx = side == 0 ? simConfig.txBuffer : simConfig.peerBuffer;
+  int32_t  room = tx - ( p->written - p->acked );
+  // the receiver keeps what is not read yet in its socket buffer: the
+  //   chip on the server, the system on the client
+  uint32_t rx = side == 0 ? simConfig.peerBuffer : simConfig.rxBuffer;
+  int32_t  window = rx - ( p->written - p->read );
+  if( window < room )
+    room = window;
+  return room > 0 ? room : 0;
+}
+
+// Send n bytes on the link of side
+
+static void pipePush( SimPipe * p, uint8_t side, const uint8_t * buffer, uint32_t n )
+{
+  uint32_t queued = p->written - p->read;
+  if( queued + n > p->cap )
+  {
+    uint32_t cap = p->cap > 0 ? p->cap : 4096;
+    while( cap < queued + n )
+      cap *= 2;
+    p->bytes = (uint8_t *) realloc( p->bytes, cap );
+    p->cap = cap;
+  }
+  memcpy( p->bytes + queued, buffer, n );
+
+  for( uint32_t done = 0; done < n; )
+  {
+    uint32_t len = n - done < SIM_MSS ? n - done : SIM_MSS;
+    uint64_t start = linkFree[ side ] > now ? linkFree[ side ] : now;
+    linkFree[ side ] = start + (uint64_t) len * 8000000000ULL / simConfig.linkBps;
+    done += len;
+    p->written += len;
+    SimSegment * s;
+    if( p->segCount < SIM_SEGMENTS )
+    {
+      s = & p->seg[ ( p->segFirst + p->segCount ) % SIM_SEGMENTS ];
+      p->segCount ++;
+    }
+    else                              // join the last one
+      s = & p->seg[ ( p->segFirst + p->segCount - 1 ) % SIM_SEGMENTS ];
+    s->end = p->written;
+    s->arrive = linkFree[ side ] + halfRtt();
+    s->ack = s->arrive + halfRtt();
+  }
+}
+
+static void connFree( SimConn * c )
+{
+  for( uint8_t s = 0; s < 2; s ++ )
+    ::free( c->pipe[ s ].bytes );
+  memset( c, 0, sizeof( SimConn ));
+}
+
+// Open a connection from side to the listener of the other side on port
+//
+// return:
+//    index of the connection, -1 if nobody listens
+
+static int16_t connOpen( uint8_t side, uint16_t port )
+{
+  uint8_t l;
+  for( l = 0; l < SIM_LISTENERS; l ++ )
+    if( listeners[ l ].used && listeners[ l ].port == port &&
+        listeners[ l ].side != side )
+      break;
+  if( l == SIM_LISTENERS )
+    return -1;
+  for( int16_t i = 0; i < SIM_CONNS; i ++ )
+    if( ! conns[ i ].used )
+    {
+      SimConn * c = & conns[ i ];
+      memset( c, 0, sizeof( SimConn ));
+      c->used = true;
+      c->generation = ++ generation;
+      c->port = port;
+      c->listenSide = 1 - side;
+      // SYN and SYN-ACK, then the ACK reaches the listener
+      c->established[ side ] = now + 2 * halfRtt();
+      c->established[ 1 - side ] = now + 3 * halfRtt();
+      return i;
+    }
+  return -1;
+}
+
+void simReset()
+{
+  for( uint8_t i = 0; i < SIM_CONNS; i ++ )
+    if( conns[ i ].used )
+      connFree( & conns[ i ] );
+  for( uint8_t l = 0; l < SIM_LISTENERS; l ++ )
+    listeners[ l ].used = false;
+  linkFree[ 0 ] = linkFree[ 1 ] = 0;
+  now = 0;
+  fsReset();
+}
+
+IPAddress::IPAddress()
+{
+  memset( bytes, 0, 4 );
+}
+
+IPAddress::IPAddress( uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3 )
+{
+  bytes[ 0 ] = b0;
+  bytes[ 1 ] = b1;
+  bytes[ 2 ] = b2;
+  bytes[ 3 ] = b3;
+}
+
+SimClient::SimClient( uint8_t side )
+{
+  this->side = side;
+  iConn = -1;
+  generation = 0;
+}
+
+// Connection of this handle, NULL if it has been closed
+
+SimConn * SimClient::conn()
+{
+  if( iConn < 0 )
+    return NULL;
+  SimConn * c = & conns[ iConn ];
+  if( ! c->used || c->generation != generation || c->closed[ side ] )
+  {
+    iConn = -1;
+    return NULL;
+  }
+  return c;
+}
+
+size_t SimClient::write( const uint8_t * buffer, size_t size )
+{
+  size_t done = 0;
+  SimConn * c;
+  while( done < size && ( c = conn()) != NULL && ! c->closed[ 1 - side ] &&
+         c->established[ side ] <= now )
+  {
+    uint32_t room = pipeRoom( c, side );
+    if( room == 0 )
+    {
+      SimPipe * p = & c->pipe[ side ];
+      // the server waits for an acknowledgement, the client does not
+      if( side == 1 || p->segCount == 0 )
+        break;
+      now = p->seg[ p->segFirst ].ack;
+      continue;
+    }
+    uint32_t n = size - done < room ? size - done : room;
+    if( side == 0 )
+      now += spiTime( n );
+    pipePush( & c->pipe[ side ], side, buffer + done, n );
+    done += n;
+  }
+  return done;
+}
+
+int SimClient::available()
+{
+  SimConn * c = conn();
+  if( c == NULL )
+    return 0;
+  SimPipe * p = & c->pipe[ 1 - side ];
+  return pipeArrived( p ) - p->read;
+}
+
+int SimClient::availableForWrite()
+{
+  SimConn * c = conn();
+  if( c == NULL || c->established[ side ] > now )
+    return 0;
+  return pipeRoom( c, side );
+}
+
+int SimClient::read()
+{
+  uint8_t b;
+  return read( & b, 1 ) == 1 ? b : -1;
+}
+
+int SimClient::read( uint8_t * buffer, size_t size )
+{
+  int n = available();
+  if( n <= 0 )
+    return -1;
+  if( (size_t) n > size )
+    n = size;
+  SimPipe * p = & conn()->pipe[ 1 - side ];
+  memcpy( buffer, p->bytes, n );
+  memmove( p->bytes, p->bytes + n, p->written - p->read - n );
+  p->read += n;
+  if( side == 0 )
+    now += spiTime( n );
+  return n;
+}
+
+// Connected, or being connected, or closed by peer with data still to read
+
+uint8_t SimClient::connected()
+{
+  SimConn * c = conn();
+  if( c == NULL )
+    return 0;
+  SimPipe * p = & c->pipe[ 1 - side ];
+  if( p->fin && p->finArrive <= now && available() == 0 )
+    return 0;
+  return 1;
+}
+
+int SimClient::connect( IPAddress ip, uint16_t port )
+{
+  if( ! connectStart( ip, port ))
+    return 0;
+  simWaitUntil( conns[ iConn ].established[ side ] / 1000 );
+  return 1;
+}
+
+// There is a single host in the simulation, so the address is not used
+
+int SimClient::connectStart( IPAddress, uint16_t port )
+{
+  stop();
+  iConn = connOpen( side, port );
+  if( iConn < 0 )
+    return 0;
+  generation = conns[ iConn ].generation;
+  return 1;
+}
+
+uint8_t SimClient::connecting()
+{
+  SimConn * c = conn();
+  return c != NULL && c->established[ side ] > now;
+}
+
+void SimClient::stop()
+{
+  SimConn * c = conn();
+  if( c == NULL )
+    return;
+  c->closed[ side ] = true;
+  SimPipe * p = & c->pipe[ side ];
+  p->fin = true;
+  p->finArrive = ( linkFree[ side ] > now ? linkFree[ side ] : now ) + halfRtt();
+  if( c->closed[ 1 - side ] )
+    connFree( c );
+  iConn = -1;
+}
+
+IPAddress SimClient::localIP()
+{
+  return sideIP[ side ];
+}
+
+IPAddress SimClient::remoteIP()
+{
+  return conn() == NULL ? IPAddress() : sideIP[ 1 - side ];
+}
+
+SimClient::operator bool()
+{
+  return conn() != NULL;
+}
+
+SimServer::SimServer( uint16_t port, uint8_t side )
+{
+  this->port = port;
+  this->side = side;
+}
+
+void SimServer::begin()
+{
+  uint8_t free = SIM_LISTENERS;
+  for( uint8_t l = 0; l < SIM_LISTENERS; l ++ )
+    if( listeners[ l ].used && listeners[ l ].port == port &&
+        listeners[ l ].side == side )
+      return;
+    else if( ! listeners[ l ].used && free == SIM_LISTENERS )
+      free = l;
+  if( free == SIM_LISTENERS )
+    return;
+  listeners[ free ].used = true;
+  listeners[ free ].port = port;
+  listeners[ free ].side = side;
+}
+
+void SimServer::stop()
+{
+  for( uint8_t l = 0; l < SIM_LISTENERS; l ++ )
+    if( listeners[ l ].used && listeners[ l ].port == port &&
+        listeners[ l ].side == side )
+      listeners[ l ].used = false;
+}
+
+SimClient SimServer::connected()
+{
+  SimClient client( side );
+  for( int16_t i = 0; i < SIM_CONNS; i ++ )
+  {
+    SimConn * c = & conns[ i ];
+    if( c->used && ! c->accepted && c->port == port && c->listenSide == side &&
+        c->established[ side ] <= now )
+    {
+      c->accepted = true;
+      client.iConn = i;
+      client.generation = c->generation;
+      break;
+    }
+  }
+  return client;
+}
+
+/*******************************************************************************
+ **                              FILE SYSTEM                                   **
+ *******************************************************************************/
+
+// Files and directories are nodes of a tree, the root being node 0. The
+//   entries of a directory are its children, in the order of the nodes
+//   (a renamed node goes to the end)
+
+struct SimNode
+{
+  char *    name;                     // NULL if removed
+  int32_t   parent;
+  boolean   dir;
+  uint8_t * data;
+  uint32_t  size, cap;
+  uint32_t  alloc;                    // bytes in the clusters of the file
+  uint16_t  modDate, modTime;
+};
+
+static SimNode * nodes = NULL;
+static int32_t   nodeCount = 0, nodeCap = 0;
+
+// The single sector cache of SdFat
+static int32_t   cacheNode;
+static uint32_t  cacheSector;
+static boolean   cacheDirty;
+
+static boolean   charge = true;       // false while tests set up files
+
+static void cardRead()
+{
+  if( charge )
+    now += (uint64_t) simConfig.sectorReadMicros * 1000;
+}
+
+static void cardWrite()
+{
+  if( charge )
+    now += (uint64_t) simConfig.sectorWriteMicros * 1000;
+}
+
+static void cacheFlush()
+{
+  if( cacheDirty )
+    cardWrite();
+  cacheDirty = false;
+}
+
+// Bring a sector in the cache. It is read from the card if load is true,
+//   as it holds data to keep
+
+static void cacheGet( int32_t node, uint32_t sector, boolean load )
+{
+  if( cacheNode == node && cacheSector == sector )
+    return;
+  cacheFlush();
+  cacheNode = node;
+  cacheSector = sector;
+  if( load )
+    cardRead();
+}
+
+static void cacheForget( int32_t node )
+{
+  if( cacheNode == node )
+  {
+    cacheNode = -1;
+    cacheDirty = false;
+  }
+}
+
+// Date and time of the simulated clock: the tests begin on 2015-01-01
+
+static void fatNow( uint16_t * pdate, uint16_t * ptime )
+{
+  uint32_t s = now / 1000000000;
+  * pdate = (( 2015 - 1980 ) << 9 ) | ( 1 << 5 ) | ( 1 + s / 86400 % 28 );
+  * ptime = ( s / 3600 % 24 << 11 ) | ( s / 60 % 60 << 5 ) | ( s % 60 >> 1 );
+}
+
+static void fsReset()
+{
+  for( int32_t i = 0; i < nodeCount; i ++ )
+  {
+    ::free( nodes[ i ].name );
+    ::free( nodes[ i ].data );
+  }
+  nodeCount = 0;
+  cacheNode = -1;
+  cacheDirty = false;
+  // root
+  if( nodeCap == 0 )
+  {
+    nodeCap = 1024;
+    nodes = (SimNode *) malloc( nodeCap * sizeof( SimNode ));
+  }
+  memset( nodes, 0, sizeof( SimNode ));
+  nodes[ 0 ].name = strdup( "" );
+  nodes[ 0 ].parent = -1;
+  nodes[ 0 ].dir = true;
+  fatNow( & nodes[ 0 ].modDate, & nodes[ 0 ].modTime );
+  nodeCount = 1;
+}
+
+static int32_t nodeNew( int32_t parent, const char * name, uint16_t len, boolean dir )
+{
+  if( nodeCount == nodeCap )
+  {
+    nodeCap *= 2;
+    nodes = (SimNode *) realloc( nodes, nodeCap * sizeof( SimNode ));
+  }
+  SimNode * n = & nodes[ nodeCount ];
+  memset( n, 0, sizeof( SimNode ));
+  n->name = strndup( name, len );
+  n->parent = parent;
+  n->dir = dir;
+  fatNow( & n->modDate, & n->modTime );
+  return nodeCount ++;
+}
+
+// Directory entries taken by a name: the short one and the long ones
+
+static uint32_t slots( const char * name )
+{
+  return 1 + ( strlen( name ) + 12 ) / 13;
+}
+
+// Read the sectors of directory dir holding entries from slot to slot + n
+
+static void dirRead( int32_t dir, uint32_t slot, uint32_t n )
+{
+  uint32_t last = (( slot + n ) * SIM_ENTRY_SIZE - 1 ) / SIM_SECTOR_SIZE;
+  for( uint32_t s = slot * SIM_ENTRY_SIZE / SIM_SECTOR_SIZE; s <= last; s ++ )
+    cacheGet( dir, s, true );
+}
+
+// Search name (of len characters) in directory dir, reading its entries
+//   up to it, or all of them if it is not there
+
+static int32_t dirSearch( int32_t dir, const char * name, uint16_t len )
+{
+  uint32_t slot = 0;
+  for( int32_t i = 1; i < nodeCount; i ++ )
+    if( nodes[ i ].name != NULL && nodes[ i ].parent == dir )
+    {
+      uint32_t n = slots( nodes[ i ].name );
+      if( strlen( nodes[ i ].name ) == len &&
+          strncasecmp( nodes[ i ].name, name, len ) == 0 )
+      {
+        dirRead( dir, slot, n );
+        return i;
+      }
+      slot += n;
+    }
+  dirRead( dir, 0, slot + 1 );        // up to the end marker
+  return -1;
+}
+
+// Find path, relative to node from (the root if path begins with '/')
+//
+// return:
+//    node of path, -1 if it does not exist. Then, if its directory exists,
+//    it is in * pparent and * plast points to the last name of path
+
+static int32_t find( int32_t from, const char * path,
+                     int32_t * pparent = NULL, const char ** plast = NULL )
+{
+  int32_t cur = path[ 0 ] == '/' ? 0 : from;
+  if( pparent != NULL )
+    * pparent = -1;
+  while( * path == '/' )
+    path ++;
+  while( * path != 0 )
+  {
+    const char * end = strchr( path, '/' );
+    uint16_t     len = end == NULL ? strlen( path ) : end - path;
+    if( ! nodes[ cur ].dir )
+      return -1;
+    int32_t child = dirSearch( cur, path, len );
+    const char * next = path + len;
+    while( * next == '/' )
+      next ++;
+    if( child < 0 )
+    {
+      if( * next == 0 && pparent != NULL )
+      {
+        * pparent = cur;
+        * plast = path;
+      }
+      return -1;
+    }
+    cur = child;
+    path = next;
+  }
+  return cur;
+}
+
+// Update the entry of node in its directory
+
+static void entryWrite( int32_t node )
+{
+  fatNow( & nodes[ node ].modDate, & nodes[ node ].modTime );
+  cacheFlush();
+  cardWrite();
+}
+
+// Allocate the clusters of node up to size, writing the FAT for each
+
+static void clustersAlloc( int32_t node, uint32_t size )
+{
+  while( nodes[ node ].alloc < size )
+  {
+    nodes[ node ].alloc += SIM_CLUSTER_SIZE;
+    cardWrite();
+  }
+}
+
+static void nodeResize( int32_t node, uint32_t size )
+{
+  SimNode * n = & nodes[ node ];
+  if( size > n->cap )
+  {
+    uint32_t cap = n->cap > 0 ? n->cap : 4096;
+    while( cap < size )
+      cap *= 2;
+    n->data = (uint8_t *) realloc( n->data, cap );
+    n->cap = cap;
+  }
+  n->size = size;
+}
+
+static void nodeRemove( int32_t node )
+{
+  cacheForget( node );
+  ::free( nodes[ node ].name );
+  ::free( nodes[ node ].data );
+  memset( & nodes[ node ], 0, sizeof( SimNode ));
+}
+
+static boolean hasChildren( int32_t dir )
+{
+  for( int32_t i = 1; i < nodeCount; i ++ )
+    if( nodes[ i ].name != NULL && nodes[ i ].parent == dir )
+      return true;
+  return false;
+}
+
+SimFile::SimFile()
+{
+  node = -1;
+}
+
+boolean SimFile::open( const char * path, int mode )
+{
+  return open( NULL, path, mode );
+}
+
+boolean SimFile::open( SimFile * dir, const char * path, int mode )
+{
+  int32_t from = dir == NULL || dir->node < 0 ? 0 : dir->node;
+  int32_t parent;
+  const char * last;
+
+  close();
+  int32_t n = find( from, path, & parent, & last );
+  if( n < 0 )
+  {
+    if( ! ( mode & O_CREAT ) || parent < 0 )
+      return false;
+    n = nodeNew( parent, last, strcspn( last, "/" ), false );
+    entryWrite( n );
+  }
+  else if( nodes[ n ].dir && ( mode & O_ACCMODE ) != O_RDONLY )
+    return false;
+  else if(( mode & O_TRUNC ) && nodes[ n ].size > 0 )
+  {
+    cacheForget( n );
+    nodes[ n ].size = 0;
+    nodes[ n ].alloc = 0;
+    entryWrite( n );
+  }
+  node = n;
+  pos = 0;
+  this->mode = mode;
+  written = false;
+  return true;
+}
+
+boolean SimFile::exists( const char * path )
+{
+  return node >= 0 && find( node, path ) >= 0;
+}
+
+// As SdFat, whole sectors go between the card and buffer, the others
+//   through the cache
+
+int SimFile::read( void * buffer, size_t size )
+{
+  if( node < 0 || nodes[ node ].dir )
+    return -1;
+  SimNode * n = & nodes[ node ];
+  if( pos >= n->size )
+    return 0;
+  if( size > n->size - pos )
+    size = n->size - pos;
+  for( uint32_t done = 0; done < size; )
+  {
+    uint32_t sector = ( pos + done ) / SIM_SECTOR_SIZE;
+    uint32_t offset = ( pos + done ) % SIM_SECTOR_SIZE;
+    uint32_t len = SIM_SECTOR_SIZE - offset;
+    if( len > size - done )
+      len = size - done;
+    if( len == SIM_SECTOR_SIZE &&
+        ! ( cacheNode == node && cacheSector == sector ))
+      cardRead();
+    else
+      cacheGet( node, sector, true );
+    done += len;
+  }
+  memcpy( buffer, n->data + pos, size );
+  pos += size;
+  return size;
+}
+
+int SimFile::write( const void * buffer, size_t size )
+{
+  if( node < 0 || ( mode & O_ACCMODE ) == O_RDONLY )
+    return -1;
+  clustersAlloc( node, pos + size );
+  for( uint32_t done = 0; done < size; )
+  {
+    uint32_t sector = ( pos + done ) / SIM_SECTOR_SIZE;
+    uint32_t offset = ( pos + done ) % SIM_SECTOR_SIZE;
+    uint32_t len = SIM_SECTOR_SIZE - offset;
+    if( len > size - done )
+      len = size - done;
+    if( len == SIM_SECTOR_SIZE )
+    {
+      if( cacheNode == node && cacheSector == sector )
+        cacheForget( node );
+      cardWrite();
+    }
+    else
+    {
+      // the sector is read first if it already holds data of the file
+      cacheGet( node, sector, sector * SIM_SECTOR_SIZE < nodes[ node ].size );
+      cacheDirty = true;
+    }
+    done += len;
+  }
+  if( pos + size > nodes[ node ].size )
+    nodeResize( node, pos + size );
+  memcpy( nodes[ node ].data + pos, buffer, size );
+  pos += size;
+  written = true;
+  return size;
+}
+
+boolean SimFile::seekSet( uint32_t pos )
+{
+  if( node < 0 || pos > nodes[ node ].size )
+    return false;
+  this->pos = pos;
+  return true;
+}
+
+// Allocating all clusters at once writes each sector of the FAT once
+
+boolean SimFile::preAllocate( uint32_t size )
+{
+  if( node < 0 || nodes[ node ].size > 0 )
+    return false;
+  uint32_t clusters = ( size + SIM_CLUSTER_SIZE - 1 ) / SIM_CLUSTER_SIZE;
+  nodes[ node ].alloc = clusters * SIM_CLUSTER_SIZE;
+  for( uint32_t i = 0; i < clusters; i += SIM_SECTOR_SIZE / 4 )
+    cardWrite();
+  return true;
+}
+
+boolean SimFile::truncate( uint32_t size )
+{
+  if( node < 0 || ( mode & O_ACCMODE ) == O_RDONLY || size > nodes[ node ].size )
+    return false;
+  nodes[ node ].size = size;
+  nodes[ node ].alloc = ( size + SIM_CLUSTER_SIZE - 1 ) / SIM_CLUSTER_SIZE
+                        * SIM_CLUSTER_SIZE;
+  if( pos > size )
+    pos = size;
+  written = true;
+  return true;
+}
+
+void SimFile::close()
+{
+  if( node >= 0 && written )
+    entryWrite( node );
+  node = -1;
+}
+
+uint32_t SimFile::fileSize()
+{
+  return node < 0 ? 0 : nodes[ node ].size;
+}
+
+boolean SimFile::isDir()
+{
+  return node >= 0 && nodes[ node ].dir;
+}
+
+SimDir::SimDir()
+{
+  node = -1;
+}
+
+boolean SimDir::openDir( const char * path )
+{
+  node = find( 0, path );
+  if( node >= 0 && ! nodes[ node ].dir )
+    node = -1;
+  next = 1;
+  slot = 0;
+  return node >= 0;
+}
+
+boolean SimDir::nextFile()
+{
+  if( node < 0 )
+    return false;
+  for( ; next < nodeCount; next ++ )
+  {
+    SimNode * n = & nodes[ next ];
+    if( n->name == NULL || n->parent != node )
+      continue;
+    uint32_t s = slots( n->name );
+    dirRead( node, slot, s );
+    slot += s;
+    strncpy( name, n->name, _MAX_LFN );
+    name[ _MAX_LFN ] = 0;
+    dirEntry = n->dir;
+    size = n->dir ? 0 : n->size;
+    modDate = n->modDate;
+    modTime = n->modTime;
+    next ++;
+    return true;
+  }
+  return false;
+}
+
+boolean SimFs::exists( const char * path )
+{
+  return find( 0, path ) >= 0;
+}
+
+boolean SimFs::isDir( const char * path )
+{
+  int32_t n = find( 0, path );
+  return n >= 0 && nodes[ n ].dir;
+}
+
+boolean SimFs::remove( const char * path )
+{
+  int32_t n = find( 0, path );
+  if( n <= 0 || nodes[ n ].dir )
+    return false;
+  entryWrite( n );
+  for( uint32_t i = 0; i < nodes[ n ].alloc; i += SIM_SECTOR_SIZE / 4 * SIM_CLUSTER_SIZE )
+    cardWrite();                      // FAT
+  nodeRemove( n );
+  return true;
+}
+
+boolean SimFs::mkdir( const char * path )
+{
+  int32_t parent;
+  const char * last;
+  if( find( 0, path, & parent, & last ) >= 0 || parent < 0 )
+    return false;
+  int32_t n = nodeNew( parent, last, strcspn( last, "/" ), true );
+  entryWrite( n );
+  cardWrite();                        // cluster of the new directory
+  cardWrite();                        // FAT
+  return true;
+}
+
+boolean SimFs::rmdir( const char * path )
+{
+  int32_t n = find( 0, path );
+  if( n <= 0 || ! nodes[ n ].dir || hasChildren( n ))
+    return false;
+  entryWrite( n );
+  cardWrite();                        // FAT
+  nodeRemove( n );
+  return true;
+}
+
+boolean SimFs::rename( const char * oldPath, const char * newPath )
+{
+  int32_t parent;
+  const char * last;
+  int32_t n = find( 0, oldPath );
+  if( n <= 0 || find( 0, newPath, & parent, & last ) >= 0 || parent < 0 )
+    return false;
+  for( int32_t p = parent; p > 0; p = nodes[ p ].parent )
+    if( p == n )
+      return false;                   // into itself
+  // the node moves to the end of its new directory
+  int32_t m = nodeNew( parent, last, strcspn( last, "/" ), nodes[ n ].dir );
+  char * name = nodes[ m ].name;
+  nodes[ m ] = nodes[ n ];
+  ::free( nodes[ m ].name );
+  nodes[ m ].name = name;
+  nodes[ m ].parent = parent;
+  for( int32_t i = 0; i < nodeCount; i ++ )
+    if( nodes[ i ].name != NULL && nodes[ i ].parent == n )
+      nodes[ i ].parent = m;
+  nodes[ n ].data = NULL;
+  nodeRemove( n );
+  entryWrite( m );
+  cardWrite();                        // old entry
+  return true;
+}
+
+boolean SimFs::timeStamp( const char * path, uint16_t year, uint8_t month, uint8_t day,
+                          uint8_t hour, uint8_t minute, uint8_t second )
+{
+  int32_t n = find( 0, path );
+  if( n < 0 )
+    return false;
+  entryWrite( n );
+  nodes[ n ].modDate = (( year - 1980 ) << 9 ) | ( month << 5 ) | day;
+  nodes[ n ].modTime = ( hour << 11 ) | ( minute << 5 ) | ( second >> 1 );
+  return true;
+}
+
+boolean SimFs::getFileModTime( const char * path, uint16_t * pdate, uint16_t * ptime )
+{
+  int32_t n = find( 0, path );
+  if( n < 0 )
+    return false;
+  * pdate = nodes[ n ].modDate;
+  * ptime = nodes[ n ].modTime;
+  return true;
+}
+
+uint32_t SimFs::free()
+{
+  uint64_t used = 0;
+  for( int32_t i = 0; i < nodeCount; i ++ )
+    used += nodes[ i ].alloc;
+  return simConfig.capacityMB - ( used >> 20 );
+}
+
+uint32_t SimFs::capacity()
+{
+  return simConfig.capacityMB;
+}
+
+boolean SimFs::create( const char * path, uint32_t size )
+{
+  SimFile f;
+  charge = false;
+  boolean ok = f.open( path, O_CREAT | O_WRITE | O_TRUNC );
+  if( ok )
+  {
+    nodeResize( f.node, size );
+    nodes[ f.node ].alloc = ( size + SIM_CLUSTER_SIZE - 1 ) / SIM_CLUSTER_SIZE
+                            * SIM_CLUSTER_SIZE;
+    for( uint32_t i = 0; i < size; i ++ )
+      nodes[ f.node ].data[ i ] = i * 7 % 251;
+    f.close();
+  }
+  charge = true;
+  return ok;
+}
+
+boolean SimFs::createDir( const char * path )
+{
+  charge = false;
+  boolean ok = mkdir( path );
+  charge = true;
+  return ok;
+}
+
+const uint8_t * SimFs::content( const char * path, uint32_t * size )
+{
+  charge = false;
+  int32_t n = find( 0, path );
+  charge = true;
+  if( n < 0 || nodes[ n ].dir )
+    return NULL;
+  * size = nodes[ n ].size;
+  return nodes[ n ].data;
+}
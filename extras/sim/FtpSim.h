@@ -0,0 +1,295 @@
+/*
+ * FTP Server - simulated hardware, for deterministic performance tests
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Stand-ins for the Arduino core, the Ethernet library and FatLib, which
+ *   model the time taken by the hardware instead of using it:
+ *     - the clock only moves when the simulation says so: each call of
+ *       service() costs simConfig.loopMicros, and the network and the card
+ *       add the time they take to the calls which wait for them
+ *     - connections go through a link of given bandwidth and round trip
+ *       time, with the socket buffers of the ethernet chip and the cost of
+ *       copying bytes to and from it over SPI
+ *     - files live in memory, each access to a sector of the card taking
+ *       the read or write latency of the card. As SdFat, partial sectors go
+ *       through a single sector cache
+ *
+ * Selected with -DFTP_BACKEND_HEADER='"extras/sim/FtpSim.h"' (see
+ *   FtpBackend.h). The same SimClient and SimServer are used on the side of
+ *   the client (side 1), so a test drives the server as a normal FTP client
+ *   and reads the time spent from simMicros(). See FtpSimTest.cpp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_SIM_H
+#define FTP_SIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+
+typedef bool boolean;
+
+#define F( s ) s
+
+#ifndef O_READ
+  #define O_READ  O_RDONLY
+#endif
+#ifndef O_WRITE
+  #define O_WRITE O_WRONLY
+#endif
+
+#define _MAX_LFN 255
+#define SIM_PATH_SIZE ( 2 * _MAX_LFN + 10 )
+
+// Sockets of the ethernet chip: W5500
+#ifndef MAX_SOCK_NUM
+  #define MAX_SOCK_NUM 8
+#endif
+
+#define SIM_SECTOR_SIZE 512
+#define SIM_MSS         1460          // bytes of a full TCP segment
+
+// Parameters of the simulated hardware. They may be changed between tests
+
+struct SimConfig
+{
+  uint32_t linkBps;                   // bandwidth of the link, bits/s
+  uint32_t rttMicros;                 // round trip time
+  uint16_t txBuffer;                  // socket buffers of the ethernet chip
+  uint16_t rxBuffer;
+  uint32_t peerBuffer;                // socket buffers of the client
+  uint32_t spiBytesPerSec;            // copies to and from the ethernet chip
+  uint32_t sectorReadMicros;          // card
+  uint32_t sectorWriteMicros;
+  uint32_t capacityMB;
+  uint32_t loopMicros;                // CPU time of one call of service()
+};
+
+extern SimConfig simConfig;
+
+void     simDefaults();               // W5500 on a 100 Mbit LAN, fast card
+void     simReset();                  // clock to 0, no connection, no file
+uint64_t simMicros();
+void     simAdvance( uint32_t us );   // let time pass
+void     simWaitUntil( uint64_t t );
+
+// Printing of the debug messages of the server (false by default)
+extern boolean simVerbose;
+
+uint32_t millis();
+uint32_t micros();
+
+/*******************************************************************************
+ **                                 OUTPUT                                     **
+ *******************************************************************************/
+
+// Minimal equivalent of class Print of the Arduino core
+
+class SimPrint
+{
+public:
+  virtual size_t write( const uint8_t * buffer, size_t size ) = 0;
+  size_t  write( const char * buffer, size_t size );
+  size_t  write( uint8_t c );
+
+  size_t  print( const char * s );
+  size_t  print( char c );
+  size_t  print( long n );
+  size_t  print( unsigned long n );
+  size_t  print( int n )            { return print((long) n ); }
+  size_t  print( unsigned int n )   { return print((unsigned long) n ); }
+  size_t  print( unsigned char n )  { return print((unsigned long) n ); }
+  size_t  println();
+  template< typename T >
+  size_t  println( T v )            { return print( v ) + println(); }
+};
+
+class SimSerial : public SimPrint
+{
+public:
+  using   SimPrint::write;
+  size_t  write( const uint8_t * buffer, size_t size );
+};
+
+extern SimSerial Serial;
+
+/*******************************************************************************
+ **                                NETWORK                                     **
+ *******************************************************************************/
+
+class IPAddress
+{
+public:
+  IPAddress();
+  IPAddress( uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3 );
+
+  uint8_t   operator[]( int i ) const { return bytes[ i ]; }
+  uint8_t & operator[]( int i )       { return bytes[ i ]; }
+  bool      operator==( const IPAddress & ip ) const
+              { return memcmp( bytes, ip.bytes, 4 ) == 0; }
+
+private:
+  uint8_t bytes[ 4 ];
+};
+
+// One end of a simulated connection. As EthernetClient, it is a handle:
+//   copies refer to the same socket, which is closed by stop()
+//
+// On side 0 (the server), write() waits, as the Ethernet library does,
+//   until the chip has room for all bytes, and each byte copied to or from
+//   the chip costs SPI time. On side 1 (the client), write() takes what
+//   fits in the socket and returns at once
+
+class SimClient : public SimPrint
+{
+public:
+  SimClient( uint8_t side = 0 );
+
+  using   SimPrint::write;
+  size_t  write( const uint8_t * buffer, size_t size );
+  int     available();
+  int     availableForWrite();
+  int     read();
+  int     read( uint8_t * buffer, size_t size );
+  uint8_t connected();
+  int     connect( IPAddress ip, uint16_t port );
+  int     connectStart( IPAddress ip, uint16_t port );
+  uint8_t connecting();
+  void    stop();
+  IPAddress localIP();
+  IPAddress remoteIP();
+  operator bool();
+
+private:
+  friend class SimServer;
+  struct SimConn * conn();
+
+  uint8_t  side;
+  int16_t  iConn;
+  uint16_t generation;
+};
+
+class SimServer
+{
+public:
+  SimServer( uint16_t port, uint8_t side = 0 );
+
+  void    begin();
+  void    stop();                     // stop listening
+  SimClient connected();              // return each new client once
+
+private:
+  uint16_t port;
+  uint8_t  side;
+};
+
+/*******************************************************************************
+ **                              FILE SYSTEM                                   **
+ *******************************************************************************/
+
+class SimFile
+{
+public:
+  SimFile();
+
+  boolean  open( const char * path, int mode = O_READ );
+  boolean  open( SimFile * dir, const char * path, int mode = O_READ );
+  boolean  exists( const char * path );
+  int      read( void * buffer, size_t size );
+  int      write( const void * buffer, size_t size );
+  boolean  seekSet( uint32_t pos );
+  boolean  preAllocate( uint32_t size );
+  boolean  truncate( uint32_t size );
+  void     close();
+  uint32_t fileSize();
+  boolean  isDir();
+
+private:
+  friend class SimFs;
+
+  int32_t  node;
+  uint32_t pos;
+  int      mode;
+  boolean  written;                   // directory entry to update at close
+};
+
+class SimDir
+{
+public:
+  SimDir();
+
+  boolean  openDir( const char * path );
+  boolean  nextFile();
+  void     closeDir()               { node = -1; }
+  boolean  isDir()                  { return dirEntry; }
+  uint32_t fileSize()               { return size; }
+  char *   fileName()               { return name; }
+  uint16_t fileModDate()            { return modDate; }
+  uint16_t fileModTime()            { return modTime; }
+
+private:
+  int32_t  node;                      // the directory
+  int32_t  next;                      // index of the next node to look at
+  uint32_t slot;                      // entries of the directory read
+  char     name[ _MAX_LFN + 1 ];
+  boolean  dirEntry;
+  uint32_t size;
+  uint16_t modDate, modTime;
+};
+
+class SimFs
+{
+public:
+  boolean  exists( const char * path );
+  boolean  isDir( const char * path );
+  boolean  remove( const char * path );
+  boolean  mkdir( const char * path );
+  boolean  rmdir( const char * path );
+  boolean  rename( const char * oldPath, const char * newPath );
+  boolean  timeStamp( const char * path, uint16_t year, uint8_t month, uint8_t day,
+                      uint8_t hour, uint8_t minute, uint8_t second );
+  boolean  getFileModTime( const char * path, uint16_t * pdate, uint16_t * ptime );
+  uint32_t free();                    // free space in MB
+  uint32_t capacity();                // size of the file system in MB
+
+  // Set up of the tests, at no cost in time: create a file of size bytes
+  //   (filled with a pattern), or a directory
+  boolean  create( const char * path, uint32_t size );
+  boolean  createDir( const char * path );
+  // Content of a file, NULL if it does not exist
+  const uint8_t * content( const char * path, uint32_t * size );
+};
+
+extern SimFs SIM_FS;
+
+/*******************************************************************************
+ **                          NAMES USED BY THE SERVER                          **
+ *******************************************************************************/
+
+#define FTP_NET_SERVER SimServer
+#define FTP_NET_CLIENT SimClient
+#define FTP_FS         SIM_FS
+#define FTP_FILE       SimFile
+#define FTP_DIR        SimDir
+
+#define FTP_LOCAL_IP( client ) ( client ).localIP()
+
+#define FTP_CWD_HANDLE 1
+
+#endif // FTP_SIM_H
@@ -0,0 +1,609 @@
+/*
+ * Performance tests of the FTP server on simulated hardware
+ * Copyright (c) 2014-2015 by Jean-Michel Gallego
+ *
+ * Each scenario sets the hardware (see FtpSim.h), drives the server as an
+ *   FTP client and checks the simulated throughput of transfers and the
+ *   latency of commands. The clock being simulated, the results are the
+ *   same on every run and on every machine, so a change of the server
+ *   which makes a scenario slower is caught by its bound.
+ *
+ * Build and run from the directory of the library:
+ *   g++ -O2 -I. -DFTP_BACKEND_HEADER='"extras/sim/FtpSim.h"' -o ftpsim \
+ *       extras/sim/FtpSimTest.cpp extras/sim/FtpSim.cpp FtpServer.cpp \
+ *       FtpCache.cpp FtpDeflate.cpp FtpMetrics.cpp FtpText.cpp
+ *   ./ftpsim [-v]
+ *
+ * -v prints the debugging messages of the server. The exit status is 1 if
+ *   a scenario is out of its bounds.
+ */
+
+#include "FtpServer.h"
+
+#include <stdarg.h>
+
+#define SIM_DATA_SIZE  4096           // bytes given to the data socket at once
+#define SIM_TIME_LIMIT 600000000ULL   // us; a scenario lasting more is stuck
+
+FtpServer ftpSrv;
+
+static SimClient  ctrl( 1 );          // control connection
+static char       rbuf[ 4096 ];       // data received on ctrl, not yet read
+static int        rlen;
+static char       line[ 1024 ];       // last line of the last reply
+static int        multiCode;          // code of the multi-line reply being read
+static uint64_t   limit;
+static uint8_t    data[ SIM_DATA_SIZE ];
+static const char * scenario;
+static int        failures = 0;
+
+static void fail( const char * what )
+{
+  printf( "%s: %s (last reply: %s)\n", scenario, what, line );
+  exit( 1 );
+}
+
+// Let the server run once
+
+static void step()
+{
+  ftpSrv.service();
+  simAdvance( simConfig.loopMicros );
+  if( simMicros() > limit )
+    fail( "no progress" );
+}
+
+// Read the reply, if it has come
+//
+// return:
+//    code of the reply, 0 if it is not complete
+
+static int pollReply()
+{
+  for( ;; )
+  {
+    char * eol = (char *) memchr( rbuf, '\n', rlen );
+    if( eol == NULL )
+    {
+      int nb = ctrl.read((uint8_t *) rbuf + rlen, sizeof( rbuf ) - rlen );
+      if( nb <= 0 )
+      {
+        if( ! ctrl.connected())
+          fail( "control connection closed" );
+        return 0;
+      }
+      rlen += nb;
+      continue;
+    }
+    int n = eol - rbuf + 1;
+    int l = n < (int) sizeof( line ) ? n : sizeof( line ) - 1;
+    memcpy( line, rbuf, l );
+    line[ l ] = 0;
+    memmove( rbuf, rbuf + n, rlen - n );
+    rlen -= n;
+    int code = atoi( line );
+    if( multiCode == 0 )
+    {
+      if( line[ 3 ] != '-' )
+        return code;
+      multiCode = code;
+    }
+    else if( code == multiCode && line[ 3 ] == ' ' )
+    {
+      multiCode = 0;
+      return code;
+    }
+  }
+}
+
+static int readReply()
+{
+  int code;
+  while(( code = pollReply()) == 0 )
+    step();
+  return code;
+}
+
+static void send( const char * fmt, ... )
+{
+  char    cmd[ 512 ];
+  va_list ap;
+  va_start( ap, fmt );
+  int n = vsnprintf( cmd, sizeof( cmd ) - 2, fmt, ap );
+  va_end( ap );
+  strcpy( cmd + n, "\r\n" );
+  if( ctrl.write((uint8_t *) cmd, n + 2 ) != (size_t) n + 2 )
+    fail( "can't send command" );
+}
+
+// Send a command and wait for its reply
+//
+// return:
+//    code of the reply; * us is set to the time until the reply
+
+static int command( uint32_t * us, const char * fmt, ... )
+{
+  char    cmd[ 512 ];
+  va_list ap;
+  va_start( ap, fmt );
+  vsnprintf( cmd, sizeof( cmd ), fmt, ap );
+  va_end( ap );
+  uint64_t t = simMicros();
+  send( "%s", cmd );
+  int code = readReply();
+  if( us != NULL )
+    * us = simMicros() - t;
+  return code;
+}
+
+static void expect( int code, const char * what )
+{
+  if( code / 100 != 2 && code / 100 != 3 )
+    fail( what );
+}
+
+// Open a data connection in passive mode
+
+static SimClient pasv()
+{
+  SimClient d( 1 );
+  if( command( NULL, "PASV" ) != 227 )
+    fail( "PASV" );
+  int h[ 6 ];
+  char * p = strchr( line, '(' );
+  if( p == NULL || sscanf( p, "(%d,%d,%d,%d,%d,%d)", h, h + 1, h + 2, h + 3,
+                           h + 4, h + 5 ) != 6 )
+    fail( "PASV reply" );
+  if( ! d.connectStart( IPAddress( h[ 0 ], h[ 1 ], h[ 2 ], h[ 3 ] ),
+                        h[ 4 ] * 256 + h[ 5 ] ))
+    fail( "data connection" );
+  while( d.connecting())
+    step();
+  return d;
+}
+
+// Send cmd, which transfers data from the server, and read them. If check
+//   is true, they must be the pattern of the files of SimFs::create()
+//
+// return:
+//    number of bytes received; * us is set to the time from the command to
+//    the end of the transfer
+
+static uint32_t receive( const char * cmd, boolean check, uint32_t * us )
+{
+  SimClient d = pasv();
+  uint64_t  t = simMicros();
+  uint32_t  total = 0;
+  boolean   open = true;
+  int       code = 0;
+
+  send( "%s", cmd );
+  while( open || code == 0 || code == 150 )
+  {
+    int nb;
+    while(( nb = d.read( data, sizeof( data ))) > 0 )
+    {
+      for( int i = 0; check && i < nb; i ++ )
+        if( data[ i ] != ( total + i ) * 7 % 251 )
+          fail( "wrong data received" );
+      total += nb;
+    }
+    if( open && ! d.connected())
+    {
+      d.stop();
+      open = false;
+    }
+    int c = pollReply();
+    if( c != 0 )
+      code = c;
+    if( code >= 400 )
+      fail( cmd );
+    step();
+  }
+  * us = simMicros() - t;
+  return total;
+}
+
+// Upload a file of size bytes, with the pattern of SimFs::create()
+//
+// return:
+//    time from the command to the end of the transfer (us)
+
+static uint32_t store( const char * name, uint32_t size )
+{
+  SimClient d = pasv();
+  uint64_t  t = simMicros();
+  uint32_t  done = 0;
+
+  send( "STOR %s", name );
+  if( readReply() != 150 )
+    fail( "STOR" );
+  while( done < size )
+  {
+    uint32_t n = size - done < sizeof( data ) ? size - done : sizeof( data );
+    for( uint32_t i = 0; i < n; i ++ )
+      data[ i ] = ( done + i ) * 7 % 251;
+    n = d.write( data, n );
+    done += n;
+    if( n == 0 )
+      step();
+  }
+  d.stop();
+  expect( readReply(), "STOR" );
+  uint32_t us = simMicros() - t;
+
+  uint32_t len;
+  const uint8_t * content = SIM_FS.content( name, & len );
+  if( content == NULL || len != size )
+    fail( "wrong size of stored file" );
+  for( uint32_t i = 0; i < size; i ++ )
+    if( content[ i ] != i * 7 % 251 )
+      fail( "wrong data stored" );
+  return us;
+}
+
+/*******************************************************************************
+ **                               SCENARIOS                                    **
+ *******************************************************************************/
+
+// Start the server on the hardware of simConfig and log in
+
+static void begin( const char * name )
+{
+  scenario = name;
+  rlen = 0;
+  multiCode = 0;
+  line[ 0 ] = 0;
+  limit = simMicros() + SIM_TIME_LIMIT;
+  ftpSrv.init();
+  if( ! ctrl.connect( IPAddress( 192, 168, 1, 10 ), FTP_CTRL_PORT ))
+    fail( "can't connect to server" );
+  expect( readReply(), "welcome" );
+  expect( command( NULL, "USER %s", FTP_USER ), "USER" );
+  expect( command( NULL, "PASS %s", FTP_PASS ), "PASS" );
+  expect( command( NULL, "TYPE I" ), "TYPE" );
+}
+
+static void end()
+{
+  command( NULL, "QUIT" );
+  ctrl.stop();
+  // let the session close
+  for( int i = 0; i < 100; i ++ )
+    step();
+}
+
+// Print a result and compare it to its bounds
+
+static void check( const char * what, double value, const char * unit,
+                   double min, double max )
+{
+  boolean ok = value >= min && value <= max;
+  printf( "%-44s %10.1f %-5s [%g, %g] %s\n", what, value, unit, min, max,
+          ok ? "ok" : "FAILED" );
+  if( ! ok )
+    failures ++;
+}
+
+static void checkRetr( const char * path, uint32_t size, double min, double max )
+{
+  char cmd[ 64 ];
+  uint32_t us;
+  snprintf( cmd, sizeof( cmd ), "RETR %s", path );
+  if( receive( cmd, true, & us ) != size )
+    fail( "RETR size" );
+  check( scenario, size / 1.024 / us * 1000, "kB/s", min, max );
+}
+
+static void checkStor( const char * path, uint32_t size, double min, double max )
+{
+  uint32_t us = store( path, size );
+  check( scenario, size / 1.024 / us * 1000, "kB/s", min, max );
+}
+
+// The bottleneck is the window: 2 KB of socket buffer per round trip,
+//   that is 100 kB/s, below the link (244 kB/s) and the card (167 kB/s)
+
+static void retrSlowLink()
+{
+  simReset();
+  simDefaults();
+  simConfig.linkBps = 2000000;
+  simConfig.rttMicros = 20000;
+  simConfig.sectorReadMicros = 3000;
+  SIM_FS.create( "/big.bin", 1UL << 20 );
+  begin( "RETR 1 MB, 2 Mbit/s, RTT 20 ms, card 3 ms" );
+  checkRetr( "big.bin", 1UL << 20, 75, 100 );
+  end();
+}
+
+// On a LAN, the processor is the bottleneck: it copies each byte to the
+//   chip (2 MB/s) and waits for the card (1.7 MB/s)
+
+static void retrLan()
+{
+  simReset();
+  simDefaults();
+  SIM_FS.create( "/big.bin", 1UL << 20 );
+  begin( "RETR 1 MB, 100 Mbit/s, RTT 0.2 ms" );
+  checkRetr( "big.bin", 1UL << 20, 800, 1 / ( 1 / 1953.0 + 1 / 1667.0 ));
+  end();
+}
+
+// Each sector written costs 5 ms: 100 kB/s at most
+
+static void storSlowCard()
+{
+  simReset();
+  simDefaults();
+  simConfig.linkBps = 10000000;
+  simConfig.rttMicros = 1000;
+  simConfig.sectorWriteMicros = 5000;
+  begin( "STOR 1 MB, 10 Mbit/s, card writes 5 ms" );
+  checkStor( "up.bin", 1UL << 20, 85, 97.7 );
+  end();
+}
+
+static void storLan()
+{
+  simReset();
+  simDefaults();
+  begin( "STOR 1 MB, 100 Mbit/s, RTT 0.2 ms" );
+  checkStor( "up.bin", 1UL << 20, 520, 1 / ( 1 / 1953.0 + 1 / 833.0 ));
+  end();
+}
+
+// A limit of the bandwidth of a session holds on a fast network
+
+static void retrRateLimit()
+{
+  simReset();
+  simDefaults();
+  SIM_FS.create( "/big.bin", 1UL << 20 );
+  begin( "RETR 1 MB, session limited to 50 kB/s" );
+  ftpSrv.setRateLimits( 0, 0, 51200, 0 );
+  checkRetr( "big.bin", 1UL << 20, 49, 50.5 );
+  end();
+}
+
+// In TYPE A, the conversion of line ends must not slow down the transfer
+//   of the pattern of SimFs::create(), where 1 byte in 251 is a LF
+
+static void retrText()
+{
+  simReset();
+  simDefaults();
+  SIM_FS.create( "/big.bin", 1UL << 20 );
+  uint32_t size = 1UL << 20;
+  for( uint32_t i = 1; i < ( 1UL << 20 ); i ++ )
+    if( i * 7 % 251 == '\n' && ( i - 1 ) * 7 % 251 != '\r' )
+      size ++;
+  begin( "RETR 1 MB in TYPE A, 100 Mbit/s" );
+  expect( command( NULL, "TYPE A" ), "TYPE" );
+  uint32_t us;
+  if( receive( "RETR big.bin", false, & us ) != size )
+    fail( "RETR size in TYPE A" );
+  check( scenario, size / 1.024 / us * 1000, "kB/s",
+         800, 1 / ( 1 / 1953.0 + 1 / 1667.0 ));
+  end();
+}
+
+// Commands answered at once take a round trip; those reading the card
+//   a few sectors more
+
+static void commandLatency()
+{
+  uint32_t us;
+  char     what[ 64 ];
+  const char * cmds[] = { "NOOP", "PWD", "SIZE d/f9", "MDTM d/f9", "CWD /d" };
+  const double maxMs[] = { 21, 21, 35, 29, 26 };
+
+  simReset();
+  simDefaults();
+  simConfig.rttMicros = 20000;
+  simConfig.sectorReadMicros = 3000;
+  SIM_FS.createDir( "/d" );
+  for( int i = 0; i < 10; i ++ )
+  {
+    snprintf( what, sizeof( what ), "/d/f%d", i );
+    SIM_FS.create( what, 1000 );
+  }
+  begin( "Commands, RTT 20 ms, card 3 ms" );
+  for( uint8_t c = 0; c < sizeof( cmds ) / sizeof( cmds[ 0 ] ); c ++ )
+  {
+    expect( command( & us, "%s", cmds[ c ] ), cmds[ c ] );
+    snprintf( what, sizeof( what ), "%s, RTT 20 ms, card 3 ms", cmds[ c ] );
+    check( what, us / 1000.0, "ms", 20, maxMs[ c ] );
+  }
+  end();
+}
+
+// REST past the end of a file is refused before any data connection; REST
+//   inside it sends the rest of the file
+
+static void restPastEnd()
+{
+  uint32_t us;
+
+  simReset();
+  simDefaults();
+  SIM_FS.create( "/small.bin", 11 );
+  begin( "REST past end of file" );
+  expect( command( NULL, "REST 5000" ), "REST" );
+  check( "RETR after REST 5000, 11 bytes file: reply",
+         command( NULL, "RETR small.bin" ), "", 554, 554 );
+  expect( command( NULL, "REST 5000" ), "REST" );
+  check( "STOR after REST 5000, 11 bytes file: reply",
+         command( NULL, "STOR small.bin" ), "", 554, 554 );
+  expect( command( NULL, "REST 6" ), "REST" );
+  check( "RETR after REST 6, 11 bytes file: bytes",
+         receive( "RETR small.bin", false, & us ), "", 5, 5 );
+  end();
+}
+
+// A listing reads each sector of the directory: 200 entries with long
+//   names take 200 * 3 * 32 bytes, 38 sectors
+
+static void listSlowCard()
+{
+  char     path[ 64 ];
+  uint32_t us;
+
+  simReset();
+  simDefaults();
+  simConfig.sectorReadMicros = 3000;
+  SIM_FS.createDir( "/d" );
+  for( int i = 0; i < 200; i ++ )
+  {
+    snprintf( path, sizeof( path ), "/d/file_%05d.txt", i );
+    SIM_FS.create( path, i );
+  }
+  begin( "LIST 200 entries, card 3 ms" );
+  expect( command( NULL, "CWD /d" ), "CWD" );
+  receive( "LIST", false, & us );
+  check( scenario, us / 1000.0, "ms", 114, 130 );
+  end();
+}
+
+// Wait for a line of client c beginning with code and a space, as the
+//   last line of a reply
+//
+// return:
+//    time waited (us)
+
+static uint32_t waitCode( SimClient & c, const char * code )
+{
+  static char text[ 1024 ];
+  static int  len = 0;
+  uint64_t    t = simMicros();
+
+  for( ;; )
+  {
+    int nb = c.read((uint8_t *) text + len, sizeof( text ) - 1 - len );
+    if( nb > 0 )
+      len += nb;
+    text[ len ] = 0;
+    for( char * l = text; l != NULL && * l != 0; )
+    {
+      char * eol = strchr( l, '\n' );
+      if( eol == NULL )
+        break;
+      if( ! strncmp( l, code, 3 ) && l[ 3 ] == ' ' )
+      {
+        len = 0;
+        return simMicros() - t;
+      }
+      l = eol + 1;
+    }
+    if( len > (int) sizeof( text ) / 2 )
+      len = 0;
+    step();
+  }
+}
+
+// A client which does not read its listing holds back its own session
+//   only: another client is welcomed and served meanwhile, then the
+//   listing comes whole once it is read
+
+static void listNotRead()
+{
+  char      path[ 64 ];
+  SimClient other( 1 );
+  uint32_t  n = 0;
+
+  simReset();
+  simDefaults();
+  SIM_FS.createDir( "/d" );
+  for( int i = 0; i < 8000; i ++ )
+  {
+    snprintf( path, sizeof( path ), "/d/file_%05d.txt", i );
+    SIM_FS.create( path, i );
+  }
+  begin( "LIST not read" );
+  expect( command( NULL, "CWD /d" ), "CWD" );
+  SimClient d = pasv();
+  if( command( NULL, "NLST" ) != 150 )
+    fail( "NLST" );
+  for( int i = 0; i < 1000; i ++ )
+    step();
+  if( ! other.connect( IPAddress( 192, 168, 1, 10 ), FTP_CTRL_PORT ))
+    fail( "can't connect second client" );
+  check( "Welcome while a listing is not read", waitCode( other, "220" ) / 1000.0,
+         "ms", 0, 1 );
+  other.write((const uint8_t *) "QUIT\r\n", 6 );
+  waitCode( other, "221" );
+  other.stop();
+
+  while( d.connected())
+  {
+    int nb;
+    while(( nb = d.read( data, sizeof( data ))) > 0 )
+      for( int i = 0; i < nb; i ++ )
+        n += data[ i ] == '\n';
+    step();
+  }
+  d.stop();
+  expect( readReply(), "NLST" );
+  check( "Lines of the listing read afterwards", n, "", 8000, 8000 );
+  end();
+}
+
+// ABOR sent in a row after a command held back by a RETR runs at once,
+//   before the end of the transfer, then the held command
+
+static void abortBehindHeld()
+{
+  int      code;
+  uint32_t total = 0;
+
+  simReset();
+  simDefaults();
+  simConfig.linkBps = 2000000;
+  SIM_FS.create( "/big.bin", 1UL << 20 );
+  begin( "ABOR behind a held command" );
+  SimClient d = pasv();
+  if( command( NULL, "RETR big.bin" ) != 150 )
+    fail( "RETR" );
+  for( int i = 0; i < 1000; i ++ )
+    step();
+  uint64_t t = simMicros();
+  send( "PWD\r\nABOR" );
+  while(( code = pollReply()) == 0 )
+  {
+    int nb;
+    while(( nb = d.read( data, sizeof( data ))) > 0 )
+      total += nb;
+    step();
+  }
+  d.stop();
+  check( "Reply to ABOR held behind PWD", code, "", 426, 426 );
+  check( "Time to abort, 2 Mbit/s", ( simMicros() - t ) / 1000.0, "ms", 0, 20 );
+  if( total >= ( 1UL << 20 ))
+    fail( "RETR not aborted" );
+  code = readReply();
+  check( "Replies after ABOR: end of ABOR, then PWD",
+         code * 1000 + readReply(), "", 226257, 226257 );
+  end();
+}
+
+int main( int argc, char ** argv )
+{
+  simVerbose = argc > 1 && strcmp( argv[ 1 ], "-v" ) == 0;
+  setvbuf( stdout, NULL, _IOLBF, 0 );
+
+  retrSlowLink();
+  retrLan();
+  storSlowCard();
+  storLan();
+  retrRateLimit();
+  retrText();
+  commandLatency();
+  listSlowCard();
+  restPastEnd();
+  listNotRead();
+  abortBehindHeld();
+
+  if( failures > 0 )
+    printf( "%d results out of bounds\n", failures );
+  return failures > 0;
+}